@@ -2,8 +2,10 @@
 #define JETEX_SERVER_H
 #include <stdint.h>
 #include <stddef.h>
+#include <sys/socket.h>
 
 struct jetex_namespace;
+struct jetex_runtime;
 struct jetex_table;
 
 struct jetex_namespace *
@@ -20,6 +22,43 @@ struct jetex_table *
 jetex_table_create(const uint8_t uuid[static 16],
     const int *restrict fds, uint64_t *restrict refcounts, size_t n_fd);
 
+/* Back fragments with transparent huge pages (best effort). */
+#define JETEX_TABLE_HUGE_PAGES 0x1U
+/* Fault every fragment page in before returning. */
+#define JETEX_TABLE_PREFAULT 0x2U
+/* Lock fragments in memory; implies JETEX_TABLE_PREFAULT. */
+#define JETEX_TABLE_MLOCK 0x4U
+/*
+ * Give each NUMA node its own copy of fragments of up to
+ * numa_max_bytes (0: all) in anonymous memory; serving threads look
+ * up through their node's copies.
+ */
+#define JETEX_TABLE_NUMA 0x8U
+
+/*
+ * How jetex_table_create_options maps fragments; all zeroes is the
+ * same as jetex_table_create.  Fragments on hugetlbfs always get huge
+ * pages, but their table_size must be a multiple of the page size.
+ */
+struct jetex_table_options {
+	uint32_t flags; /* JETEX_TABLE_*. */
+	uint32_t n_thread; /* prefault threads, including the caller. */
+	/* If non-NULL, called from the calling thread while prefaulting. */
+	void (*progress)(void *context, uint64_t done_bytes,
+	    uint64_t total_bytes);
+	void *progress_context;
+	uint64_t numa_max_bytes; /* for JETEX_TABLE_NUMA. */
+};
+
+/*
+ * NULL options -> defaults.  Fails if JETEX_TABLE_MLOCK can't lock, or
+ * JETEX_TABLE_NUMA can't allocate a copy on some node.
+ */
+struct jetex_table *
+jetex_table_create_options(const uint8_t uuid[static 16],
+    const int *restrict fds, uint64_t *restrict refcounts, size_t n_fd,
+    const struct jetex_table_options *options);
+
 void
 jetex_table_destroy(struct jetex_table *table);
 
@@ -27,4 +66,63 @@ void
 jetex_serve(const struct jetex_namespace *ns,
     double deadline, /* seconds since epoch. */
     const int *fds, size_t n_fd);
+
+/*
+ * Packs single-key responses for the same destination back to back,
+ * in datagrams of at most mtu bytes of payload.  0 (the default)
+ * disables coalescing: clients must split datagrams on each record's
+ * jetex_header.len before enabling this.  Applies to all serving
+ * threads, starting with their next batch.
+ */
+void
+jetex_serve_set_coalesce_mtu(size_t mtu);
+
+/* Process-wide counts of requests dropped without a reply. */
+struct jetex_serve_stats {
+	uint64_t expired; /* past their jetex_header deadline. */
+	uint64_t malformed; /* failed to decode. */
+};
+
+void
+jetex_serve_stats(struct jetex_serve_stats *OUT_stats);
+
+/*
+ * Thread-per-core serving: one SO_REUSEPORT socket bound to addr and
+ * one pinned worker thread per CPU in cpus[0 ... n_cpu - 1] (every
+ * CPU in the caller's affinity mask if cpus is NULL).  The kernel
+ * steers each datagram to the socket of the CPU that received it.
+ */
+struct jetex_runtime *
+jetex_runtime_create(const struct jetex_namespace *ns,
+    const struct sockaddr *addr, socklen_t addr_len,
+    const int *cpus, size_t n_cpu);
+
+void
+jetex_runtime_destroy(struct jetex_runtime *runtime);
+
+size_t
+jetex_runtime_n_worker(const struct jetex_runtime *runtime);
+
+/* CPU worker i is pinned to. */
+int
+jetex_runtime_worker_cpu(const struct jetex_runtime *runtime, size_t i);
+
+/* Socket worker i serves. */
+int
+jetex_runtime_worker_fd(const struct jetex_runtime *runtime, size_t i);
+
+/* Serves until deadline (seconds since epoch).  0 -> ok. */
+int
+jetex_runtime_serve(struct jetex_runtime *runtime, double deadline);
+
+/*
+ * Atomically switches the runtime's workers to ns, and waits until
+ * none of them can still be looking at the previous namespace (or its
+ * tables' fragments).  Returns that previous namespace: the caller may
+ * then destroy it, and any table that isn't also in ns.  Safe to call
+ * while jetex_runtime_serve is running in another thread.
+ */
+const struct jetex_namespace *
+jetex_runtime_publish(struct jetex_runtime *runtime,
+    const struct jetex_namespace *ns);
 #endif /* !JETEX_SERVER_H */
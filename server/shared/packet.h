@@ -20,6 +20,11 @@ struct jetex_header {
 	uint32_t expiry;
 } __attribute__((__packed__));
 
+/*
+ * A response datagram may hold several type 1 and 3 records back to
+ * back, when the server coalesces replies for the same destination:
+ * each record's header.len covers that record only.
+ */
 struct jetex_response_header {
 	/*
 	 * type is odd.
@@ -70,16 +75,236 @@ struct jetex_header_missing {
 	struct jetex_response_header header;
 } __attribute__((__packed__));
 
+/*
+ * Multi-key lookups: many keys, for one or several tables, in one
+ * datagram.  Replies are one or more type 5 datagrams with the same
+ * correlation key, and one record per key, identified by its index in
+ * the request.  Records may be spread over several replies, in any
+ * order.  A found value too large for any reply gets a record with
+ * length JETEX_MULTI_OVERSIZED instead.  Keys without a record were
+ * dropped: the server ran out of replies for the request, or replies
+ * were lost.
+ */
+#define JETEX_MULTI_MAX_LEN 32767
+
+/* Tag bit for multi-lookup records: a table UUID precedes the key. */
+#define JETEX_MULTI_TABLE 0x4U
+/* Record flag in multi-response value lengths: the key was found. */
+#define JETEX_MULTI_FOUND 0x8000U
+/*
+ * Multi-response value length of a found key whose value doesn't fit
+ * in a reply; no value follows.  No real value is that long.
+ */
+#define JETEX_MULTI_OVERSIZED 0xFFFFU
+
+struct jetex_header_multi_lookup {
+	/*
+	 * type is 4.
+	 * extra is as for jetex_header_lookup.
+	 */
+	struct jetex_header header;
+	/* correlation key. */
+	/* destination section: 0, 6, or 18 bytes */
+	/*
+	 * records, until len:
+	 *  1 byte tag: low 2 bits are the key size (0: 8 bytes ... 3:
+	 *   64 bytes); JETEX_MULTI_TABLE if a table UUID follows, else
+	 *   the key is for the previous record's table.  The first
+	 *   record must have a UUID.  Other bits must be 0.
+	 *  table UUID (16 bytes), if tagged.
+	 *  key.
+	 */
+	char data[JETEX_MULTI_MAX_LEN - sizeof(struct jetex_header)];
+} __attribute__((__packed__));
+
+struct jetex_header_multi_response {
+	/*
+	 * type is 5.
+	 * extra's low 4 bits are the correlation key size - 1, in
+	 * uint64_t; high 4 bits are 0.
+	 */
+	struct jetex_header header;
+	/* correlation key. */
+	/*
+	 * records, until len:
+	 *  LE uint16_t index of the key in the request.
+	 *  LE uint16_t value length, | JETEX_MULTI_FOUND if found;
+	 *   or JETEX_MULTI_OVERSIZED.
+	 *  value.
+	 */
+	char data[JETEX_MULTI_MAX_LEN - sizeof(struct jetex_header)];
+} __attribute__((__packed__));
+
+/*
+ * Range scans: every key in a table whose first word is in [start[0],
+ * end], from start on, in key order.  A prefix query sets start to
+ * the prefix followed by zero bits, and end to the prefix followed by
+ * one bits.  The server replies with up to limit records, over one or
+ * more type 7 datagrams numbered from 0; the last one has
+ * JETEX_SCAN_LAST, and, if the range goes on, JETEX_SCAN_MORE and the
+ * next key, to send as start in a new request.  A key whose value is
+ * too large for any reply, or can't be read, gets a record with length
+ * JETEX_SCAN_OVERSIZED instead.  The server may stop early (with
+ * JETEX_SCAN_MORE) after a few such records.
+ */
+#define JETEX_SCAN_MAX_LEN 32767
+
+/* Scan response flags. */
+#define JETEX_SCAN_LAST 0x1U
+#define JETEX_SCAN_MORE 0x2U
+/*
+ * Scan-response value length of a key whose value isn't sent; no
+ * value follows.  No real value is that long.
+ */
+#define JETEX_SCAN_OVERSIZED 0xFFFFU
+
+struct jetex_header_scan {
+	/*
+	 * type is 6.
+	 * extra is as for jetex_header_lookup.
+	 */
+	struct jetex_header header;
+	/* correlation key. */
+	/* destination section: 0, 6, or 18 bytes */
+	/* table UUID (16 bytes). */
+	/* 1 byte tag: low 2 bits are the key size, other bits are 0. */
+	/* LE uint16_t limit: max records, 0 for the server's default. */
+	/* LE uint64_t end: last key[0] to return. */
+	/* start key. */
+	char data[128 + 18 + 16 + 1 + 2 + 8 + 64];
+} __attribute__((__packed__));
+
+struct jetex_header_scan_response {
+	/*
+	 * type is 7.
+	 * extra's low 4 bits are the correlation key size - 1, in
+	 * uint64_t; high 4 bits are the key size, as for
+	 * jetex_response_header.
+	 */
+	struct jetex_header header;
+	/* correlation key. */
+	/* LE uint16_t sequence number, from 0. */
+	/* LE uint16_t flags. */
+	/* next key, with JETEX_SCAN_MORE; zeros otherwise. */
+	/*
+	 * records, until len:
+	 *  key.
+	 *  LE uint16_t value length, or JETEX_SCAN_OVERSIZED.
+	 *  value.
+	 */
+	char data[JETEX_SCAN_MAX_LEN - sizeof(struct jetex_header)];
+} __attribute__((__packed__));
+
+/* Decoded scan request. */
+struct jetex_scan {
+	const void *base_data;
+	struct sockaddr_storage dst;
+	size_t dstlen;
+	uint32_t correlation_key_offset; /* from base_data. */
+	uint32_t correlation_key_length;
+	uint32_t key_length; /* 8, 16, 32 or 64 bytes. */
+	uint32_t limit;
+	uint64_t end;
+	uint8_t table_uuid[16];
+	uint64_t start[8];
+} __attribute__((__packed__));
+
+/* Decoded scan response; iterate over records with _next. */
+struct jetex_scan_response {
+	const void *base_data;
+	uint32_t correlation_key_offset; /* from base_data. */
+	uint32_t correlation_key_length;
+	uint32_t key_length;
+	uint16_t sequence;
+	uint16_t flags;
+	uint32_t next_key_offset; /* from base_data. */
+	uint32_t next_offset; /* from base_data. */
+	uint32_t end_offset;
+} __attribute__((__packed__));
+
+struct jetex_scan_record {
+	const void *key;
+	const void *value;
+	size_t value_len;
+	uint32_t oversized; /* 1 if not sent; value_len is 0. */
+	uint32_t padding;
+};
+
+/* One key in a multi-key lookup, for jetex_packet_multi_lookup_encode. */
+struct jetex_multi_key {
+	const uint8_t *table; /* 16 bytes. */
+	const void *key;
+	size_t key_len; /* 8, 16, 32 or 64 bytes. */
+};
+
+/* Decoded multi-key lookup; iterate over keys with _next. */
+struct jetex_multi_lookup {
+	const void *base_data;
+	struct sockaddr_storage dst;
+	size_t dstlen;
+	uint32_t correlation_key_offset; /* from base_data. */
+	uint32_t correlation_key_length;
+	uint32_t n_keys;
+	/* Iteration state. */
+	uint32_t next_offset; /* from base_data. */
+	uint32_t end_offset;
+	uint32_t next_index;
+	uint8_t table_uuid[16];
+} __attribute__((__packed__));
+
+struct jetex_multi_lookup_key {
+	uint32_t index;
+	uint32_t key_length;
+	uint8_t table_uuid[16];
+	uint64_t key[8];
+} __attribute__((__packed__));
+
+/* Decoded multi-key response; iterate over records with _next. */
+struct jetex_multi_response {
+	const void *base_data;
+	uint32_t correlation_key_offset; /* from base_data. */
+	uint32_t correlation_key_length;
+	uint32_t next_offset; /* from base_data. */
+	uint32_t end_offset;
+} __attribute__((__packed__));
+
+struct jetex_multi_record {
+	uint32_t index;
+	uint32_t found; /* 1 if found, 0 if missing. */
+	uint32_t oversized; /* 1 if found but not sent; value_len is 0. */
+	uint32_t padding;
+	const void *value;
+	size_t value_len;
+};
+
 struct jetex_lookup {
 	const void *base_data; /* pointer to the bytes we're decoding. */
 	struct sockaddr_storage dst;
 	size_t dstlen;
 	uint32_t correlation_key_offset; /* from base_data. */
 	uint32_t correlation_key_length;
+	uint32_t key_length; /* 8, 16, 32 or 64 bytes. */
 	uint8_t table_uuid[16];
 	uint64_t key[8];
 } __attribute__((__packed__));
 
+/*
+ * Decoded single-key response (type 1 or 3): the first record of a
+ * datagram, which may hold more after record_length bytes.
+ */
+struct jetex_response {
+	const void *base_data;
+	uint32_t correlation_key_offset; /* from base_data. */
+	uint32_t correlation_key_length;
+	uint32_t key_offset; /* from base_data. */
+	uint32_t key_length; /* 8, 16, 32 or 64 bytes. */
+	uint32_t value_offset; /* from base_data. */
+	uint32_t value_length; /* 0 if missing. */
+	uint32_t record_length;
+	uint32_t found; /* 1 for type 1, 0 for type 3. */
+	uint8_t table_uuid[16];
+} __attribute__((__packed__));
+
 static inline void
 jetex_packet_set_ttl(struct jetex_header *header, uint8_t ttl)
 {
@@ -143,4 +368,140 @@ jetex_packet_found_encode(struct jetex_header_found *restrict dst,
     const void *restrict correlation, size_t correlation_len,
     const uint8_t table[static 16], const void *restrict key, size_t key_len,
     size_t value_len);
+
+/*
+ * Decodes and validates the first record in packet; 0 on success.
+ * Coalesced datagrams hold more records after record_length bytes.
+ */
+int
+jetex_packet_response_decode(struct jetex_response *restrict dst,
+    const void *restrict packet, size_t packet_len);
+
+/*
+ * Encodes as many of keys[0 ... n - 1] as fit in one datagram, and
+ * stores that count in OUT_n_encoded.  Returns the datagram's length,
+ * or -1 if even the first key doesn't fit or an argument is invalid.
+ */
+ssize_t
+jetex_packet_multi_lookup_encode(struct jetex_header_multi_lookup *restrict dst,
+    const void *restrict correlation, size_t correlation_len,
+    const struct sockaddr *restrict addr, socklen_t addr_len,
+    const struct jetex_multi_key *restrict keys, size_t n,
+    size_t *restrict OUT_n_encoded);
+
+/* Decodes and validates all of packet; 0 on success. */
+int
+jetex_packet_multi_lookup_decode(struct jetex_multi_lookup *restrict dst,
+    const void *restrict packet, size_t packet_len,
+    const struct sockaddr *restrict src, socklen_t srclen);
+
+/* Decodes the next key: 1 -> key, 0 -> done. */
+int
+jetex_packet_multi_lookup_next(struct jetex_multi_lookup *restrict lookup,
+    struct jetex_multi_lookup_key *restrict key);
+
+/* Starts a response without any record.  Returns the current length. */
+ssize_t
+jetex_packet_multi_response_init(struct jetex_header_multi_response *restrict dst,
+    const void *restrict correlation, size_t correlation_len);
+
+/*
+ * Appends a record for the key at index: a NULL value means missing.
+ * Returns the new length, or -1 (and leaves dst as is) if the record
+ * doesn't fit.
+ */
+ssize_t
+jetex_packet_multi_response_add(struct jetex_header_multi_response *restrict dst,
+    uint32_t index, const void *restrict value, size_t value_len);
+
+/*
+ * Appends a found record for the key at index, and returns where the
+ * caller must write its value_len-byte value (e.g., to decompress it
+ * in place); NULL (and leaves dst as is) if the record doesn't fit.
+ */
+void *
+jetex_packet_multi_response_reserve(struct jetex_header_multi_response *restrict dst,
+    uint32_t index, size_t value_len);
+
+/* Largest value a record fits in an otherwise empty response like dst. */
+size_t
+jetex_packet_multi_response_max_value(const struct jetex_header_multi_response *dst)
+    __attribute__((__pure__));
+
+/*
+ * Appends a JETEX_MULTI_OVERSIZED record for the key at index.
+ * Returns the new length, or -1 (and leaves dst as is) if it doesn't
+ * fit.
+ */
+ssize_t
+jetex_packet_multi_response_add_oversized(struct jetex_header_multi_response *restrict dst,
+    uint32_t index);
+
+/* Decodes and validates all of packet; 0 on success. */
+int
+jetex_packet_multi_response_decode(struct jetex_multi_response *restrict dst,
+    const void *restrict packet, size_t packet_len);
+
+/* Decodes the next record: 1 -> record, 0 -> done. */
+int
+jetex_packet_multi_response_next(struct jetex_multi_response *restrict response,
+    struct jetex_multi_record *restrict record);
+
+ssize_t
+jetex_packet_scan_encode(struct jetex_header_scan *restrict dst,
+    const void *restrict correlation, size_t correlation_len,
+    const struct sockaddr *restrict addr, socklen_t addr_len,
+    const uint8_t table[static 16], const void *restrict start, size_t key_len,
+    uint64_t end, uint16_t limit);
+
+int
+jetex_packet_scan_decode(struct jetex_scan *restrict dst,
+    const void *restrict packet, size_t packet_len,
+    const struct sockaddr *restrict src, socklen_t srclen);
+
+/*
+ * Starts datagram number sequence of a scan response, without any record, for
+ * key_len-byte keys.  Returns the current length.
+ */
+ssize_t
+jetex_packet_scan_response_init(struct jetex_header_scan_response *restrict dst,
+    const void *restrict correlation, size_t correlation_len,
+    size_t key_len, uint16_t sequence);
+
+/*
+ * Appends a record for key, and returns where the caller must write
+ * its value_len-byte value; NULL (and leaves dst as is) if the record
+ * doesn't fit.
+ */
+void *
+jetex_packet_scan_response_add(struct jetex_header_scan_response *restrict dst,
+    const void *restrict key, size_t value_len);
+
+/* Largest value a record fits in an otherwise empty response like dst. */
+size_t
+jetex_packet_scan_response_max_value(const struct jetex_header_scan_response *dst)
+    __attribute__((__pure__));
+
+/*
+ * Appends a JETEX_SCAN_OVERSIZED record for key.  Returns the new
+ * length, or -1 (and leaves dst as is) if it doesn't fit.
+ */
+ssize_t
+jetex_packet_scan_response_add_oversized(struct jetex_header_scan_response *restrict dst,
+    const void *restrict key);
+
+/* Sets the response's flags, and, with JETEX_SCAN_MORE, next_key. */
+void
+jetex_packet_scan_response_finish(struct jetex_header_scan_response *restrict dst,
+    uint16_t flags, const void *restrict next_key);
+
+/* Decodes and validates all of packet; 0 on success. */
+int
+jetex_packet_scan_response_decode(struct jetex_scan_response *restrict dst,
+    const void *restrict packet, size_t packet_len);
+
+/* Decodes the next record: 1 -> record, 0 -> done. */
+int
+jetex_packet_scan_response_next(struct jetex_scan_response *restrict response,
+    struct jetex_scan_record *restrict record);
 #endif /* !JETEX_PACKET_H */
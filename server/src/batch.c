@@ -0,0 +1,666 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "include/jetex_server.h"
+#include "namespace.h"
+#include "serve.h"
+#include "shared/packet.h"
+#include "table.h"
+#include "utility/cc.h"
+
+/* Max payload for coalesced replies; 0 disables coalescing. */
+static size_t coalesce_mtu = 0;
+
+/* Updated once per batch, with atomic adds. */
+static struct jetex_serve_stats serve_stats;
+
+/* Reads request's jetex_header.  0 -> ok, -1 if it's too short. */
+static int
+request_header(const struct serve_request *request,
+    struct jetex_header *OUT_header)
+{
+
+	if (request->len < sizeof(*OUT_header)) {
+		return -1;
+	}
+
+	memcpy(OUT_header, request->data, sizeof(*OUT_header));
+	return 0;
+}
+
+/* Table for uuid, if it exists and its keys are key_length bytes. */
+static const struct jetex_table *
+find_table(const struct jetex_namespace *ns, const uint8_t uuid[static 16],
+    size_t key_length)
+{
+	const struct jetex_table *table;
+
+	table = namespace_find(ns, uuid);
+	if (table != NULL && key_length == sizeof(uint64_t) * table->key_size) {
+		return table;
+	}
+
+	return NULL;
+}
+
+/*
+ * Decodes request into lookup, and resolves the table and key; table
+ * is NULL if the namespace has no matching table.
+ */
+static int
+decode_one(const struct jetex_namespace *ns,
+    const struct serve_request *request, struct jetex_lookup *lookup,
+    const struct jetex_table **OUT_table, uint64_t key[static 8])
+{
+
+	*OUT_table = NULL;
+	if (jetex_packet_lookup_decode(lookup,
+	    request->data, request->len,
+	    request->src, request->srclen) != 0) {
+		return -1;
+	}
+
+	if (lookup->dstlen > sizeof(struct sockaddr_storage)) {
+		return -1;
+	}
+
+	/* jetex_lookup is packed; copy the key out to an aligned buffer. */
+	memset(key, 0, 8 * sizeof(uint64_t));
+	memcpy(key, (const char *)lookup + offsetof(struct jetex_lookup, key),
+	    lookup->key_length);
+
+	*OUT_table = find_table(ns, lookup->table_uuid, lookup->key_length);
+	return 0;
+}
+
+static int
+encode_one(const struct jetex_lookup *lookup, const uint64_t key[static 8],
+    const struct fragment *fragment, const void *value, size_t value_length,
+    struct serve_reply *reply)
+{
+	const char *correlation;
+	size_t key_length = lookup->key_length;
+	ssize_t r;
+
+	correlation = (const char *)lookup->base_data + lookup->correlation_key_offset;
+	if (value != NULL) {
+		r = jetex_packet_found_encode(&reply->found,
+		    correlation, lookup->correlation_key_length,
+		    lookup->table_uuid, key, key_length, value_length);
+		if (r < 0) {
+			return -1;
+		}
+
+		reply->len = (uint32_t)r;
+		reply->value = NULL;
+		reply->value_len = 0;
+		if ((fragment->flags & FRAGMENT_FLAG_COMPRESSED) != 0) {
+			/* Decompress right behind the header. */
+			if (fragment_value_copy(fragment, &reply->bytes[r],
+			    value, value_length) != 0) {
+				return -1;
+			}
+
+			reply->len += (uint32_t)value_length;
+		} else {
+			/* Don't copy: send it straight from the fragment. */
+			reply->value = value;
+			reply->value_len = value_length;
+		}
+	} else {
+		r = jetex_packet_missing_encode(&reply->missing,
+		    correlation, lookup->correlation_key_length,
+		    lookup->table_uuid, key, key_length);
+		if (r < 0) {
+			return -1;
+		}
+
+		reply->len = reply->missing.header.header.len;
+		reply->value = NULL;
+		reply->value_len = 0;
+	}
+
+	memcpy(&reply->dst, (const char *)lookup + offsetof(struct jetex_lookup, dst),
+	    lookup->dstlen);
+	reply->dstlen = (socklen_t)lookup->dstlen;
+	return 0;
+}
+
+/*
+ * Starts a multi-key reply to lookup in reply.  Returns 0 on success.
+ */
+static int
+multi_reply_init(const struct jetex_multi_lookup *lookup, uint32_t origin,
+    struct serve_reply *reply)
+{
+	const char *correlation;
+	ssize_t r;
+
+	correlation = (const char *)lookup->base_data + lookup->correlation_key_offset;
+	r = jetex_packet_multi_response_init(&reply->multi,
+	    correlation, lookup->correlation_key_length);
+	if (r < 0) {
+		return -1;
+	}
+
+	reply->len = (uint32_t)r;
+	reply->origin = origin;
+	reply->value = NULL;
+	reply->value_len = 0;
+	memcpy(&reply->dst, (const char *)lookup + offsetof(struct jetex_multi_lookup, dst),
+	    lookup->dstlen);
+	reply->dstlen = (socklen_t)lookup->dstlen;
+	return 0;
+}
+
+/*
+ * Appends a record for key index to reply, like
+ * jetex_packet_multi_response_add, but decompresses values from
+ * compressed fragments in place.  Corrupt values are reported as
+ * missing, and values too large for any reply as oversized.
+ */
+static ssize_t
+multi_reply_add(struct serve_reply *reply, uint32_t index,
+    const struct fragment *fragment, const void *value, size_t value_len)
+{
+	uint16_t len = reply->multi.header.len;
+	void *dst;
+
+	if (value != NULL &&
+	    value_len > jetex_packet_multi_response_max_value(&reply->multi)) {
+		return jetex_packet_multi_response_add_oversized(&reply->multi,
+		    index);
+	}
+
+	if (value == NULL || (fragment->flags & FRAGMENT_FLAG_COMPRESSED) == 0) {
+		return jetex_packet_multi_response_add(&reply->multi,
+		    index, value, value_len);
+	}
+
+	dst = jetex_packet_multi_response_reserve(&reply->multi,
+	    index, value_len);
+	if (dst == NULL) {
+		return -1;
+	}
+
+	if (fragment_value_copy(fragment, dst, value, value_len) != 0) {
+		reply->multi.header.len = len;
+		return jetex_packet_multi_response_add(&reply->multi,
+		    index, NULL, 0);
+	}
+
+	return reply->multi.header.len;
+}
+
+/*
+ * Serves a multi-key request, in groups of TABLE_LOOKUP_GROUP keys.
+ * Records are packed in as few replies as possible; values too large
+ * for a datagram get a JETEX_MULTI_OVERSIZED record, and once we run
+ * out of replies, the remaining keys are dropped.
+ *
+ * Returns the number of replies written to replies[0 ... max_reply - 1],
+ * or -1 if the request is malformed.
+ */
+static ssize_t
+serve_multi(const struct jetex_namespace *ns, unsigned int node,
+    const struct serve_request *request,
+    struct serve_reply *replies, size_t max_reply)
+{
+	struct jetex_multi_lookup lookup;
+	struct jetex_multi_lookup_key keys[TABLE_LOOKUP_GROUP];
+	const struct jetex_table *tables[TABLE_LOOKUP_GROUP];
+	uint64_t key_words[TABLE_LOOKUP_GROUP][8];
+	const void *values[TABLE_LOOKUP_GROUP];
+	size_t value_lens[TABLE_LOOKUP_GROUP];
+	const struct fragment *fragments[TABLE_LOOKUP_GROUP];
+	struct serve_reply *reply = NULL;
+	size_t n_reply = 0;
+
+	if (jetex_packet_multi_lookup_decode(&lookup,
+	    request->data, request->len,
+	    request->src, request->srclen) != 0 ||
+	    lookup.dstlen > sizeof(struct sockaddr_storage)) {
+		return -1;
+	}
+
+	for (;;) {
+		size_t m = 0;
+
+		while (m < TABLE_LOOKUP_GROUP &&
+		    jetex_packet_multi_lookup_next(&lookup, &keys[m]) == 1) {
+			memset(key_words[m], 0, sizeof(key_words[m]));
+			memcpy(key_words[m],
+			    (const char *)&keys[m] + offsetof(struct jetex_multi_lookup_key, key),
+			    keys[m].key_length);
+			tables[m] = find_table(ns, keys[m].table_uuid, keys[m].key_length);
+			m++;
+		}
+
+		if (m == 0) {
+			break;
+		}
+
+		table_lookup_batch(m, node, tables,
+		    (const uint64_t (*)[8])key_words, values, value_lens,
+		    fragments);
+
+		for (size_t i = 0; i < m; i++) {
+			ssize_t r = -1;
+
+			if (reply != NULL) {
+				r = multi_reply_add(reply, keys[i].index,
+				    fragments[i], values[i], value_lens[i]);
+			}
+
+			if (r < 0) {
+				if (n_reply == max_reply) {
+					return (ssize_t)n_reply;
+				}
+
+				reply = &replies[n_reply];
+				if (multi_reply_init(&lookup, request->origin, reply) != 0) {
+					return (ssize_t)n_reply;
+				}
+
+				n_reply++;
+				r = multi_reply_add(reply, keys[i].index,
+				    fragments[i], values[i], value_lens[i]);
+			}
+
+			if (r >= 0) {
+				reply->len = (uint32_t)r;
+			}
+		}
+	}
+
+	return (ssize_t)n_reply;
+}
+
+/* Starts scan response datagram number sequence in reply. */
+static int
+scan_reply_init(const struct jetex_scan *scan, uint32_t origin,
+    uint16_t sequence, struct serve_reply *reply)
+{
+	const char *correlation;
+	ssize_t r;
+
+	correlation = (const char *)scan->base_data + scan->correlation_key_offset;
+	r = jetex_packet_scan_response_init(&reply->scan,
+	    correlation, scan->correlation_key_length,
+	    scan->key_length, sequence);
+	if (r < 0) {
+		return -1;
+	}
+
+	reply->len = (uint32_t)r;
+	reply->origin = origin;
+	reply->value = NULL;
+	reply->value_len = 0;
+	memcpy(&reply->dst, (const char *)scan + offsetof(struct jetex_scan, dst),
+	    scan->dstlen);
+	reply->dstlen = (socklen_t)scan->dstlen;
+	return 0;
+}
+
+/*
+ * Appends a record for key to reply, decompressing values from
+ * compressed fragments in place.  Values too large for any reply, and
+ * corrupt ones, get a JETEX_SCAN_OVERSIZED record.  Returns 1 for a
+ * value, 0 for an oversized record, or -1 if reply is full.
+ */
+static int
+scan_reply_add(struct serve_reply *reply, const uint64_t *key,
+    const struct fragment *fragment, const void *value, size_t value_len)
+{
+	uint16_t len = reply->scan.header.len;
+	void *dst;
+
+	if (value_len <= jetex_packet_scan_response_max_value(&reply->scan)) {
+		dst = jetex_packet_scan_response_add(&reply->scan, key, value_len);
+		if (dst == NULL) {
+			return -1;
+		}
+
+		if (fragment_value_copy(fragment, dst, value, value_len) == 0) {
+			return 1;
+		}
+
+		/* Corrupt; the marker takes less room than the record did. */
+		reply->scan.header.len = len;
+	}
+
+	if (jetex_packet_scan_response_add_oversized(&reply->scan, key) < 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Serves a scan request with up to SERVE_SCAN_MAX_REPLY replies.  When
+ * we run out of replies, hit the request's limit, or have sent
+ * SERVE_SCAN_MAX_OVERSIZED oversized records before the end of the
+ * range, the last reply has the first key we didn't send.  Oversized
+ * records count towards the limit.
+ *
+ * Returns the number of replies written to replies[0 ... max_reply - 1],
+ * or -1 if the request is malformed.
+ */
+static ssize_t
+serve_scan(const struct jetex_namespace *ns, unsigned int node,
+    const struct serve_request *request,
+    struct serve_reply *replies, size_t max_reply)
+{
+	struct jetex_scan scan;
+	struct table_scan cursor;
+	const struct jetex_table *table;
+	const uint64_t *key;
+	const uint64_t *next = NULL;
+	struct serve_reply *reply;
+	size_t n_reply = 0;
+	size_t n_record = 0;
+	size_t n_oversized = 0;
+
+	if (jetex_packet_scan_decode(&scan,
+	    request->data, request->len,
+	    request->src, request->srclen) != 0 ||
+	    scan.dstlen > sizeof(struct sockaddr_storage)) {
+		return -1;
+	}
+
+	if (max_reply > SERVE_SCAN_MAX_REPLY) {
+		max_reply = SERVE_SCAN_MAX_REPLY;
+	}
+
+	if (max_reply == 0 ||
+	    scan_reply_init(&scan, request->origin, 0, &replies[0]) != 0) {
+		return 0;
+	}
+
+	reply = &replies[n_reply++];
+	table = find_table(ns, scan.table_uuid, scan.key_length);
+	if (table != NULL) {
+		uint64_t start[8];
+
+		/* jetex_scan is packed; copy the key out to an aligned buffer. */
+		memcpy(start, (const char *)&scan + offsetof(struct jetex_scan, start),
+		    sizeof(start));
+		table_scan_init(&cursor, table, node, start, scan.end);
+	}
+
+	while (table != NULL) {
+		const struct fragment *fragment;
+		const void *value;
+		size_t value_len;
+		int r;
+
+		key = table_scan_next(&cursor, &value, &value_len, &fragment);
+		if (key == NULL) {
+			break;
+		}
+
+		if ((scan.limit != 0 && n_record == scan.limit) ||
+		    n_oversized == SERVE_SCAN_MAX_OVERSIZED) {
+			next = key;
+			break;
+		}
+
+		r = scan_reply_add(reply, key, fragment, value, value_len);
+		if (r < 0) {
+			if (n_reply == max_reply) {
+				next = key;
+				break;
+			}
+
+			jetex_packet_scan_response_finish(&reply->scan, 0, NULL);
+			reply->len = reply->scan.header.len;
+			if (scan_reply_init(&scan, request->origin,
+			    (uint16_t)n_reply, &replies[n_reply]) != 0) {
+				next = key;
+				break;
+			}
+
+			reply = &replies[n_reply++];
+			/* Always fits in an empty reply. */
+			r = scan_reply_add(reply, key, fragment, value, value_len);
+			if (r < 0) {
+				next = key;
+				break;
+			}
+		}
+
+		if (r == 0) {
+			n_oversized++;
+		}
+
+		n_record++;
+	}
+
+	jetex_packet_scan_response_finish(&reply->scan,
+	    (uint16_t)(JETEX_SCAN_LAST | ((next != NULL) ? JETEX_SCAN_MORE : 0)),
+	    next);
+	reply->len = reply->scan.header.len;
+	return (ssize_t)n_reply;
+}
+
+/* Single-key replies that fit in mtu can share a datagram. */
+static bool
+coalescable(const struct serve_reply *reply, size_t mtu)
+{
+	uint8_t type = reply->found.header.header.type;
+
+	return reply->len > 0 && (type == 1 || type == 3) &&
+	    reply->len + reply->value_len <= mtu;
+}
+
+static bool
+same_destination(const struct serve_reply *x, const struct serve_reply *y)
+{
+
+	return x->origin == y->origin && x->dstlen == y->dstlen &&
+	    memcmp(&x->dst, &y->dst, x->dstlen) == 0;
+}
+
+/* Appends other's header and value to dst's datagram. */
+static void
+append_record(struct serve_reply *dst, const struct serve_reply *other)
+{
+
+	memcpy(&dst->bytes[dst->len], other->bytes, other->len);
+	dst->len += other->len;
+	if (other->value_len > 0) {
+		memcpy(&dst->bytes[dst->len], other->value, other->value_len);
+		dst->len += (uint32_t)other->value_len;
+	}
+
+	return;
+}
+
+/*
+ * Packs replies into the first reply for the same destination with
+ * enough room left.  Records are self-delimiting, so we concatenate
+ * them: this only copies small values, and happens before any send,
+ * so nothing ever waits for a coalescing buffer to fill up.
+ */
+static void
+coalesce(struct serve_reply *replies, size_t n, size_t mtu)
+{
+
+	for (size_t i = 0; i < n; i++) {
+		struct serve_reply *leader = &replies[i];
+
+		if (!coalescable(leader, mtu)) {
+			continue;
+		}
+
+		for (size_t j = i + 1; j < n; j++) {
+			struct serve_reply *other = &replies[j];
+
+			if (!coalescable(other, mtu) ||
+			    !same_destination(leader, other) ||
+			    leader->len + leader->value_len +
+			    other->len + other->value_len > mtu) {
+				continue;
+			}
+
+			/* Move the leader's own value inline first. */
+			if (leader->value_len > 0) {
+				memcpy(&leader->bytes[leader->len],
+				    leader->value, leader->value_len);
+				leader->len += (uint32_t)leader->value_len;
+				leader->value = NULL;
+				leader->value_len = 0;
+			}
+
+			append_record(leader, other);
+			other->len = 0;
+		}
+	}
+
+	return;
+}
+
+void
+jetex_serve_stats(struct jetex_serve_stats *OUT_stats)
+{
+
+	*OUT_stats = (struct jetex_serve_stats) {
+		.expired = __atomic_load_n(&serve_stats.expired, __ATOMIC_RELAXED),
+		.malformed = __atomic_load_n(&serve_stats.malformed, __ATOMIC_RELAXED)
+	};
+
+	return;
+}
+
+void
+jetex_serve_set_coalesce_mtu(size_t mtu)
+{
+
+	/* Coalesced datagrams are built in serve_reply.bytes. */
+	if (mtu > sizeof(((struct serve_reply *)NULL)->bytes)) {
+		mtu = sizeof(((struct serve_reply *)NULL)->bytes);
+	}
+
+	__atomic_store_n(&coalesce_mtu, mtu, __ATOMIC_RELAXED);
+	return;
+}
+
+size_t
+serve_batch(const struct jetex_namespace *ns, unsigned int node,
+    const struct serve_request *requests, size_t n,
+    struct serve_reply *replies, size_t max_reply)
+{
+	struct jetex_lookup lookups[TABLE_LOOKUP_GROUP];
+	const struct jetex_table *tables[TABLE_LOOKUP_GROUP];
+	uint64_t keys[TABLE_LOOKUP_GROUP][8];
+	const void *values[TABLE_LOOKUP_GROUP];
+	size_t value_lens[TABLE_LOOKUP_GROUP];
+	const struct fragment *fragments[TABLE_LOOKUP_GROUP];
+	uint32_t origins[TABLE_LOOKUP_GROUP];
+	struct timeval now;
+	size_t n_reply = 0;
+	size_t n_multi = 0;
+	uint64_t n_expired = 0;
+	uint64_t n_malformed = 0;
+	size_t mtu;
+
+	/* One clock read for the whole batch. */
+	gettimeofday(&now, NULL);
+
+	/*
+	 * Decode a group, look it up in one pipelined batch, encode.
+	 * Requests past their deadline are dropped before any lookup.
+	 * Single-key requests need exactly one reply each; multi-key
+	 * and scan requests go last, and share the remaining replies.
+	 */
+	for (size_t base = 0; base < n; base += TABLE_LOOKUP_GROUP) {
+		size_t m = n - base;
+		size_t n_decoded = 0;
+
+		if (m > TABLE_LOOKUP_GROUP) {
+			m = TABLE_LOOKUP_GROUP;
+		}
+
+		for (size_t i = 0; i < m; i++) {
+			const struct serve_request *request = &requests[base + i];
+			struct jetex_header header;
+
+			if (request_header(request, &header) != 0) {
+				n_malformed++;
+				continue;
+			}
+
+			if (jetex_packet_expired(&header, &now)) {
+				n_expired++;
+				continue;
+			}
+
+			if (header.type == 4 || header.type == 6) {
+				n_multi++;
+				continue;
+			}
+
+			if (decode_one(ns, request, &lookups[n_decoded],
+			    &tables[n_decoded], keys[n_decoded]) == 0) {
+				origins[n_decoded++] = request->origin;
+			} else {
+				n_malformed++;
+			}
+		}
+
+		table_lookup_batch(n_decoded, node, tables,
+		    (const uint64_t (*)[8])keys, values, value_lens,
+		    fragments);
+
+		for (size_t i = 0; i < n_decoded && n_reply < max_reply; i++) {
+			struct serve_reply *reply = &replies[n_reply];
+
+			if (encode_one(&lookups[i], keys[i], fragments[i],
+			    values[i], value_lens[i], reply) == 0) {
+				reply->origin = origins[i];
+				n_reply++;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < n && n_multi > 0; i++) {
+		struct jetex_header header;
+		ssize_t r;
+
+		if (request_header(&requests[i], &header) != 0 ||
+		    (header.type != 4 && header.type != 6) ||
+		    jetex_packet_expired(&header, &now)) {
+			continue;
+		}
+
+		n_multi--;
+		r = (header.type == 4)
+		    ? serve_multi(ns, node, &requests[i],
+			&replies[n_reply], max_reply - n_reply)
+		    : serve_scan(ns, node, &requests[i],
+			&replies[n_reply], max_reply - n_reply);
+		if (r < 0) {
+			n_malformed++;
+		} else {
+			n_reply += (size_t)r;
+		}
+	}
+
+	if (n_expired > 0) {
+		__atomic_fetch_add(&serve_stats.expired, n_expired, __ATOMIC_RELAXED);
+	}
+
+	if (n_malformed > 0) {
+		__atomic_fetch_add(&serve_stats.malformed, n_malformed, __ATOMIC_RELAXED);
+	}
+
+	mtu = __atomic_load_n(&coalesce_mtu, __ATOMIC_RELAXED);
+	if (mtu > 0) {
+		coalesce(replies, n_reply, mtu);
+	}
+
+	return n_reply;
+}
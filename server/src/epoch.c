@@ -0,0 +1,54 @@
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "epoch.h"
+
+void
+epoch_domain_init(struct epoch_domain *domain,
+    struct epoch_reader *readers, size_t n_reader)
+{
+
+	*domain = (struct epoch_domain) {
+		.epoch = 1,
+		.n_reader = n_reader,
+		.readers = readers
+	};
+
+	for (size_t i = 0; i < n_reader; i++) {
+		readers[i] = (struct epoch_reader) { .seen = 0 };
+	}
+
+	return;
+}
+
+void
+epoch_synchronize(struct epoch_domain *domain)
+{
+	uint64_t target;
+
+	target = 1 + __atomic_fetch_add(&domain->epoch, 1, __ATOMIC_SEQ_CST);
+	for (size_t i = 0; i < domain->n_reader; i++) {
+		const struct epoch_reader *reader = &domain->readers[i];
+
+		for (size_t spin = 0; ; spin++) {
+			uint64_t seen = __atomic_load_n(&reader->seen, __ATOMIC_SEQ_CST);
+
+			if (seen == 0 || seen >= target) {
+				break;
+			}
+
+			/* Busy readers quiesce once per batch; idle ones are offline. */
+			if (spin < 100) {
+				sched_yield();
+			} else {
+				struct timespec ts = { .tv_nsec = 100 * 1000 };
+
+				nanosleep(&ts, NULL);
+			}
+		}
+	}
+
+	return;
+}
@@ -0,0 +1,60 @@
+#ifndef JETEX_EPOCH_H
+#define JETEX_EPOCH_H
+#include <stddef.h>
+#include <stdint.h>
+
+#include "utility/cc.h"
+
+/*
+ * Quiescent-state based reclamation.  Readers (serving threads)
+ * announce the epoch they last observed between batches, and go
+ * offline before blocking; a writer that swaps a pointer then calls
+ * epoch_synchronize to wait until no reader can still hold the old
+ * value.
+ */
+struct epoch_reader {
+	uint64_t seen; /* 0: offline, otherwise last observed epoch. */
+	uint64_t padding[7];
+} __attribute__((__aligned__(64)));
+
+struct epoch_domain {
+	uint64_t epoch; /* >= 1. */
+	size_t n_reader;
+	struct epoch_reader *readers;
+};
+
+void
+epoch_domain_init(struct epoch_domain *domain,
+    struct epoch_reader *readers, size_t n_reader);
+
+/*
+ * Waits until every reader has gone through a quiescent point (or
+ * offline) since the call started.
+ */
+void
+epoch_synchronize(struct epoch_domain *domain);
+
+/*
+ * Declares that reader holds no reference to anything published
+ * before now.  Loads of published pointers after this call are
+ * protected until the next quiescent point.
+ */
+static inline void
+epoch_quiescent(struct epoch_domain *domain, struct epoch_reader *reader)
+{
+
+	__atomic_store_n(&reader->seen,
+	    __atomic_load_n(&domain->epoch, __ATOMIC_SEQ_CST),
+	    __ATOMIC_SEQ_CST);
+	return;
+}
+
+/* Declares that reader holds no reference until epoch_quiescent. */
+static inline void
+epoch_offline(struct epoch_reader *reader)
+{
+
+	__atomic_store_n(&reader->seen, 0, __ATOMIC_RELEASE);
+	return;
+}
+#endif /* !JETEX_EPOCH_H */
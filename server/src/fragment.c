@@ -3,13 +3,18 @@
 #include <limits.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
+#include <linux/magic.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "include/jetex_server.h"
 #include "fragment.h"
+#include "lz.h"
+#include "numa.h"
 #include "utility/cc.h"
 
 static inline uint64_t
@@ -21,15 +26,150 @@ scale(uint64_t delta, uint64_t multiplier)
 	return (uint64_t)(offset >> 64);
 }
 
+/* Size of the version 1 model, knots and segments, padded to 64 bytes. */
+static inline uint64_t
+model_size(uint64_t n_segments)
+{
+	uint64_t size = n_segments *
+	    (sizeof(uint64_t) + sizeof(struct fragment_segment));
+
+	return (size + 63) & ~(uint64_t)63;
+}
+
+static int
+pread_full(int fd, void *buf, size_t len, uint64_t offset)
+{
+	char *dst = buf;
+
+	while (len > 0) {
+		ssize_t r;
+
+		r = pread(fd, dst, len, (off_t)offset);
+		if (r == -1 && errno == EINTR) {
+			continue;
+		}
+
+		if (r <= 0) {
+			return -1;
+		}
+
+		dst += r;
+		len -= (size_t)r;
+		offset += (uint64_t)r;
+	}
+
+	return 0;
+}
+
+/* Checks that probe windows starting at guess stay in n_slot slots. */
+static inline int
+check_window(uint64_t guess, uint64_t max_displacement, uint64_t n_slot)
+{
+
+	if (guess >= n_slot || n_slot - guess <= max_displacement) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Number of MODEL_CHUNK segments validate_model reads at a time. */
+#define MODEL_CHUNK 256
+
+/*
+ * Checks that knots ascend from min to at most max, and that every
+ * key in each segment gets a probe window inside the n_slot items.
+ * Guesses are monotonic within a segment, so checking each segment's
+ * largest key suffices.
+ */
+static int
+validate_model(const struct fragment_header *header, int fd, uint64_t n_slot)
+{
+	uint64_t knots[MODEL_CHUNK + 1];
+	struct fragment_segment segments[MODEL_CHUNK];
+	uint64_t n = header->n_segments;
+	uint64_t knot_offset = sizeof(*header);
+	uint64_t segment_offset = knot_offset + n * sizeof(knots[0]);
+
+	for (uint64_t i = 0; i < n; i += MODEL_CHUNK) {
+		size_t m = (n - i < MODEL_CHUNK) ? (size_t)(n - i) : MODEL_CHUNK;
+		/* Also read the next chunk's first knot. */
+		size_t n_knot = m + (i + m < n);
+
+		if (pread_full(fd, knots, n_knot * sizeof(knots[0]),
+		    knot_offset + i * sizeof(knots[0])) != 0 ||
+		    pread_full(fd, segments, m * sizeof(segments[0]),
+		    segment_offset + i * sizeof(segments[0])) != 0) {
+			return -1;
+		}
+
+		if (i == 0 && knots[0] != header->min) {
+			return -1;
+		}
+
+		for (size_t j = 0; j < m; j++) {
+			uint64_t end = header->max;
+			uint64_t offset;
+
+			if (j + 1 < n_knot) {
+				if (knots[j + 1] <= knots[j] ||
+				    knots[j + 1] > header->max) {
+					return -1;
+				}
+
+				end = knots[j + 1] - 1;
+			}
+
+			offset = scale(end - knots[j], segments[j].multiplier);
+			if (UINT64_MAX - offset < segments[j].first_slot ||
+			    check_window(segments[j].first_slot + offset,
+			    header->max_displacement, n_slot) != 0) {
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
 static int
 validate_header(const struct fragment_header *header, int fd)
 {
+	uint64_t data_offset = sizeof(*header);
+	uint64_t n_slot;
 
 	if (header->magic != FRAGMENT_HEADER_MAGIC) {
 		return -1;
 	}
 
-	if (header->version != 0) {
+	if ((header->flags & ~(FRAGMENT_FLAG_SPLIT | FRAGMENT_FLAG_FILTER |
+	    FRAGMENT_FLAG_HEAP | FRAGMENT_FLAG_COMPRESSED)) != 0) {
+		return -1;
+	}
+
+	if ((header->flags & FRAGMENT_FLAG_COMPRESSED) != 0 &&
+	    (header->flags & FRAGMENT_FLAG_HEAP) == 0) {
+		return -1;
+	}
+
+	switch (header->version) {
+	case 0:
+		if (header->n_segments != 0) {
+			return -1;
+		}
+
+		break;
+	case 1:
+		if (header->multiplier != 0 ||
+		    header->n_segments == 0 ||
+		    header->n_segments > UINT32_MAX ||
+		    header->max_displacement >= FRAGMENT_MODEL_MAX_DISPLACEMENT) {
+			return -1;
+		}
+
+		data_offset += model_size(header->n_segments);
+		break;
+	default:
 		return -1;
 	}
 
@@ -67,42 +207,82 @@ validate_header(const struct fragment_header *header, int fd)
 		return -1;
 	}
 
-	{
-		uint64_t range = header->max - header->min;
-		uint64_t guess = scale(range, header->multiplier);
-		uint64_t max_index;
-		uint64_t max_offset;
+	if ((header->flags & FRAGMENT_FLAG_FILTER) != 0) {
+		struct fragment_filter filter;
 
-		if (UINT64_MAX - guess < header->max_displacement) {
+		if (header->table_size < data_offset + sizeof(filter) ||
+		    pread_full(fd, &filter, sizeof(filter), data_offset) != 0) {
 			return -1;
 		}
 
-		max_index = guess + header->max_displacement;
-		if (max_index > UINT64_MAX / (sizeof(uint64_t) * header->item_size)) {
+		if (filter.n_blocks == 0 || filter.n_blocks > UINT32_MAX) {
 			return -1;
 		}
 
-		max_offset = max_index * sizeof(uint64_t) * header->item_size;
-		if (max_offset > UINT64_MAX - sizeof(*header)) {
+		data_offset += sizeof(filter) + 64 * filter.n_blocks;
+	}
+
+	if ((header->flags & FRAGMENT_FLAG_HEAP) != 0) {
+		struct fragment_heap heap;
+
+		if (header->item_size != header->key_size + 1) {
 			return -1;
 		}
 
-		if (max_offset + sizeof(*header) > header->table_size) {
+		if (header->table_size < data_offset + sizeof(heap) ||
+		    pread_full(fd, &heap, sizeof(heap), data_offset) != 0) {
 			return -1;
 		}
+
+		if (heap.size >= (uint64_t)1 << FRAGMENT_HEAP_OFFSET_BITS ||
+		    heap.dict_size > FRAGMENT_DICT_MAX_SIZE ||
+		    heap.dict_offset > heap.size ||
+		    heap.size - heap.dict_offset < heap.dict_size) {
+			return -1;
+		}
+
+		data_offset += sizeof(heap) + ((heap.size + 63) & ~(uint64_t)63);
 	}
 
+	if (header->table_size < data_offset) {
+		return -1;
+	}
+
+	n_slot = (header->table_size - data_offset) /
+	    (sizeof(uint64_t) * header->item_size);
+
 	{
 		struct stat buf;
 		int r;
 
 		r = fstat(fd, &buf);
-		if (r < 0 || header->table_size < (uint64_t)buf.st_size) {
+		if (r < 0 || header->table_size > (uint64_t)buf.st_size) {
 			return -1;
 		}
 	}
 
-	return 0;
+	/* hugetlbfs mappings can only be unmapped in whole pages. */
+	{
+		struct statfs buf;
+
+		if (fstatfs(fd, &buf) != 0) {
+			return -1;
+		}
+
+		if (buf.f_type == HUGETLBFS_MAGIC && buf.f_bsize > 0 &&
+		    header->table_size % (uint64_t)buf.f_bsize != 0) {
+			return -1;
+		}
+	}
+
+	if (header->version == 0) {
+		uint64_t range = header->max - header->min;
+
+		return check_window(scale(range, header->multiplier),
+		    header->max_displacement, n_slot);
+	}
+
+	return validate_model(header, fd, n_slot);
 }
 
 int
@@ -123,6 +303,8 @@ fragment_validate(int fd, uint64_t *OUT_pattern, uint8_t *OUT_nbits)
 		if (r < 0 || (size_t)r < sizeof(header)) {
 			return -1;
 		}
+
+		break;
 	}
 
 	if (r < 0) {
@@ -152,10 +334,11 @@ jetex_table_fragment_validate(int fd)
 }
 
 struct fragment
-fragment_map(int fd)
+fragment_map(int fd, unsigned int flags)
 {
 	struct fragment_header header;
 	struct fragment_header *map;
+	struct fragment ret;
 	ssize_t r;
 
 	r = pread(fd, &header, sizeof(header), 0);
@@ -167,16 +350,120 @@ fragment_map(int fd)
 	    PROT_READ, MAP_SHARED, fd, 0);
 	assert((void *)map != MAP_FAILED && "mmap of fragment failed.");
 
-	return (struct fragment) {
+	/* Only a hint: file THP needs kernel support. */
+	if ((flags & FRAGMENT_MAP_HUGE_PAGES) != 0) {
+		(void)madvise(map, header.table_size, MADV_HUGEPAGE);
+	}
+
+	ret = (struct fragment) {
 		.data = map,
-		.n_bytes = header.table_size - sizeof(header),
+		.items = (const void *)(map + 1),
 		.min = header.min,
 		.range = header.max - header.min,
 		.multiplier = header.multiplier,
+		.item_size = header.item_size,
+		.value_size = (uint16_t)(header.item_size - header.key_size),
 		.max_displacement = header.max_displacement,
-		.fd = fd,
-		.data_offset = (int64_t)header.table_size
+		.key_size = header.key_size,
+		.flags = (uint8_t)(header.flags & (FRAGMENT_FLAG_SPLIT |
+		    FRAGMENT_FLAG_FILTER | FRAGMENT_FLAG_HEAP |
+		    FRAGMENT_FLAG_COMPRESSED))
 	};
+
+	if (header.version == 1) {
+		uint64_t size = model_size(header.n_segments);
+
+		ret.items = (const void *)((const char *)ret.items + size);
+		ret.n_segments = header.n_segments;
+		ret.flags |= FRAGMENT_FLAG_MODEL;
+	}
+
+	if ((ret.flags & FRAGMENT_FLAG_FILTER) != 0) {
+		const struct fragment_filter *filter = (const void *)ret.items;
+
+		ret.filter = (const void *)(filter + 1);
+		ret.n_filter_block = (uint32_t)filter->n_blocks;
+		ret.items = ret.filter + 8 * filter->n_blocks;
+	}
+
+	if ((ret.flags & FRAGMENT_FLAG_HEAP) != 0) {
+		const struct fragment_heap *heap = (const void *)ret.items;
+
+		ret.heap = (const void *)(heap + 1);
+		ret.heap_size = heap->size;
+		if ((ret.flags & FRAGMENT_FLAG_COMPRESSED) != 0) {
+			ret.dict = ret.heap + heap->dict_offset;
+			ret.dict_size = (uint32_t)heap->dict_size;
+		}
+
+		ret.items = (const void *)(ret.heap +
+		    ((heap->size + 63) & ~(uint64_t)63));
+	}
+
+	ret.n_slot = (header.table_size - sizeof(header) -
+	    (uint64_t)((const char *)ret.items - (const char *)(map + 1))) /
+	    (sizeof(uint64_t) * header.item_size);
+
+	/* Split: slots are key_size apart, and values follow the keys. */
+	if ((ret.flags & FRAGMENT_FLAG_SPLIT) != 0) {
+		ret.item_size = header.key_size;
+		ret.values = ret.items + ret.n_slot * header.key_size;
+	}
+
+	ret.probe = probe_select(&ret);
+	return ret;
+}
+
+/* Moves field, a pointer into src, to the same offset in dst. */
+static inline const void *
+rebase(const void *field, const struct fragment_header *src,
+    const struct fragment_header *dst)
+{
+
+	if (field == NULL) {
+		return NULL;
+	}
+
+	return (const char *)dst + ((const char *)field - (const char *)src);
+}
+
+struct fragment
+fragment_replicate(const struct fragment *fragment, unsigned int node,
+    unsigned int flags)
+{
+	struct fragment ret = *fragment;
+	size_t size = fragment->data->table_size;
+	void *map;
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		return (struct fragment) { .data = NULL };
+	}
+
+	if ((flags & FRAGMENT_MAP_HUGE_PAGES) != 0) {
+		(void)madvise(map, size, MADV_HUGEPAGE);
+	}
+
+	/* Bind before the copy faults pages in. */
+	if (numa_bind(map, size, node) != 0) {
+		munmap(map, size);
+		return (struct fragment) { .data = NULL };
+	}
+
+	memcpy(map, fragment->data, size);
+	if (mprotect(map, size, PROT_READ) != 0) {
+		munmap(map, size);
+		return (struct fragment) { .data = NULL };
+	}
+
+	ret.data = map;
+	ret.items = rebase(fragment->items, fragment->data, ret.data);
+	ret.filter = rebase(fragment->filter, fragment->data, ret.data);
+	ret.heap = rebase(fragment->heap, fragment->data, ret.data);
+	ret.dict = rebase(fragment->dict, fragment->data, ret.data);
+	ret.values = rebase(fragment->values, fragment->data, ret.data);
+	return ret;
 }
 
 void
@@ -193,190 +480,272 @@ fragment_unmap(const struct fragment *fragment)
 	return;
 }
 
-static const void *
-lookup8(const struct fragment *restrict fragment,
-    const uint64_t key[static 8],
-    uint64_t key0, uint64_t guess)
+int
+fragment_populate(const struct fragment *fragment,
+    uint64_t offset, uint64_t len)
 {
-	const uint64_t *data = fragment_header_data(fragment->data);
-	size_t item_size = fragment->item_size;
-	size_t max_displacement = fragment->max_displacement;
+	const volatile char *base = (const volatile char *)fragment->data + offset;
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	char sink = 0;
 
-	(void)key;
-	if (JT_CC_UNLIKELY(key0 == fragment->min + fragment->range)) {
-		return &data[guess * item_size + max_displacement];
+#ifdef MADV_POPULATE_READ
+	if (madvise((void *)(uintptr_t)base, len, MADV_POPULATE_READ) == 0) {
+		return 0;
 	}
 
-	for (size_t i = 0, offset = guess * item_size;
-	     i <= max_displacement;
-	     i++, offset += item_size) {
-		uint64_t current = data[offset];
-
-		if (current == key0) {
-			return &data[offset];
-		}
+	/* EINVAL: kernel older than 5.14; touch pages instead. */
+	if (errno != EINVAL) {
+		return -1;
+	}
+#endif
 
-		if (current > key0) {
-			return NULL;
-		}
+	for (uint64_t i = 0; i < len; i += page) {
+		sink ^= base[i];
 	}
 
-	return NULL;
+	(void)sink;
+	return 0;
 }
 
-static const void *
-lookup16(const struct fragment *restrict fragment,
-    const uint64_t key[static 8],
-    uint64_t key0, uint64_t guess)
+int
+fragment_lock(const struct fragment *fragment)
 {
-	const uint64_t *data = fragment_header_data(fragment->data);
-	uint64_t key1 = key[1];
-	size_t item_size = fragment->item_size;
-	size_t max_displacement = fragment->max_displacement;
-
-	(void)key;
-	if (JT_CC_UNLIKELY(key0 == fragment->min + fragment->range)) {
-		if (key1 == UINT64_MAX) {
-			return &data[guess * item_size + max_displacement];
-		}
-	}
 
-	for (size_t i = 0, offset = guess * item_size;
-	     i <= max_displacement;
-	     i++, offset += item_size) {
-		uint64_t c0 = data[offset];
-		uint64_t c1 = data[offset + 1];
+	return mlock(fragment->data, fragment->data->table_size);
+}
 
-		if (((c0 ^ key0) | (c1 & key1)) == 0) {
-			return &data[offset];
-		}
+/*
+ * Slot guess for key0, which must be in fragment's range: the last
+ * segment whose knot is <= key0 extrapolates from its first slot.
+ */
+static inline JT_CC_PURE uint64_t
+fragment_guess(const struct fragment *fragment, uint64_t key0)
+{
+	const uint64_t *knots;
+	const struct fragment_segment *segments;
+	const uint64_t *base;
+	size_t n = fragment->n_segments;
 
-		if (c0 > key0) {
-			return NULL;
-		}
+	if ((fragment->flags & FRAGMENT_FLAG_MODEL) == 0) {
+		return scale(key0 - fragment->min, fragment->multiplier);
+	}
+
+	knots = (const void *)(fragment->data + 1);
+	/* Branch-free binary search; knots[0] == min <= key0. */
+	base = knots;
+	while (n > 1) {
+		size_t half = n / 2;
+
+		base = (base[half] <= key0) ? base + half : base;
+		n -= half;
 	}
 
-	return NULL;
+	segments = (const void *)(knots + fragment->n_segments);
+	return segments[base - knots].first_slot +
+	    scale(key0 - *base, segments[base - knots].multiplier);
 }
 
-static const void *
-lookup32(const struct fragment *restrict fragment,
-    const uint64_t key[static 8],
-    uint64_t key0, uint64_t guess)
+/* Raw and compressed lengths of a FRAGMENT_FLAG_COMPRESSED value. */
+struct compressed_header {
+	uint16_t raw_len;
+	uint16_t len;
+};
+
+/*
+ * Resolves a FRAGMENT_FLAG_HEAP value reference.  References past the
+ * heap can only come from a corrupt file; treat their keys as absent.
+ * Compressed values are returned as is, with their raw length.
+ */
+static inline const void *
+heap_value(const struct fragment *restrict fragment,
+    size_t *restrict OUT_value_len, uint64_t ref)
 {
-	const uint64_t *data = fragment_header_data(fragment->data);
-	uint64_t key1 = key[1];
-	size_t item_size = fragment->item_size;
-	size_t max_displacement = fragment->max_displacement;
-
-	(void)key;
-	if (JT_CC_UNLIKELY(key0 == fragment->min + fragment->range)) {
-		if (key1 == UINT64_MAX &&
-		    key[2] == UINT64_MAX &&
-		    key[3] == UINT64_MAX) {
-			return &data[guess * item_size + max_displacement];
-		}
+	struct compressed_header header;
+	const uint8_t *value;
+	uint64_t offset = ref & (((uint64_t)1 << FRAGMENT_HEAP_OFFSET_BITS) - 1);
+	uint64_t len = ref >> FRAGMENT_HEAP_OFFSET_BITS;
+
+	if (JT_CC_UNLIKELY(offset > fragment->heap_size ||
+	    fragment->heap_size - offset < len)) {
+		return NULL;
 	}
 
-	for (size_t i = 0, offset = guess * item_size;
-	     i <= max_displacement;
-	     i++, offset += item_size) {
-		uint64_t c0 = data[offset];
-		uint64_t c1 = data[offset + 1];
+	value = fragment->heap + offset;
+	if ((fragment->flags & FRAGMENT_FLAG_COMPRESSED) == 0) {
+		*OUT_value_len = (size_t)len;
+		return value;
+	}
 
-		if (((c0 ^ key0) | (c1 & key1)) == 0) {
-			if (key[2] == data[offset + 2] &&
-			    key[3] == data[offset + 3]) {
-				return &data[offset];
-			}
-		}
+	/* fragment_value_copy trusts the header's length: check it here. */
+	if (JT_CC_UNLIKELY(len < sizeof(header))) {
+		return NULL;
+	}
 
-		if (c0 > key0) {
-			return NULL;
-		}
+	memcpy(&header, value, sizeof(header));
+	if (JT_CC_UNLIKELY(sizeof(header) + header.len != len)) {
+		return NULL;
 	}
 
-	return NULL;
+	*OUT_value_len = header.raw_len;
+	return value;
 }
 
-static const void *
-lookup64(const struct fragment *restrict fragment,
-    const uint64_t key[static 8],
-    uint64_t key0, uint64_t guess)
+int
+fragment_value_copy(const struct fragment *restrict fragment,
+    void *restrict dst, const void *restrict value, size_t value_len)
 {
-	const uint64_t *data = fragment_header_data(fragment->data);
-	uint64_t key1 = key[1];
-	size_t item_size = fragment->item_size;
-	size_t max_displacement = fragment->max_displacement;
-
-	(void)key;
-	if (JT_CC_UNLIKELY(key0 == fragment->min + fragment->range)) {
-		if (key1 == UINT64_MAX &&
-		    key[2] == UINT64_MAX &&
-		    key[3] == UINT64_MAX &&
-		    key[4] == UINT64_MAX &&
-		    key[5] == UINT64_MAX &&
-		    key[6] == UINT64_MAX &&
-		    key[7] == UINT64_MAX) {
-			return &data[guess * item_size + max_displacement];
-		}
+	struct compressed_header header;
+
+	if ((fragment->flags & FRAGMENT_FLAG_COMPRESSED) == 0) {
+		memcpy(dst, value, value_len);
+		return 0;
 	}
 
-	for (size_t i = 0, offset = guess * item_size;
-	     i <= max_displacement;
-	     i++, offset += item_size) {
-		uint64_t c0 = data[offset];
-		uint64_t c1 = data[offset + 1];
-
-		if (((c0 ^ key0) | (c1 & key1)) == 0) {
-			if (key[2] == data[offset + 2] &&
-			    key[3] == data[offset + 3] &&
-			    key[4] == data[offset + 4] &&
-			    key[5] == data[offset + 5] &&
-			    key[6] == data[offset + 6] &&
-			    key[7] == data[offset + 7]) {
-				return &data[offset];
-			}
-		}
+	memcpy(&header, value, sizeof(header));
+	return lz_decode(dst, value_len,
+	    (const uint8_t *)value + sizeof(header), header.len,
+	    fragment->dict, fragment->dict_size);
+}
 
-		if (c0 > key0) {
-			return NULL;
-		}
+const void *
+fragment_lookup(const struct fragment *restrict fragment,
+    size_t *restrict OUT_value_len,
+    const uint64_t key[static 8])
+{
+	uint64_t delta = key[0] - fragment->min;
+
+	*OUT_value_len = 0;
+	if (JT_CC_UNLIKELY(fragment->data == NULL ||
+	    delta > fragment->range)) {
+		return NULL;
+	}
+
+	/* Most misses stop here, after one filter block. */
+	if (fragment->filter != NULL &&
+	    !fragment_filter_check(fragment,
+	    fragment_filter_hash(key, fragment->key_size))) {
+		return NULL;
 	}
 
-	return NULL;
+	return fragment_lookup_unfiltered(fragment, OUT_value_len, key);
 }
 
 const void *
-fragment_lookup(const struct fragment *restrict fragment,
-    size_t *restrict OUT_item_size,
+fragment_lookup_unfiltered(const struct fragment *restrict fragment,
+    size_t *restrict OUT_value_len,
     const uint64_t key[static 8])
 {
+	const uint64_t *slot;
 	uint64_t key0 = key[0];
 	uint64_t delta = key0 - fragment->min;
-	uint64_t guess;
 
-	*OUT_item_size = 0;
+	*OUT_value_len = 0;
 	if (JT_CC_UNLIKELY(fragment->data == NULL ||
 	    delta > fragment->range)) {
 		return NULL;
 	}
 
-	guess = scale(delta, fragment->multiplier);
-	*OUT_item_size = fragment->item_size;
-	switch (fragment->key_size) {
-	case 1:
-		return lookup8(fragment, key, key0, guess);
-	case 2:
-		return lookup16(fragment, key, key0, guess);
-	case 4:
-		return lookup32(fragment, key, key0, guess);
-	case 8:
-		return lookup64(fragment, key, key0, guess);
-	default:
-		*OUT_item_size = 0;
+	slot = fragment->probe(fragment, key, fragment_guess(fragment, key0));
+	if (slot == NULL) {
 		return NULL;
 	}
 
-	return NULL;
+	return fragment_item_value(fragment, OUT_value_len, slot);
+}
+
+const void *
+fragment_item_value(const struct fragment *restrict fragment,
+    size_t *restrict OUT_value_len, const uint64_t *item)
+{
+	const uint64_t *value;
+	size_t index;
+
+	*OUT_value_len = 0;
+	if ((fragment->flags & FRAGMENT_FLAG_SPLIT) == 0) {
+		value = item + fragment->key_size;
+	} else {
+		/* Only now touch value memory; key_size is a power of 2. */
+		index = (size_t)(item - fragment->items) >>
+		    __builtin_ctz(fragment->key_size);
+		value = fragment->values + index * fragment->value_size;
+	}
+
+	if (fragment->heap != NULL) {
+		return heap_value(fragment, OUT_value_len, *value);
+	}
+
+	*OUT_value_len = sizeof(uint64_t) * fragment->value_size;
+	return value;
+}
+
+/* Compares keys word by word, like the item order. */
+static inline JT_CC_PURE int
+key_compare(const uint64_t *a, const uint64_t *b, size_t key_size)
+{
+
+	for (size_t i = 0; i < key_size; i++) {
+		if (a[i] != b[i]) {
+			return (a[i] < b[i]) ? -1 : 1;
+		}
+	}
+
+	return 0;
+}
+
+uint64_t
+fragment_seek(const struct fragment *fragment, const uint64_t key[static 8])
+{
+	uint64_t slot;
+
+	if (fragment->data == NULL || key[0] < fragment->min) {
+		return 0;
+	}
+
+	if (key[0] - fragment->min > fragment->range) {
+		return fragment->n_slot;
+	}
+
+	/*
+	 * Guesses never decrease, so every key at or after key lives at
+	 * or after key[0]'s guess, and smaller keys at most
+	 * max_displacement slots later.
+	 */
+	for (slot = fragment_guess(fragment, key[0]);
+	    slot < fragment->n_slot; slot++) {
+		const uint64_t *item = &fragment->items[slot * fragment->item_size];
+
+		if (key_compare(item, key, fragment->key_size) >= 0) {
+			break;
+		}
+	}
+
+	return slot;
+}
+
+void
+fragment_prefetch(const struct fragment *fragment,
+    const uint64_t key[static 8])
+{
+	const uint64_t *data;
+	uintptr_t first;
+	size_t span;
+	uint64_t delta = key[0] - fragment->min;
+
+	if (fragment->data == NULL || delta > fragment->range) {
+		return;
+	}
+
+	data = fragment->items;
+	first = (uintptr_t)&data[fragment_guess(fragment, key[0]) *
+	    fragment->item_size];
+	span = sizeof(uint64_t) * fragment->item_size *
+	    ((size_t)fragment->max_displacement + 1);
+
+	/* Most hits are close to the guess: only fetch up to two lines. */
+	__builtin_prefetch((const void *)first);
+	if ((first % 64) + span > 64) {
+		__builtin_prefetch((const void *)(first + 64));
+	}
+
+	return;
 }
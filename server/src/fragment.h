@@ -1,12 +1,74 @@
 #ifndef JETEX_TABLE_FRAGMENT_H
 #define JETEX_TABLE_FRAGMENT_H
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#include "probe.h"
 #include "utility/cc.h"
 
 /* "JetX" in LE. */
 #define FRAGMENT_HEADER_MAGIC 0x5874654AU
 
+/*
+ * Version 0 maps key[0] to a slot with a single linear model, min and
+ * multiplier.  Version 1 replaces it with a piecewise-linear model:
+ * the header is followed by n_segments ascending knots (uint64_t, the
+ * first equal to min), then n_segments struct fragment_segment, padded
+ * to a multiple of 64 bytes; items start right after.  A key goes to
+ * the last segment whose knot is <= key[0], and
+ *
+ *   guess = segment.first_slot + (key[0] - knot) * segment.multiplier / 2^64.
+ *
+ * In both versions, each key lives in slots guess ... guess +
+ * max_displacement, and the max key in the last slot of its window.
+ * Version 1 fragments must keep max_displacement below
+ * FRAGMENT_MODEL_MAX_DISPLACEMENT: builders add segments until it fits.
+ */
+#define FRAGMENT_MODEL_MAX_DISPLACEMENT 64
+
+/*
+ * Items are normally stored whole, key words then value words.  With
+ * FRAGMENT_FLAG_SPLIT, the n_slot = (table_size - items offset) /
+ * (8 * item_size) slots are stored as two arrays instead: all keys,
+ * then all values, so probes only touch key memory.
+ */
+#define FRAGMENT_FLAG_SPLIT 0x1U
+
+/*
+ * With FRAGMENT_FLAG_FILTER, a blocked Bloom filter over the full keys
+ * sits between the header (and model) and the items: a 64-byte struct
+ * fragment_filter, then n_blocks 64-byte blocks.  A key's
+ * fragment_filter_hash() picks one block, and one bit in each of its
+ * 8 words (fragment_filter_block, fragment_filter_bit); builders set
+ * those 8 bits for every key, so a miss usually costs one cache line.
+ */
+#define FRAGMENT_FLAG_FILTER 0x2U
+
+/*
+ * With FRAGMENT_FLAG_HEAP, values are variable-length byte strings
+ * out of line: each slot's value is a single word, (length <<
+ * FRAGMENT_HEAP_OFFSET_BITS) | offset, that points into a packed value
+ * heap.  The heap follows the filter, if any: a 64-byte struct
+ * fragment_heap, then size bytes padded to 64.  item_size must be
+ * key_size + 1.
+ */
+#define FRAGMENT_FLAG_HEAP 0x4U
+#define FRAGMENT_HEAP_OFFSET_BITS 48
+
+/*
+ * FRAGMENT_FLAG_COMPRESSED (only with FRAGMENT_FLAG_HEAP) compresses
+ * each heap value on its own: LE uint16_t raw length, LE uint16_t
+ * compressed length, then that many bytes of LZ4 block (lz.h).
+ * Matches may refer back into the heap's shared dictionary,
+ * dict_size bytes at dict_offset, up to FRAGMENT_DICT_MAX_SIZE.
+ */
+#define FRAGMENT_FLAG_COMPRESSED 0x8U
+#define FRAGMENT_DICT_MAX_SIZE 65536
+
+/* struct fragment only: the fragment has a version 1 model. */
+#define FRAGMENT_FLAG_MODEL 0x80U
+
 struct fragment_header {
 	uint32_t magic;
 	uint32_t version;
@@ -15,33 +77,99 @@ struct fragment_header {
 	uint8_t key_size; /* in uint64_t. */
 	uint16_t item_size; /* in uint64_t. */
 	uint16_t max_displacement;
-	uint16_t padding0;
+	uint16_t flags;
 	uint64_t table_size; /* of the data table, including header. */
 	uint64_t min;
 	uint64_t max;
-	uint64_t multiplier;
-	uint64_t padding1;
+	uint64_t multiplier; /* 0 in version 1. */
+	uint64_t n_segments; /* 0 in version 0. */
 	uint8_t signature[64];
 };
 
+struct fragment_segment {
+	uint64_t first_slot;
+	uint64_t multiplier;
+};
+
+struct fragment_filter {
+	uint64_t n_blocks; /* 1 ... UINT32_MAX. */
+	uint64_t padding[7];
+};
+
+struct fragment_heap {
+	uint64_t size; /* in bytes, < 2^FRAGMENT_HEAP_OFFSET_BITS. */
+	uint64_t dict_offset; /* in the heap. */
+	uint64_t dict_size; /* 0 without a dictionary. */
+	uint64_t padding[5];
+};
+
+/*
+ * Two cache lines: lookups that the filter rejects only read the
+ * first one.
+ */
 struct fragment {
 	const struct fragment_header *data;
-	uint64_t n_bytes;
+	const uint64_t *items; /* first slot, after the header and model. */
+	const uint64_t *filter; /* first block, or NULL. */
 	uint64_t min;
 	uint64_t range;
-	uint64_t multiplier;
-	uint32_t item_size; /* in uint64_t. */
-	uint32_t max_displacement;
-	unsigned int key_size; /* in uint64_t */
-	int fd;
-	int64_t data_offset;
+	union {
+		uint64_t multiplier; /* linear model. */
+		uint64_t n_segments; /* FRAGMENT_FLAG_MODEL. */
+	};
+	probe_fn *probe; /* chosen by fragment_map for this layout and CPU. */
+	uint32_t n_filter_block;
+	uint16_t item_size; /* in uint64_t, between consecutive slots. */
+	uint8_t key_size; /* in uint64_t */
+	uint8_t flags;
+	/* Second line: only read once the filter lets a key through. */
+	const uint64_t *values; /* FRAGMENT_FLAG_SPLIT only. */
+	const uint8_t *heap; /* FRAGMENT_FLAG_HEAP only. */
+	uint64_t heap_size;
+	const uint8_t *dict; /* FRAGMENT_FLAG_COMPRESSED only. */
+	uint64_t n_slot;
+	uint16_t value_size; /* in uint64_t. */
+	uint16_t max_displacement;
+	uint32_t dict_size;
+	uint64_t padding[2];
 } __attribute__((__aligned__(64)));
 
-static inline const void *
-fragment_header_data(const struct fragment_header *header)
+static inline JT_CC_PURE uint64_t
+fragment_filter_hash(const uint64_t *key, size_t key_size)
+{
+	uint64_t hash = 0;
+
+	/* MurmurHash3's fmix64 after mixing in each word. */
+	for (size_t i = 0; i < key_size; i++) {
+		hash ^= key[i];
+		hash ^= hash >> 33;
+		hash *= 0xff51afd7ed558ccdULL;
+		hash ^= hash >> 33;
+		hash *= 0xc4ceb9fe1a85ec53ULL;
+		hash ^= hash >> 33;
+	}
+
+	return hash;
+}
+
+/* Block index in [0, n_blocks), from the hash's high half. */
+static inline JT_CC_CONST uint64_t
+fragment_filter_block(uint64_t hash, uint64_t n_blocks)
 {
 
-	return (header + 1);
+	return ((hash >> 32) * n_blocks) >> 32;
+}
+
+/* Mask for word i (0 ... 7) of the block, from the hash's low half. */
+static inline JT_CC_CONST uint64_t
+fragment_filter_bit(uint64_t hash, size_t i)
+{
+	static const uint32_t salts[8] = {
+		0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+		0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+	};
+
+	return (uint64_t)1 << ((uint32_t)hash * salts[i] >> 26);
 }
 
 JT_CC_PUBLIC int
@@ -50,14 +178,119 @@ jetex_table_fragment_validate(int fd);
 int
 fragment_validate(int fd, uint64_t *OUT_pattern, uint8_t *OUT_nbits);
 
+/* fragment_map flags. */
+#define FRAGMENT_MAP_HUGE_PAGES 0x1U
+
+struct fragment
+fragment_map(int fd, unsigned int flags);
+
+/*
+ * Copies fragment to anonymous memory bound to NUMA node; the copy is
+ * independent of the original, and must also be fragment_unmap()ed.
+ * Returns a fragment with data == NULL on failure.
+ */
 struct fragment
-fragment_map(int fd);
+fragment_replicate(const struct fragment *fragment, unsigned int node,
+    unsigned int flags);
 
 void
 fragment_unmap(const struct fragment *fragment);
 
+/*
+ * Faults in len bytes of fragment's mapping, starting at offset (a
+ * multiple of the page size).  0 -> ok.
+ */
+int
+fragment_populate(const struct fragment *fragment,
+    uint64_t offset, uint64_t len);
+
+/* Locks the whole mapping in memory.  0 -> ok. */
+int
+fragment_lock(const struct fragment *fragment);
+
+/*
+ * Returns key's value, and stores its length in bytes in
+ * OUT_value_len; NULL if key isn't in fragment.
+ */
 const void *
 fragment_lookup(const struct fragment *restrict fragment,
-    size_t *restrict OUT_item_size,
+    size_t *restrict OUT_value_len,
+    const uint64_t key[static 8]);
+
+/*
+ * Copies the value_len-byte value fragment_lookup returned to dst,
+ * decompressing it for FRAGMENT_FLAG_COMPRESSED fragments (where
+ * value isn't the raw bytes).  0 -> ok, -1 if the value is corrupt.
+ */
+int
+fragment_value_copy(const struct fragment *restrict fragment,
+    void *restrict dst, const void *restrict value, size_t value_len);
+
+/*
+ * Returns the value of the item whose key is at item (in
+ * fragment->items), and its length, like fragment_lookup.
+ */
+const void *
+fragment_item_value(const struct fragment *restrict fragment,
+    size_t *restrict OUT_value_len, const uint64_t *item);
+
+/*
+ * Returns the first slot whose item sorts at or after key, or n_slot.
+ * Items are sorted on their whole key, word 0 first; slots without a
+ * key repeat a neighbouring item, so scans must skip repeats.
+ */
+JT_CC_PURE uint64_t
+fragment_seek(const struct fragment *fragment, const uint64_t key[static 8]);
+
+/*
+ * Like fragment_lookup, but skips the filter: for keys that already
+ * passed fragment_filter_check.
+ */
+const void *
+fragment_lookup_unfiltered(const struct fragment *restrict fragment,
+    size_t *restrict OUT_value_len,
     const uint64_t key[static 8]);
+
+/*
+ * Prefetches the first cache lines fragment_lookup would probe for
+ * key.  Does nothing if key is out of the fragment's range.
+ */
+void
+fragment_prefetch(const struct fragment *fragment,
+    const uint64_t key[static 8]);
+
+/* Prefetches the filter block for hash; fragment must have a filter. */
+static inline void
+fragment_filter_prefetch(const struct fragment *fragment, uint64_t hash)
+{
+
+	__builtin_prefetch(fragment->filter +
+	    8 * fragment_filter_block(hash, fragment->n_filter_block));
+	return;
+}
+
+/*
+ * Checks key's hash against fragment's filter: false means key is
+ * definitely absent.  Always true without a filter.
+ */
+static inline JT_CC_PURE bool
+fragment_filter_check(const struct fragment *fragment, uint64_t hash)
+{
+	const uint64_t *block;
+	uint64_t missing = 0;
+
+	if (fragment->filter == NULL) {
+		return true;
+	}
+
+	block = fragment->filter +
+	    8 * fragment_filter_block(hash, fragment->n_filter_block);
+	for (size_t i = 0; i < 8; i++) {
+		uint64_t bit = fragment_filter_bit(hash, i);
+
+		missing |= bit & ~block[i];
+	}
+
+	return missing == 0;
+}
 #endif /* !JETEX_TABLE_FRAGMENT_H */
@@ -0,0 +1,105 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+#include "utility/cc.h"
+
+/* Adds extension bytes at src[*in ...] to *len.  0 -> ok. */
+static inline int
+read_length(const uint8_t *src, size_t src_len, size_t *in, size_t *len)
+{
+
+	for (;;) {
+		uint8_t byte;
+
+		if (*in >= src_len) {
+			return -1;
+		}
+
+		byte = src[(*in)++];
+		*len += byte;
+		if (byte != 255) {
+			return 0;
+		}
+
+		/* Nothing we decode is anywhere near that long. */
+		if (*len > SIZE_MAX / 2) {
+			return -1;
+		}
+	}
+}
+
+int
+lz_decode(uint8_t *restrict dst, size_t dst_len,
+    const uint8_t *restrict src, size_t src_len,
+    const uint8_t *dict, size_t dict_len)
+{
+	size_t in = 0;
+	size_t out = 0;
+
+	while (in < src_len) {
+		uint8_t token = src[in++];
+		size_t literal = token >> 4;
+		size_t match = token & 15U;
+		size_t offset;
+
+		if (literal == 15 &&
+		    read_length(src, src_len, &in, &literal) != 0) {
+			return -1;
+		}
+
+		if (literal > src_len - in || literal > dst_len - out) {
+			return -1;
+		}
+
+		memcpy(dst + out, src + in, literal);
+		in += literal;
+		out += literal;
+		if (in == src_len) {
+			break;
+		}
+
+		if (src_len - in < 2) {
+			return -1;
+		}
+
+		offset = (size_t)src[in] | (size_t)src[in + 1] << 8;
+		in += 2;
+		if (match == 15 &&
+		    read_length(src, src_len, &in, &match) != 0) {
+			return -1;
+		}
+
+		match += 4;
+		if (offset == 0 || offset > out + dict_len ||
+		    match > dst_len - out) {
+			return -1;
+		}
+
+		/* The part of the match that starts in the dictionary. */
+		if (offset > out) {
+			size_t back = offset - out;
+			size_t n = (back < match) ? back : match;
+
+			memcpy(dst + out, dict + dict_len - back, n);
+			out += n;
+			match -= n;
+			if (match == 0) {
+				continue;
+			}
+		}
+
+		if (offset >= match) {
+			memcpy(dst + out, dst + out - offset, match);
+			out += match;
+		} else {
+			/* Overlapping match: repeats the last offset bytes. */
+			for (size_t i = 0; i < match; i++, out++) {
+				dst[out] = dst[out - offset];
+			}
+		}
+	}
+
+	return (out == dst_len) ? 0 : -1;
+}
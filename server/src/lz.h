@@ -0,0 +1,27 @@
+#ifndef JETEX_LZ_H
+#define JETEX_LZ_H
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Decoder for the LZ4 block format, with an optional external
+ * dictionary: matches may reach up to 65535 bytes back, past the start
+ * of dst and into the end of dict.  Builders can produce compatible
+ * blocks with LZ4_compress_fast_continue() after LZ4_loadDict().
+ *
+ * Sequences are a token (literal length << 4 | (match length - 4)),
+ * then literal length extension bytes (if the nibble is 15), literals,
+ * a LE uint16_t match offset, and match length extension bytes; the
+ * last sequence stops after its literals.
+ */
+
+/*
+ * Decodes src_len bytes of src into exactly dst_len bytes at dst.
+ * Never reads or writes out of bounds, even for corrupt input.
+ * 0 -> ok, -1 if src is malformed or doesn't decode to dst_len bytes.
+ */
+int
+lz_decode(uint8_t *restrict dst, size_t dst_len,
+    const uint8_t *restrict src, size_t src_len,
+    const uint8_t *dict, size_t dict_len);
+#endif /* !JETEX_LZ_H */
@@ -25,18 +25,63 @@ cmp_jetex_table_ptr(const void *vx, const void *vy)
 	return 0;
 }
 
+static void
+namespace_index_insert(struct jetex_namespace *ns, const struct jetex_table *table)
+{
+	size_t i = (size_t)(namespace_hash(table->uuid) >> 32);
+
+	for (;; i++) {
+		struct namespace_slot *slot = &ns->index[i & ns->index_mask];
+
+		if (slot->table == NULL) {
+			*slot = (struct namespace_slot) {
+				.uuid = { table->uuid[0], table->uuid[1] },
+				.table = table
+			};
+			return;
+		}
+
+		/* Duplicate UUID: first one wins. */
+		if (slot->uuid[0] == table->uuid[0] &&
+		    slot->uuid[1] == table->uuid[1]) {
+			return;
+		}
+	}
+}
+
 struct jetex_namespace *
 jetex_namespace_create(const struct jetex_table **tables, size_t n)
 {
 	struct jetex_namespace *ret;
+	size_t n_slot = 2;
+
+	/* At most half full; uuids are inlined to skip a pointer chase. */
+	while (n_slot < 2 * n) {
+		n_slot *= 2;
+	}
 
 	ret = calloc(1, sizeof(*ret) + n * sizeof(tables[0]));
+	if (ret == NULL) {
+		return NULL;
+	}
+
+	ret->index = calloc(n_slot, sizeof(ret->index[0]));
+	if (ret->index == NULL) {
+		free(ret);
+		return NULL;
+	}
+
+	ret->index_mask = n_slot - 1;
 	ret->ntable = n;
 	for (size_t i = 0; i < n; i++) {
 		ret->tables[i] = tables[i];
 	}
 
 	qsort(ret->tables, n, sizeof(ret->tables[0]), cmp_jetex_table_ptr);
+	for (size_t i = 0; i < n; i++) {
+		namespace_index_insert(ret, ret->tables[i]);
+	}
+
 	return ret;
 }
 
@@ -59,6 +104,9 @@ jetex_namespace_destroy(struct jetex_namespace *ns, int recursive)
 	}
 
 	ns->ntable = 0;
+	free(ns->index);
+	ns->index = NULL;
 	free(ns);
 	return;
 }
+
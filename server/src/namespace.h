@@ -1,13 +1,24 @@
 #ifndef JETEX_NAMESPACE_H
 #define JETEX_NAMESPACE_H
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 
 #include "utility/cc.h"
 
 struct jetex_table;
 
+/* Open-addressed UUID -> table index; table is NULL for empty slots. */
+struct namespace_slot {
+	uint64_t uuid[2];
+	const struct jetex_table *table;
+	uint64_t padding;
+};
+
 struct jetex_namespace {
 	size_t ntable;
+	size_t index_mask; /* index has index_mask + 1 slots. */
+	struct namespace_slot *index;
 	const struct jetex_table *tables[];
 };
 
@@ -16,4 +27,36 @@ jetex_namespace_create(const struct jetex_table **tables, size_t nt);
 
 JT_CC_PUBLIC void
 jetex_namespace_destroy(struct jetex_namespace *ns, int recursive);
+
+static inline uint64_t
+namespace_hash(const uint64_t uuid[static 2])
+{
+
+	return (uuid[0] ^ (uuid[1] * 0x9E3779B97F4A7C15ULL)) * 0xD6E8FEB86659FD93ULL;
+}
+
+/*
+ * Returns the table with that UUID, or NULL if there is none.  The
+ * index is at most half full, so this is ~1.5 probes on average.
+ */
+static inline JT_CC_PURE const struct jetex_table *
+namespace_find(const struct jetex_namespace *ns, const uint8_t uuid[static 16])
+{
+	uint64_t key[2];
+	size_t i;
+
+	memcpy(key, uuid, sizeof(key));
+	i = (size_t)(namespace_hash(key) >> 32);
+	for (;; i++) {
+		const struct namespace_slot *slot = &ns->index[i & ns->index_mask];
+
+		if (slot->table == NULL) {
+			return NULL;
+		}
+
+		if (slot->uuid[0] == key[0] && slot->uuid[1] == key[1]) {
+			return slot->table;
+		}
+	}
+}
 #endif /* !JETEX_NAMESPACE_H */
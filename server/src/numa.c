@@ -0,0 +1,152 @@
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "numa.h"
+#include "utility/cc.h"
+
+/* Enough for CONFIG_NODES_SHIFT = 10; mbind wants one extra bit. */
+#define NUMA_MAX_NODE 1024
+#define NUMA_MASK_BITS (8 * sizeof(unsigned long))
+#define NUMA_MASK_WORDS (NUMA_MAX_NODE / NUMA_MASK_BITS)
+
+/*
+ * Sets the bits of OUT_mask for a sysfs node list, e.g., "0-1,3".
+ * 0 -> ok.
+ */
+static int
+node_list_read(unsigned long OUT_mask[static NUMA_MASK_WORDS],
+    const char *path)
+{
+	char buf[4096];
+	const char *cur = buf;
+	FILE *file;
+	size_t len;
+
+	file = fopen(path, "r");
+	if (file == NULL) {
+		return -1;
+	}
+
+	len = fread(buf, 1, sizeof(buf) - 1, file);
+	fclose(file);
+	buf[len] = '\0';
+	while (*cur >= '0' && *cur <= '9') {
+		char *end;
+		long lo, hi;
+
+		lo = hi = strtol(cur, &end, 10);
+		if (*end == '-') {
+			hi = strtol(end + 1, &end, 10);
+		}
+
+		if (lo < 0 || hi >= NUMA_MAX_NODE || lo > hi) {
+			return -1;
+		}
+
+		for (long node = lo; node <= hi; node++) {
+			OUT_mask[(size_t)node / NUMA_MASK_BITS] |=
+			    1UL << ((size_t)node % NUMA_MASK_BITS);
+		}
+
+		cur = (*end == ',') ? end + 1 : end;
+	}
+
+	return 0;
+}
+
+unsigned int
+numa_n_node(void)
+{
+	char buf[4096];
+	FILE *file;
+	size_t len;
+	long max = 0;
+
+	/* A list of ranges, e.g., "0-1,3": we only want the last number. */
+	file = fopen("/sys/devices/system/node/online", "r");
+	if (file == NULL) {
+		return 1;
+	}
+
+	len = fread(buf, 1, sizeof(buf) - 1, file);
+	fclose(file);
+	buf[len] = '\0';
+	for (size_t i = 0; i < len; i++) {
+		if (buf[i] >= '0' && buf[i] <= '9' &&
+		    (i == 0 || buf[i - 1] == ',' || buf[i - 1] == '-')) {
+			max = strtol(&buf[i], NULL, 10);
+		}
+	}
+
+	if (max < 0 || max >= NUMA_MAX_NODE) {
+		return 1;
+	}
+
+	return 1 + (unsigned int)max;
+}
+
+size_t
+numa_usable_nodes(uint8_t *OUT_usable, size_t n)
+{
+	unsigned long has_memory[NUMA_MASK_WORDS] = { 0 };
+	unsigned long allowed[NUMA_MASK_WORDS] = { 0 };
+	size_t n_usable = 0;
+
+	/* Kernels without has_memory (before 2.6.35) only had online. */
+	if (node_list_read(has_memory,
+	    "/sys/devices/system/node/has_memory") != 0 &&
+	    node_list_read(has_memory, "/sys/devices/system/node/online") != 0) {
+		has_memory[0] = 1;
+	}
+
+	if (syscall(__NR_get_mempolicy, NULL, allowed,
+	    (unsigned long)NUMA_MAX_NODE + 1, NULL,
+	    (unsigned long)MPOL_F_MEMS_ALLOWED) != 0) {
+		for (size_t i = 0; i < NUMA_MASK_WORDS; i++) {
+			allowed[i] = ~0UL;
+		}
+	}
+
+	for (size_t node = 0; node < n; node++) {
+		unsigned long bit = 1UL << (node % NUMA_MASK_BITS);
+		size_t word = node / NUMA_MASK_BITS;
+
+		OUT_usable[node] = node < NUMA_MAX_NODE &&
+		    (has_memory[word] & allowed[word] & bit) != 0;
+		n_usable += OUT_usable[node];
+	}
+
+	return n_usable;
+}
+
+unsigned int
+numa_local_node(void)
+{
+	unsigned int cpu;
+	unsigned int node;
+
+	if (getcpu(&cpu, &node) != 0) {
+		return 0;
+	}
+
+	return node;
+}
+
+int
+numa_bind(void *addr, size_t len, unsigned int node)
+{
+	unsigned long mask[NUMA_MASK_WORDS] = { 0 };
+
+	if (node >= NUMA_MAX_NODE) {
+		return -1;
+	}
+
+	mask[node / NUMA_MASK_BITS] = 1UL << (node % NUMA_MASK_BITS);
+	return (int)syscall(__NR_mbind, addr, len, MPOL_BIND,
+	    mask, (unsigned long)NUMA_MAX_NODE + 1, 0U);
+}
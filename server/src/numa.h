@@ -0,0 +1,36 @@
+#ifndef JETEX_NUMA_H
+#define JETEX_NUMA_H
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Minimal NUMA support, straight from sysfs and syscalls: we don't
+ * want to depend on libnuma.
+ */
+
+/*
+ * Highest online node + 1; 1 if unknown or not NUMA.  Ids may have
+ * gaps, and not every node below may be usable.
+ */
+unsigned int
+numa_n_node(void);
+
+/*
+ * Sets OUT_usable[node] for nodes 0 ... n - 1 that have memory the
+ * caller may allocate (in its cpuset's mems), i.e., that numa_bind
+ * can bind to; clears it for the others.  Returns how many are set.
+ */
+size_t
+numa_usable_nodes(uint8_t *OUT_usable, size_t n);
+
+/* Node of the CPU the caller is running on; 0 if unknown. */
+unsigned int
+numa_local_node(void);
+
+/*
+ * Binds len bytes at addr (page-aligned, not yet touched) to node:
+ * pages will only be allocated there.  0 -> ok.
+ */
+int
+numa_bind(void *addr, size_t len, unsigned int node);
+#endif /* !JETEX_NUMA_H */
@@ -0,0 +1,483 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__)
+# include <immintrin.h>
+# define PROBE_X86 1
+#endif
+
+#include "fragment.h"
+#include "probe.h"
+#include "utility/cc.h"
+
+/*
+ * Kernels are instantiated from always-inline templates with a
+ * constant key_size (and item_size, for packed layouts), so the
+ * compiler fully unrolls key comparisons.
+ */
+#define PROBE_INLINE inline __attribute__((__always_inline__))
+
+/*
+ * Schema-specific kernels also fix item_size, which turns the probe
+ * stride into an immediate; 0 means the fragment's runtime value.
+ */
+#define PROBE_ITEM_SIZE(ITEM_SIZE)					\
+	((ITEM_SIZE) != 0 ? (size_t)(ITEM_SIZE) : (size_t)fragment->item_size)
+
+/*
+ * The max key lives in the last slot of its guess's probe window;
+ * skip the scan for it.  Returns NULL for every other key.
+ */
+static PROBE_INLINE const void *
+probe_max_key(const struct fragment *restrict fragment,
+    const uint64_t key[static 8], uint64_t guess,
+    size_t key_size, size_t item_size)
+{
+	const uint64_t *data = fragment->items;
+
+	if (JT_CC_LIKELY(key[0] != fragment->min + fragment->range)) {
+		return NULL;
+	}
+
+	for (size_t i = 1; i < key_size; i++) {
+		if (key[i] != UINT64_MAX) {
+			return NULL;
+		}
+	}
+
+	return &data[(guess + fragment->max_displacement) * item_size];
+}
+
+/*
+ * Scans slots i ... max_displacement, one at a time, starting at word
+ * offset.  Items are sorted on their first word: stop at the first
+ * slot that sorts after key.
+ */
+static PROBE_INLINE JT_CC_PURE const void *
+scan_scalar(const uint64_t *data, const uint64_t key[static 8],
+    size_t key_size, size_t item_size,
+    size_t i, size_t offset, size_t max_displacement)
+{
+	uint64_t key0 = key[0];
+
+#pragma GCC unroll 2
+	for (; i <= max_displacement; i++, offset += item_size) {
+		uint64_t c0 = data[offset];
+
+		if (c0 == key0) {
+			uint64_t diff = 0;
+
+			/* No early exit: compare all words, branch once. */
+			for (size_t j = 1; j < key_size; j++) {
+				diff |= data[offset + j] ^ key[j];
+			}
+
+			if (diff == 0) {
+				return &data[offset];
+			}
+		}
+
+		if (c0 > key0) {
+			return NULL;
+		}
+	}
+
+	return NULL;
+}
+
+static PROBE_INLINE const void *
+probe_scalar(const struct fragment *restrict fragment,
+    const uint64_t key[static 8], uint64_t guess,
+    size_t key_size, size_t item_size)
+{
+	const void *max;
+
+	max = probe_max_key(fragment, key, guess, key_size, item_size);
+	if (max != NULL) {
+		return max;
+	}
+
+	return scan_scalar(fragment->items, key,
+	    key_size, item_size,
+	    0, guess * item_size, fragment->max_displacement);
+}
+
+#define DEFINE_SCALAR(NAME, KEY_SIZE, ITEM_SIZE)			\
+	static const void *						\
+	NAME(const struct fragment *restrict fragment,			\
+	    const uint64_t key[static 8], uint64_t guess)		\
+	{								\
+									\
+		return probe_scalar(fragment, key, guess,		\
+		    KEY_SIZE, PROBE_ITEM_SIZE(ITEM_SIZE));		\
+	}
+
+DEFINE_SCALAR(probe_scalar_1, 1, 0)
+DEFINE_SCALAR(probe_scalar_2, 2, 0)
+DEFINE_SCALAR(probe_scalar_4, 4, 0)
+DEFINE_SCALAR(probe_scalar_8, 8, 0)
+/* 8-byte keys with 8- and 16-byte values. */
+DEFINE_SCALAR(probe_scalar_1_2, 1, 2)
+DEFINE_SCALAR(probe_scalar_1_3, 1, 3)
+
+#undef DEFINE_SCALAR
+
+#ifdef PROBE_X86
+
+/*
+ * Decides a vector of packed slots (item_size == key_size, so slots
+ * are contiguous).  ne has a bit for each 64-bit lane that differs from
+ * the key, gt a bit for each lane greater than key[0]; a slot's first
+ * lane is at a multiple of key_size.
+ *
+ * Returns 1 and stores the matching slot's first lane in OUT_lane,
+ * -1 if the scan should stop, 0 to keep going.
+ */
+static PROBE_INLINE int
+packed_decide(uint32_t ne, uint32_t gt, size_t n_lane, size_t key_size,
+    unsigned int *OUT_lane)
+{
+	uint32_t first = 0;
+	uint32_t slot_ne = ne;
+	uint32_t eq;
+	uint32_t stop;
+
+	for (size_t i = 0; i < n_lane; i += key_size) {
+		first |= 1U << i;
+	}
+
+	/* Fold each slot's lanes into its first lane. */
+	for (size_t j = 1; j < key_size; j++) {
+		slot_ne |= ne >> j;
+	}
+
+	eq = ~slot_ne & first;
+	stop = eq | (gt & first);
+	if (stop == 0) {
+		return 0;
+	}
+
+	*OUT_lane = (unsigned int)__builtin_ctz(stop);
+	return ((eq >> *OUT_lane) & 1) != 0 ? 1 : -1;
+}
+
+__attribute__((__target__("sse4.2")))
+static PROBE_INLINE bool
+equal_sse(const uint64_t *candidate, const uint64_t key[static 8],
+    size_t key_size)
+{
+	__m128i diff = _mm_setzero_si128();
+
+	for (size_t j = 0; j < key_size; j += 2) {
+		__m128i x = _mm_loadu_si128((const void *)&candidate[j]);
+		__m128i y = _mm_loadu_si128((const void *)&key[j]);
+
+		diff = _mm_or_si128(diff, _mm_xor_si128(x, y));
+	}
+
+	return _mm_testz_si128(diff, diff) != 0;
+}
+
+__attribute__((__target__("avx2")))
+static PROBE_INLINE bool
+equal_avx2(const uint64_t *candidate, const uint64_t key[static 8],
+    size_t key_size)
+{
+	__m256i diff = _mm256_setzero_si256();
+
+	for (size_t j = 0; j < key_size; j += 4) {
+		__m256i x = _mm256_loadu_si256((const void *)&candidate[j]);
+		__m256i y = _mm256_loadu_si256((const void *)&key[j]);
+
+		diff = _mm256_or_si256(diff, _mm256_xor_si256(x, y));
+	}
+
+	return _mm256_testz_si256(diff, diff) != 0;
+}
+
+__attribute__((__target__("avx512f")))
+static PROBE_INLINE bool
+equal_avx512(const uint64_t *candidate, const uint64_t key[static 8])
+{
+
+	return _mm512_cmpneq_epu64_mask(_mm512_loadu_si512(candidate),
+	    _mm512_loadu_si512(key)) == 0;
+}
+
+/*
+ * One slot per iteration, with the whole key compared in one to four
+ * vector operations.  EQUAL(candidate) must be a vector comparison.
+ */
+#define DEFINE_VECTOR(NAME, TARGET, KEY_SIZE, ITEM_SIZE, EQUAL)		\
+	__attribute__((__target__(TARGET)))				\
+	static const void *						\
+	NAME(const struct fragment *restrict fragment,			\
+	    const uint64_t key[static 8], uint64_t guess)		\
+	{								\
+		const uint64_t *data = fragment->items;			\
+		size_t item_size = PROBE_ITEM_SIZE(ITEM_SIZE);		\
+		size_t max_displacement = fragment->max_displacement;	\
+		uint64_t key0 = key[0];					\
+		const void *max;					\
+									\
+		max = probe_max_key(fragment, key, guess,		\
+		    KEY_SIZE, item_size);				\
+		if (max != NULL) {					\
+			return max;					\
+		}							\
+									\
+		_Pragma("GCC unroll 2")					\
+		for (size_t i = 0, offset = guess * item_size;		\
+		     i <= max_displacement;				\
+		     i++, offset += item_size) {			\
+			const uint64_t *candidate = &data[offset];	\
+									\
+			if (EQUAL) {					\
+				return candidate;			\
+			}						\
+									\
+			if (candidate[0] > key0) {			\
+				return NULL;				\
+			}						\
+		}							\
+									\
+		return NULL;						\
+	}
+
+DEFINE_VECTOR(probe_sse_2, "sse4.2", 2, 0, equal_sse(candidate, key, 2))
+DEFINE_VECTOR(probe_sse_4, "sse4.2", 4, 0, equal_sse(candidate, key, 4))
+DEFINE_VECTOR(probe_sse_8, "sse4.2", 8, 0, equal_sse(candidate, key, 8))
+DEFINE_VECTOR(probe_avx2_4, "avx2", 4, 0, equal_avx2(candidate, key, 4))
+DEFINE_VECTOR(probe_avx2_8, "avx2", 8, 0, equal_avx2(candidate, key, 8))
+DEFINE_VECTOR(probe_avx512_8, "avx512f", 8, 0, equal_avx512(candidate, key))
+/* 16-byte keys with 16-byte values, 32-byte keys with 64-byte values. */
+DEFINE_VECTOR(probe_sse_2_4, "sse4.2", 2, 4, equal_sse(candidate, key, 2))
+DEFINE_VECTOR(probe_sse_4_12, "sse4.2", 4, 12, equal_sse(candidate, key, 4))
+DEFINE_VECTOR(probe_avx2_4_12, "avx2", 4, 12, equal_avx2(candidate, key, 4))
+
+#undef DEFINE_VECTOR
+
+/* Packed slots, 4 lanes (1 to 4 slots) per iteration. */
+__attribute__((__target__("avx2")))
+static PROBE_INLINE JT_CC_PURE const void *
+probe_packed_avx2(const struct fragment *restrict fragment,
+    const uint64_t key[static 8], uint64_t guess, size_t key_size)
+{
+	const uint64_t *data = fragment->items;
+	size_t max_displacement = fragment->max_displacement;
+	size_t per_vector = 4 / key_size;
+	uint64_t pattern[4];
+	__m256i needle;
+	__m256i sign;
+	__m256i first;
+	const void *max;
+	size_t i = 0;
+	size_t offset = guess * key_size;
+
+	max = probe_max_key(fragment, key, guess, key_size, key_size);
+	if (max != NULL) {
+		return max;
+	}
+
+	for (size_t j = 0; j < 4; j++) {
+		pattern[j] = key[j % key_size];
+	}
+
+	/* AVX2 only has signed comparisons: flip sign bits. */
+	needle = _mm256_loadu_si256((const void *)pattern);
+	sign = _mm256_set1_epi64x(INT64_MIN);
+	first = _mm256_xor_si256(_mm256_set1_epi64x((long long)key[0]), sign);
+	for (; i + per_vector <= max_displacement + 1;
+	     i += per_vector, offset += 4) {
+		__m256i c = _mm256_loadu_si256((const void *)&data[offset]);
+		uint32_t eq, gt;
+		unsigned int lane;
+		int r;
+
+		eq = (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(
+		    _mm256_cmpeq_epi64(c, needle)));
+		gt = (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(
+		    _mm256_cmpgt_epi64(_mm256_xor_si256(c, sign), first)));
+		r = packed_decide(~eq & 0xFU, gt, 4, key_size, &lane);
+		if (r > 0) {
+			return &data[offset + lane];
+		}
+
+		if (r < 0) {
+			return NULL;
+		}
+	}
+
+	return scan_scalar(data, key, key_size, key_size,
+	    i, offset, max_displacement);
+}
+
+/* Packed slots, 8 lanes (1 to 8 slots) per iteration. */
+__attribute__((__target__("avx512f")))
+static PROBE_INLINE JT_CC_PURE const void *
+probe_packed_avx512(const struct fragment *restrict fragment,
+    const uint64_t key[static 8], uint64_t guess, size_t key_size)
+{
+	const uint64_t *data = fragment->items;
+	size_t max_displacement = fragment->max_displacement;
+	size_t per_vector = 8 / key_size;
+	uint64_t pattern[8];
+	__m512i needle;
+	__m512i first;
+	const void *max;
+	size_t i = 0;
+	size_t offset = guess * key_size;
+
+	max = probe_max_key(fragment, key, guess, key_size, key_size);
+	if (max != NULL) {
+		return max;
+	}
+
+	for (size_t j = 0; j < 8; j++) {
+		pattern[j] = key[j % key_size];
+	}
+
+	needle = _mm512_loadu_si512(pattern);
+	first = _mm512_set1_epi64((long long)key[0]);
+	for (; i + per_vector <= max_displacement + 1;
+	     i += per_vector, offset += 8) {
+		__m512i c = _mm512_loadu_si512(&data[offset]);
+		unsigned int lane;
+		int r;
+
+		r = packed_decide(_mm512_cmpneq_epu64_mask(c, needle),
+		    _mm512_cmpgt_epu64_mask(c, first), 8, key_size, &lane);
+		if (r > 0) {
+			return &data[offset + lane];
+		}
+
+		if (r < 0) {
+			return NULL;
+		}
+	}
+
+	return scan_scalar(data, key, key_size, key_size,
+	    i, offset, max_displacement);
+}
+
+#define DEFINE_PACKED(ISA, TARGET, KEY_SIZE)				\
+	__attribute__((__target__(TARGET)))				\
+	static const void *						\
+	probe_packed_##ISA##_##KEY_SIZE(const struct fragment *restrict fragment, \
+	    const uint64_t key[static 8], uint64_t guess)		\
+	{								\
+									\
+		return probe_packed_##ISA(fragment, key, guess, KEY_SIZE); \
+	}
+
+DEFINE_PACKED(avx2, "avx2", 1)
+DEFINE_PACKED(avx2, "avx2", 2)
+DEFINE_PACKED(avx512, "avx512f", 1)
+DEFINE_PACKED(avx512, "avx512f", 2)
+DEFINE_PACKED(avx512, "avx512f", 4)
+
+#undef DEFINE_PACKED
+
+#endif /* PROBE_X86 */
+
+probe_fn *
+probe_select(const struct fragment *fragment)
+{
+	bool packed = (fragment->item_size == fragment->key_size);
+
+#ifdef PROBE_X86
+	bool avx512 = __builtin_cpu_supports("avx512f") != 0;
+	bool avx2 = __builtin_cpu_supports("avx2") != 0;
+	bool sse = __builtin_cpu_supports("sse4.2") != 0;
+
+	switch (fragment->key_size) {
+	case 1:
+		if (packed && avx512) {
+			return probe_packed_avx512_1;
+		}
+
+		if (packed && avx2) {
+			return probe_packed_avx2_1;
+		}
+
+		break;
+	case 2:
+		if (packed && avx512) {
+			return probe_packed_avx512_2;
+		}
+
+		if (packed && avx2) {
+			return probe_packed_avx2_2;
+		}
+
+		if (sse && fragment->item_size == 4) {
+			return probe_sse_2_4;
+		}
+
+		if (sse) {
+			return probe_sse_2;
+		}
+
+		break;
+	case 4:
+		if (packed && avx512) {
+			return probe_packed_avx512_4;
+		}
+
+		if (avx2 && fragment->item_size == 12) {
+			return probe_avx2_4_12;
+		}
+
+		if (avx2) {
+			return probe_avx2_4;
+		}
+
+		if (sse && fragment->item_size == 12) {
+			return probe_sse_4_12;
+		}
+
+		if (sse) {
+			return probe_sse_4;
+		}
+
+		break;
+	case 8:
+		if (avx512) {
+			return probe_avx512_8;
+		}
+
+		if (avx2) {
+			return probe_avx2_8;
+		}
+
+		if (sse) {
+			return probe_sse_8;
+		}
+
+		break;
+	default:
+		break;
+	}
+#else
+	(void)packed;
+#endif
+
+	switch (fragment->key_size) {
+	case 1:
+		switch (fragment->item_size) {
+		case 2:
+			return probe_scalar_1_2;
+		case 3:
+			return probe_scalar_1_3;
+		default:
+			return probe_scalar_1;
+		}
+	case 2:
+		return probe_scalar_2;
+	case 4:
+		return probe_scalar_4;
+	default:
+		return probe_scalar_8;
+	}
+}
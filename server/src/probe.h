@@ -0,0 +1,24 @@
+#ifndef JETEX_PROBE_H
+#define JETEX_PROBE_H
+#include <stdint.h>
+
+#include "utility/cc.h"
+
+struct fragment;
+
+/*
+ * Scans fragment's probe window for key, starting at slot guess.  The
+ * caller has already checked that key[0] is in the fragment's range.
+ *
+ * Returns the matching item, or NULL.
+ */
+typedef const void *probe_fn(const struct fragment *restrict fragment,
+    const uint64_t key[static 8], uint64_t guess);
+
+/*
+ * Returns the fastest probe routine for fragment's key and item sizes
+ * on the current CPU.  Always succeeds for valid fragments.
+ */
+JT_CC_PURE probe_fn *
+probe_select(const struct fragment *fragment);
+#endif /* !JETEX_PROBE_H */
@@ -0,0 +1,363 @@
+#include <linux/filter.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "include/jetex_server.h"
+#include "runtime.h"
+#include "serve.h"
+#include "utility/cc.h"
+#include "zerocopy.h"
+
+static size_t
+affinity_cpus(int **OUT_cpus)
+{
+	cpu_set_t set;
+	size_t n = 0;
+	int *cpus;
+
+	*OUT_cpus = NULL;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+		return 0;
+	}
+
+	cpus = calloc((size_t)CPU_COUNT(&set), sizeof(cpus[0]));
+	if (cpus == NULL) {
+		return 0;
+	}
+
+	for (size_t i = 0; i < CPU_SETSIZE; i++) {
+		if (CPU_ISSET(i, &set)) {
+			cpus[n++] = (int)i;
+		}
+	}
+
+	*OUT_cpus = cpus;
+	return n;
+}
+
+static int
+open_socket(const struct sockaddr *addr, socklen_t addr_len)
+{
+	int one = 1;
+	int fd;
+
+	fd = socket(addr->sa_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0 ||
+	    bind(fd, addr, addr_len) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Classic BPF for SO_ATTACH_REUSEPORT_CBPF: the return value is an
+ * index in the reuseport group (i.e., in bind order), so map the
+ * receiving CPU to the index of the worker pinned on it.  CPUs
+ * without a worker fall back to CPU % n_worker.
+ */
+static int
+attach_steering(int fd, const int *cpus, size_t n)
+{
+	struct sock_filter *code;
+	struct sock_fprog prog;
+	size_t len = 3 + 2 * n;
+	int r;
+
+	if (len > BPF_MAXINSNS) {
+		return -1;
+	}
+
+	code = calloc(len, sizeof(code[0]));
+	if (code == NULL) {
+		return -1;
+	}
+
+	code[0] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+	    (uint32_t)(SKF_AD_OFF + SKF_AD_CPU));
+	for (size_t i = 0; i < n; i++) {
+		code[1 + 2 * i] = (struct sock_filter)BPF_JUMP(
+		    BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)cpus[i], 0, 1);
+		code[2 + 2 * i] = (struct sock_filter)BPF_STMT(
+		    BPF_RET | BPF_K, (uint32_t)i);
+	}
+
+	code[1 + 2 * n] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K,
+	    (uint32_t)n);
+	code[2 + 2 * n] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+
+	prog = (struct sock_fprog) {
+		.len = (unsigned short)len,
+		.filter = code
+	};
+
+	r = setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+	    &prog, sizeof(prog));
+	free(code);
+	return r;
+}
+
+struct jetex_runtime *
+jetex_runtime_create(const struct jetex_namespace *ns,
+    const struct sockaddr *addr, socklen_t addr_len,
+    const int *cpus, size_t n_cpu)
+{
+	struct sockaddr_storage bound;
+	socklen_t bound_len;
+	struct jetex_runtime *ret = NULL;
+	int *default_cpus = NULL;
+
+	if (addr == NULL || addr_len > sizeof(bound)) {
+		return NULL;
+	}
+
+	if (cpus == NULL) {
+		n_cpu = affinity_cpus(&default_cpus);
+		cpus = default_cpus;
+	}
+
+	if (n_cpu == 0 ||
+	    n_cpu > (SIZE_MAX - sizeof(*ret)) / sizeof(ret->workers[0])) {
+		goto fail;
+	}
+
+	ret = calloc(1, sizeof(*ret) + n_cpu * sizeof(ret->workers[0]));
+	if (ret == NULL) {
+		goto fail;
+	}
+
+	ret->ns = ns;
+	ret->n_worker = n_cpu;
+	for (size_t i = 0; i < n_cpu; i++) {
+		ret->workers[i] = (struct runtime_worker) {
+			.runtime = ret,
+			.cpu = cpus[i],
+			.fd = -1
+		};
+	}
+
+	/* One cache line per reader: they're written once per batch. */
+	ret->readers = aligned_alloc(sizeof(struct epoch_reader),
+	    n_cpu * sizeof(struct epoch_reader));
+	if (ret->readers == NULL) {
+		goto fail;
+	}
+
+	epoch_domain_init(&ret->epoch, ret->readers, n_cpu);
+	for (size_t i = 0; i < n_cpu; i++) {
+		ret->workers[i].reader = &ret->readers[i];
+	}
+
+	/*
+	 * Bind in worker order: reuseport group indices follow bind
+	 * order.  Bind everything to the first socket's address in case
+	 * addr asked for an ephemeral port.
+	 */
+	memcpy(&bound, addr, addr_len);
+	bound_len = addr_len;
+	for (size_t i = 0; i < n_cpu; i++) {
+		int fd;
+
+		fd = open_socket((const struct sockaddr *)&bound, bound_len);
+		if (fd < 0) {
+			goto fail;
+		}
+
+		ret->workers[i].fd = fd;
+		ret->workers[i].zc = calloc(1, sizeof(*ret->workers[i].zc));
+		if (ret->workers[i].zc == NULL) {
+			goto fail;
+		}
+
+		/* Without SO_ZEROCOPY, we simply always copy. */
+		(void)zerocopy_enable(ret->workers[i].zc, fd, true);
+		if (i == 0) {
+			bound_len = sizeof(bound);
+			if (getsockname(fd, (struct sockaddr *)&bound, &bound_len) != 0) {
+				goto fail;
+			}
+		}
+	}
+
+	if (attach_steering(ret->workers[0].fd, cpus, n_cpu) != 0) {
+		goto fail;
+	}
+
+	free(default_cpus);
+	return ret;
+
+fail:
+	jetex_runtime_destroy(ret);
+	free(default_cpus);
+	return NULL;
+}
+
+void
+jetex_runtime_destroy(struct jetex_runtime *runtime)
+{
+
+	if (runtime == NULL) {
+		return;
+	}
+
+	for (size_t i = 0; i < runtime->n_worker; i++) {
+		if (runtime->workers[i].fd >= 0) {
+			close(runtime->workers[i].fd);
+		}
+
+		free(runtime->workers[i].zc);
+		runtime->workers[i].fd = -1;
+		runtime->workers[i].zc = NULL;
+	}
+
+	free(runtime->readers);
+	free(runtime);
+	return;
+}
+
+size_t
+jetex_runtime_n_worker(const struct jetex_runtime *runtime)
+{
+
+	return runtime->n_worker;
+}
+
+int
+jetex_runtime_worker_cpu(const struct jetex_runtime *runtime, size_t i)
+{
+
+	return (i < runtime->n_worker) ? runtime->workers[i].cpu : -1;
+}
+
+int
+jetex_runtime_worker_fd(const struct jetex_runtime *runtime, size_t i)
+{
+
+	return (i < runtime->n_worker) ? runtime->workers[i].fd : -1;
+}
+
+static void *
+worker_main(void *arg)
+{
+	struct runtime_worker *worker = arg;
+	struct jetex_runtime *runtime = worker->runtime;
+	struct serve_source source = {
+		.published = &runtime->ns,
+		.domain = &runtime->epoch,
+		.reader = worker->reader
+	};
+	enum runtime_start start;
+
+	pthread_mutex_lock(&runtime->start_lock);
+	while (runtime->start == RUNTIME_START_WAIT) {
+		pthread_cond_wait(&runtime->start_cond, &runtime->start_lock);
+	}
+
+	start = runtime->start;
+	pthread_mutex_unlock(&runtime->start_lock);
+	if (start == RUNTIME_START_SERVE) {
+		serve_loop(&source, runtime->deadline, &worker->fd,
+		    worker->zc, 1);
+	}
+
+	return NULL;
+}
+
+/* Lets workers serve, or tells them to exit right away. */
+static void
+workers_release(struct jetex_runtime *runtime, enum runtime_start start)
+{
+
+	pthread_mutex_lock(&runtime->start_lock);
+	runtime->start = start;
+	pthread_cond_broadcast(&runtime->start_cond);
+	pthread_mutex_unlock(&runtime->start_lock);
+	return;
+}
+
+/*
+ * Workers only start serving once all of them are up: if any fails to
+ * start, the others exit without serving (steering would otherwise
+ * keep sending the failed CPUs' flows to sockets nobody reads), and
+ * we return -1 right away.
+ */
+int
+jetex_runtime_serve(struct jetex_runtime *runtime, double deadline)
+{
+	int ret = 0;
+
+	if (pthread_mutex_init(&runtime->start_lock, NULL) != 0) {
+		return -1;
+	}
+
+	if (pthread_cond_init(&runtime->start_cond, NULL) != 0) {
+		pthread_mutex_destroy(&runtime->start_lock);
+		return -1;
+	}
+
+	runtime->start = RUNTIME_START_WAIT;
+	runtime->deadline = deadline;
+	for (size_t i = 0; i < runtime->n_worker; i++) {
+		struct runtime_worker *worker = &runtime->workers[i];
+		pthread_attr_t attr;
+		cpu_set_t set;
+
+		/* Pin before the thread starts so its buffers are node-local. */
+		CPU_ZERO(&set);
+		CPU_SET((size_t)worker->cpu, &set);
+		if (pthread_attr_init(&attr) != 0) {
+			ret = -1;
+			break;
+		}
+
+		if (pthread_attr_setaffinity_np(&attr, sizeof(set), &set) == 0 &&
+		    pthread_create(&worker->thread, &attr, worker_main, worker) == 0) {
+			worker->started = 1;
+		} else {
+			ret = -1;
+		}
+
+		pthread_attr_destroy(&attr);
+		if (ret != 0) {
+			break;
+		}
+	}
+
+	workers_release(runtime, (ret == 0)
+	    ? RUNTIME_START_SERVE : RUNTIME_START_ABORT);
+	for (size_t i = 0; i < runtime->n_worker; i++) {
+		struct runtime_worker *worker = &runtime->workers[i];
+
+		if (worker->started != 0) {
+			pthread_join(worker->thread, NULL);
+			worker->started = 0;
+		}
+	}
+
+	pthread_cond_destroy(&runtime->start_cond);
+	pthread_mutex_destroy(&runtime->start_lock);
+	return ret;
+}
+
+const struct jetex_namespace *
+jetex_runtime_publish(struct jetex_runtime *runtime,
+    const struct jetex_namespace *ns)
+{
+	const struct jetex_namespace *old;
+
+	old = __atomic_exchange_n(&runtime->ns, ns, __ATOMIC_SEQ_CST);
+	epoch_synchronize(&runtime->epoch);
+	return old;
+}
@@ -0,0 +1,70 @@
+#ifndef JETEX_RUNTIME_H
+#define JETEX_RUNTIME_H
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+#include "epoch.h"
+#include "utility/cc.h"
+
+struct jetex_namespace;
+struct zerocopy;
+
+struct runtime_worker {
+	struct jetex_runtime *runtime;
+	struct epoch_reader *reader;
+	struct zerocopy *zc; /* fd's, across jetex_runtime_serve calls. */
+	pthread_t thread;
+	int cpu;
+	int fd;
+	int started;
+	int padding;
+};
+
+/*
+ * Workers wait for start to leave RUNTIME_START_WAIT before serving,
+ * so jetex_runtime_serve can abort if it fails to create them all.
+ */
+enum runtime_start {
+	RUNTIME_START_WAIT = 0,
+	RUNTIME_START_SERVE,
+	RUNTIME_START_ABORT
+};
+
+struct jetex_runtime {
+	const struct jetex_namespace *ns; /* published; see epoch.h */
+	double deadline;
+	size_t n_worker;
+	struct epoch_domain epoch;
+	struct epoch_reader *readers; /* [n_worker] */
+	pthread_mutex_t start_lock;
+	pthread_cond_t start_cond;
+	enum runtime_start start; /* under start_lock. */
+	int padding;
+	struct runtime_worker workers[];
+};
+
+JT_CC_PUBLIC struct jetex_runtime *
+jetex_runtime_create(const struct jetex_namespace *ns,
+    const struct sockaddr *addr, socklen_t addr_len,
+    const int *cpus, size_t n_cpu);
+
+JT_CC_PUBLIC void
+jetex_runtime_destroy(struct jetex_runtime *runtime);
+
+JT_CC_PUBLIC JT_CC_PURE size_t
+jetex_runtime_n_worker(const struct jetex_runtime *runtime);
+
+JT_CC_PUBLIC JT_CC_PURE int
+jetex_runtime_worker_cpu(const struct jetex_runtime *runtime, size_t i);
+
+JT_CC_PUBLIC JT_CC_PURE int
+jetex_runtime_worker_fd(const struct jetex_runtime *runtime, size_t i);
+
+JT_CC_PUBLIC int
+jetex_runtime_serve(struct jetex_runtime *runtime, double deadline);
+
+JT_CC_PUBLIC const struct jetex_namespace *
+jetex_runtime_publish(struct jetex_runtime *runtime,
+    const struct jetex_namespace *ns);
+#endif /* !JETEX_RUNTIME_H */
@@ -0,0 +1,352 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "include/jetex_server.h"
+#include "numa.h"
+#include "serve.h"
+#include "uring.h"
+#include "utility/cc.h"
+#include "zerocopy.h"
+
+/*
+ * Max number of recvmmsg batches we pull from one fd before moving
+ * on to the next one: we don't want one busy fd to starve the rest.
+ */
+#define SERVE_DRAIN_ROUNDS 4
+
+struct serve_mmsg {
+	struct mmsghdr recv_msg[SERVE_BATCH_SIZE];
+	struct iovec recv_iov[SERVE_BATCH_SIZE];
+	struct sockaddr_storage recv_addr[SERVE_BATCH_SIZE];
+	struct serve_request requests[SERVE_BATCH_SIZE];
+	struct mmsghdr send_msg[SERVE_BATCH_SIZE];
+	struct mmsghdr zc_msg[SERVE_BATCH_SIZE];
+	/* Header and value for each reply. */
+	struct iovec send_iov[SERVE_BATCH_SIZE][2];
+	struct serve_reply replies[SERVE_BATCH_SIZE];
+	char recv_buf[SERVE_BATCH_SIZE][SERVE_DATAGRAM_SIZE];
+};
+
+static void
+serve_mmsg_init(struct serve_mmsg *state)
+{
+
+	for (size_t i = 0; i < SERVE_BATCH_SIZE; i++) {
+		state->recv_iov[i] = (struct iovec) {
+			.iov_base = state->recv_buf[i],
+			.iov_len = sizeof(state->recv_buf[i])
+		};
+	}
+
+	return;
+}
+
+/*
+ * Sends msgs[0 ... n - 1], dropping what doesn't fit in the socket
+ * buffer.  If stop_on_error, bad messages also stop the send instead
+ * of being skipped.  Returns the number of messages the kernel took.
+ */
+static size_t
+send_msgs(int fd, struct mmsghdr *msgs, size_t n, int flags, bool stop_on_error)
+{
+	size_t accepted = 0;
+	size_t sent = 0;
+
+	while (sent < n) {
+		int r;
+
+		r = sendmmsg(fd, &msgs[sent], (unsigned int)(n - sent), flags);
+		if (r > 0) {
+			sent += (size_t)r;
+			accepted += (size_t)r;
+			continue;
+		}
+
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+
+		/* Socket buffer is full: drop the rest, it's UDP. */
+		if (r == 0 || errno == EAGAIN || errno == EWOULDBLOCK ||
+		    stop_on_error) {
+			break;
+		}
+
+		/* The first reply is bad (e.g., unreachable dst). Skip it. */
+		sent++;
+	}
+
+	return accepted;
+}
+
+/*
+ * Large values go out with MSG_ZEROCOPY, straight from the fragment;
+ * their headers are copied to zc, since the kernel may read them after
+ * sendmmsg returns.  Everything else goes out with regular sends.
+ */
+static void
+send_replies(struct serve_mmsg *state, struct zerocopy *zc, int fd, size_t n)
+{
+	uint32_t id = zc->tail;
+	size_t n_copy = 0;
+	size_t n_zc = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		struct serve_reply *reply = &state->replies[i];
+		struct iovec *iov = state->send_iov[i];
+		struct mmsghdr *msg;
+
+		/* Coalesced into an earlier reply. */
+		if (reply->len == 0) {
+			continue;
+		}
+
+		iov[0] = (struct iovec) {
+			.iov_base = reply->bytes,
+			.iov_len = reply->len
+		};
+
+		iov[1] = (struct iovec) {
+			.iov_base = (void *)(uintptr_t)reply->value,
+			.iov_len = reply->value_len
+		};
+
+		if (reply->value_len >= ZEROCOPY_MIN_VALUE &&
+		    zc->enabled != 0 && id - zc->head < ZEROCOPY_SLOTS) {
+			iov[0].iov_base = memcpy(zerocopy_header(zc, id++),
+			    reply->bytes, reply->len);
+			msg = &state->zc_msg[n_zc++];
+		} else {
+			msg = &state->send_msg[n_copy++];
+		}
+
+		*msg = (struct mmsghdr) {
+			.msg_hdr = {
+				.msg_name = &reply->dst,
+				.msg_namelen = reply->dstlen,
+				.msg_iov = iov,
+				.msg_iovlen = (reply->value_len > 0) ? 2 : 1
+			}
+		};
+	}
+
+	send_msgs(fd, state->send_msg, n_copy, MSG_DONTWAIT, false);
+	/*
+	 * The kernel numbers zero-copy sends sequentially, so we can't
+	 * skip over failures: ids only advance for accepted messages.
+	 */
+	zc->tail += (uint32_t)send_msgs(fd, state->zc_msg, n_zc,
+	    MSG_DONTWAIT | MSG_ZEROCOPY, true);
+	return;
+}
+
+static void
+serve_fd(struct serve_mmsg *state, struct serve_source *source,
+    struct zerocopy *zc, int fd)
+{
+
+	for (size_t round = 0; round < SERVE_DRAIN_ROUNDS; round++) {
+		size_t n_reply;
+		int r;
+
+		for (size_t i = 0; i < SERVE_BATCH_SIZE; i++) {
+			state->recv_msg[i] = (struct mmsghdr) {
+				.msg_hdr = {
+					.msg_name = &state->recv_addr[i],
+					.msg_namelen = sizeof(state->recv_addr[i]),
+					.msg_iov = &state->recv_iov[i],
+					.msg_iovlen = 1
+				}
+			};
+		}
+
+		r = recvmmsg(fd, state->recv_msg, SERVE_BATCH_SIZE,
+		    MSG_DONTWAIT, NULL);
+		if (r <= 0) {
+			return;
+		}
+
+		for (size_t i = 0; i < (size_t)r; i++) {
+			const struct msghdr *hdr = &state->recv_msg[i].msg_hdr;
+
+			state->requests[i] = (struct serve_request) {
+				.data = state->recv_buf[i],
+				.len = state->recv_msg[i].msg_len,
+				.src = hdr->msg_name,
+				.srclen = hdr->msg_namelen
+			};
+
+			/* Truncated datagrams can't be valid requests. */
+			if ((hdr->msg_flags & MSG_TRUNC) != 0) {
+				state->requests[i].len = 0;
+			}
+		}
+
+		n_reply = serve_batch(serve_source_acquire(source), source->node,
+		    state->requests, (size_t)r, state->replies,
+		    ARRAY_SIZE(state->replies));
+		source->in_flight -= zerocopy_pending(zc);
+		send_replies(state, zc, fd, n_reply);
+		zerocopy_drain(zc, fd);
+		source->in_flight += zerocopy_pending(zc);
+		if (r < SERVE_BATCH_SIZE) {
+			return;
+		}
+	}
+
+	return;
+}
+
+/* Consumes zero-copy notifications, and clears socket errors. */
+static void
+serve_error(struct serve_source *source, struct zerocopy *zc, int fd)
+{
+	int error;
+	socklen_t len = sizeof(error);
+
+	source->in_flight -= zerocopy_pending(zc);
+	zerocopy_drain(zc, fd);
+	source->in_flight += zerocopy_pending(zc);
+	/* Otherwise, a pending ICMP error keeps poll(2) spinning. */
+	getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+	return;
+}
+
+/*
+ * Waits up to SERVE_ZEROCOPY_WAIT_MS for the kernel to release pending
+ * zero-copy sends.  Returns how many are still pending.
+ */
+static size_t
+serve_zerocopy_wait(struct serve_source *source, struct zerocopy *zcs,
+    const int *fds, struct pollfd *pollfds, size_t n_fd)
+{
+	double end = serve_now() + 1e-3 * SERVE_ZEROCOPY_WAIT_MS;
+
+	/* POLLERR is always reported: that's all we wait for. */
+	for (size_t i = 0; i < n_fd; i++) {
+		pollfds[i].events = 0;
+	}
+
+	while (source->in_flight > 0) {
+		int timeout = serve_timeout_ms(end);
+
+		if (timeout <= 0 || poll(pollfds, (nfds_t)n_fd, timeout) < 0) {
+			break;
+		}
+
+		for (size_t i = 0; i < n_fd; i++) {
+			if ((pollfds[i].revents & POLLERR) != 0) {
+				serve_error(source, &zcs[i], fds[i]);
+			}
+		}
+	}
+
+	return source->in_flight;
+}
+
+void
+serve_loop(struct serve_source *source,
+    double deadline, const int *fds, struct zerocopy *zcs, size_t n_fd)
+{
+	struct zerocopy *own_zcs = NULL;
+	struct serve_mmsg *state;
+	struct pollfd *pollfds;
+
+	/* Runtime workers are pinned; other callers keep their first node. */
+	source->node = numa_local_node();
+
+	/* Prefer io_uring; it only returns non-zero before serving anything. */
+	if (serve_uring(source, deadline, fds, n_fd) == 0) {
+		return;
+	}
+
+	state = calloc(1, sizeof(*state));
+	pollfds = calloc(n_fd + 1, sizeof(pollfds[0]));
+	if (zcs == NULL) {
+		zcs = own_zcs = calloc(n_fd + 1, sizeof(zcs[0]));
+	}
+
+	if (state == NULL || pollfds == NULL || zcs == NULL) {
+		goto out;
+	}
+
+	serve_mmsg_init(state);
+	for (size_t i = 0; i < n_fd; i++) {
+		pollfds[i] = (struct pollfd) {
+			.fd = fds[i],
+			.events = POLLIN
+		};
+
+		/*
+		 * Without SO_ZEROCOPY, we simply always copy.  fds may have
+		 * sent with MSG_ZEROCOPY before: our ids will need syncing.
+		 */
+		if (own_zcs != NULL) {
+			(void)zerocopy_enable(&zcs[i], fds[i], false);
+		}
+
+		/* Sends left over from the caller's last serve_loop. */
+		source->in_flight += zerocopy_pending(&zcs[i]);
+	}
+
+	for (;;) {
+		int timeout = serve_timeout_ms(deadline);
+		int r;
+
+		if (timeout <= 0) {
+			break;
+		}
+
+		serve_source_release(source);
+		r = poll(pollfds, (nfds_t)n_fd, timeout);
+		if (r <= 0) {
+			continue;
+		}
+
+		for (size_t i = 0; i < n_fd; i++) {
+			if ((pollfds[i].revents & POLLERR) != 0) {
+				serve_error(source, &zcs[i], fds[i]);
+			}
+
+			if ((pollfds[i].revents & POLLIN) != 0) {
+				serve_fd(state, source, &zcs[i], fds[i]);
+			}
+		}
+	}
+
+	/*
+	 * The last sends may still read fragments and headers: give the
+	 * kernel a moment.  Sends still pending after that are stuck
+	 * (e.g., behind a wedged device queue), and must not block
+	 * publishers forever, so we go offline regardless.  The kernel
+	 * keeps the fragment pages they pinned, but their headers must
+	 * stay put: we can't free our own zcs then.
+	 */
+	if (serve_zerocopy_wait(source, zcs, fds, pollfds, n_fd) > 0) {
+		own_zcs = NULL;
+	}
+
+out:
+	source->in_flight = 0;
+	serve_source_release(source);
+	free(state);
+	free(pollfds);
+	free(own_zcs);
+	return;
+}
+
+void
+jetex_serve(const struct jetex_namespace *ns,
+    double deadline, const int *fds, size_t n_fd)
+{
+	struct serve_source source = { .ns = ns };
+
+	serve_loop(&source, deadline, fds, NULL, n_fd);
+	return;
+}
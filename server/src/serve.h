@@ -0,0 +1,198 @@
+#ifndef JETEX_SERVE_H
+#define JETEX_SERVE_H
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "epoch.h"
+#include "shared/packet.h"
+#include "utility/cc.h"
+
+struct jetex_namespace;
+struct jetex_serve_stats;
+struct zerocopy;
+
+/* Max number of datagrams we receive or send per syscall. */
+#define SERVE_BATCH_SIZE 64
+/* jetex_header.len is at most 32767. */
+#define SERVE_DATAGRAM_SIZE (1UL << 15)
+/* Upper bound on each blocking wait, in milliseconds. */
+#define SERVE_POLL_MAX_MS 1000
+/* How long we wait for pending zero-copy sends once past the deadline. */
+#define SERVE_ZEROCOPY_WAIT_MS 100
+/* Max number of datagrams we send back for one scan request. */
+#define SERVE_SCAN_MAX_REPLY 8
+/* Max number of oversized or unreadable records per scan request. */
+#define SERVE_SCAN_MAX_OVERSIZED 64
+
+/*
+ * Where a serving thread finds its namespace.  Without an epoch
+ * domain, ns is fixed.  Otherwise, *published is reloaded at each
+ * quiescent point (between batches), and the thread goes offline
+ * while it blocks.
+ *
+ * Sends that still read from fragments (pending zero-copy or async
+ * sends) are counted in in_flight; while it's non-zero, the thread
+ * keeps announcing the epoch it last observed, which holds back
+ * reclamation of older namespaces.
+ */
+struct serve_source {
+	const struct jetex_namespace *ns;
+	const struct jetex_namespace *const *published;
+	struct epoch_domain *domain;
+	struct epoch_reader *reader;
+	size_t in_flight;
+	unsigned int node; /* NUMA node whose fragment copies we read. */
+	uint32_t padding;
+};
+
+/* Quiescent point: returns the namespace to use for the next batch. */
+static inline const struct jetex_namespace *
+serve_source_acquire(struct serve_source *source)
+{
+
+	if (source->domain != NULL) {
+		if (source->in_flight == 0 ||
+		    __atomic_load_n(&source->reader->seen, __ATOMIC_RELAXED) == 0) {
+			epoch_quiescent(source->domain, source->reader);
+		}
+
+		source->ns = __atomic_load_n(source->published, __ATOMIC_SEQ_CST);
+	}
+
+	return source->ns;
+}
+
+/* We're about to block; go offline unless sends still read fragments. */
+static inline void
+serve_source_release(struct serve_source *source)
+{
+
+	if (source->domain != NULL && source->in_flight == 0) {
+		epoch_offline(source->reader);
+	}
+
+	return;
+}
+
+/* One incoming datagram, and where it came from. */
+struct serve_request {
+	const void *data;
+	size_t len;
+	const struct sockaddr *src;
+	socklen_t srclen;
+	uint32_t origin; /* opaque to serve_batch, copied to the reply. */
+};
+
+/*
+ * One outgoing datagram: len bytes of encoded header, followed by
+ * value_len bytes at value, which usually points into a fragment.
+ */
+struct serve_reply {
+	struct sockaddr_storage dst;
+	socklen_t dstlen;
+	uint32_t len;
+	uint32_t origin;
+	uint32_t padding;
+	const void *value;
+	size_t value_len;
+	union {
+		struct jetex_header_found found;
+		struct jetex_header_missing missing;
+		struct jetex_header_multi_response multi;
+		struct jetex_header_scan_response scan;
+		char bytes[SERVE_DATAGRAM_SIZE];
+	};
+};
+
+/*
+ * Time left until request's deadline, in 1/256 ms (the expiry
+ * encoding's units); INT32_MAX without a deadline, and negative once
+ * expired.  Malformed requests have no deadline.
+ */
+static inline int32_t
+serve_request_slack(const struct serve_request *request,
+    const struct timeval *now)
+{
+	struct jetex_header header;
+	uint32_t limit;
+
+	if (request->len < sizeof(header)) {
+		return INT32_MAX;
+	}
+
+	memcpy(&header, request->data, sizeof(header));
+	limit = header.expiry | 0xFFU;
+	if (limit == 0xFFU) {
+		return INT32_MAX;
+	}
+
+	return (int32_t)(limit -
+	    ((uint32_t)(now->tv_sec * 1000 + now->tv_usec / 1000) << 8));
+}
+
+static inline double
+serve_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+/* Milliseconds until deadline, capped at SERVE_POLL_MAX_MS; <= 0 if past. */
+static inline int
+serve_timeout_ms(double deadline)
+{
+	double remaining = deadline - serve_now();
+
+	if (!(remaining > 0)) {
+		return 0;
+	}
+
+	return (remaining * 1000 < SERVE_POLL_MAX_MS)
+	    ? 1 + (int)(remaining * 1000)
+	    : SERVE_POLL_MAX_MS;
+}
+
+JT_CC_PUBLIC void
+jetex_serve(const struct jetex_namespace *ns,
+    double deadline, const int *fds, size_t n_fd);
+
+JT_CC_PUBLIC void
+jetex_serve_set_coalesce_mtu(size_t mtu);
+
+JT_CC_PUBLIC void
+jetex_serve_stats(struct jetex_serve_stats *OUT_stats);
+
+/*
+ * jetex_serve, with the namespace coming from source.  zcs[0 ... n_fd
+ * - 1], if non-NULL, is fds' zero-copy state, kept (and enabled) by the
+ * caller for as long as the sockets live; NULL -> our own, until we
+ * return.
+ */
+void
+serve_loop(struct serve_source *source,
+    double deadline, const int *fds, struct zerocopy *zcs, size_t n_fd);
+
+/*
+ * Decodes, resolves and encodes responses for up to n requests,
+ * reading node's fragment copies.  Malformed requests are silently
+ * dropped.  Multi-key requests may need more than one reply; records
+ * that don't fit in max_reply replies are dropped as well.  Scans
+ * stop early instead, with a continuation key.
+ *
+ * Finally, coalesces replies to the same destination (see
+ * jetex_serve_set_coalesce_mtu): replies merged into an earlier one
+ * are left with len = 0, and must not be sent.
+ *
+ * Returns the number of replies written to replies[0 ... max_reply - 1].
+ */
+size_t
+serve_batch(const struct jetex_namespace *ns, unsigned int node,
+    const struct serve_request *requests, size_t n,
+    struct serve_reply *replies, size_t max_reply);
+#endif /* !JETEX_SERVE_H */
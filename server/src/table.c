@@ -1,5 +1,7 @@
 #include <assert.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -9,6 +11,7 @@
 #include "utility/cc.h"
 #include "table.h"
 #include "fragment.h"
+#include "numa.h"
 
 struct table_scan_result {
 	uint64_t max_pattern;
@@ -63,25 +66,325 @@ static inline uint64_t
 extract(uint64_t pattern, uint8_t n_bits)
 {
 
-	return pattern >> (64 - n_bits);
+	return (n_bits == 0) ? 0 : pattern >> (64 - n_bits);
+}
+
+/* Prefault work units; progress is reported after each. */
+#define TABLE_PREFAULT_CHUNK (64ULL << 20)
+
+/*
+ * Fragments to prefault are split in TABLE_PREFAULT_CHUNK-byte chunks;
+ * fragment i has chunks first_chunk[i] ... first_chunk[i + 1] - 1.
+ * Threads claim chunks with an atomic increment of next.
+ */
+struct table_prefault {
+	const struct fragment *fragments;
+	const uint64_t *first_chunk; /* [n + 1]. */
+	size_t n;
+	uint64_t n_chunk;
+	uint64_t total;
+	const struct jetex_table_options *options;
+	uint64_t next;
+	uint64_t done;
+	uint32_t fail;
+	uint32_t padding;
+};
+
+/* Populates chunks until none is left; only the caller reports progress. */
+static void
+prefault_run(struct table_prefault *state, bool report)
+{
+	const struct jetex_table_options *options = state->options;
+
+	for (;;) {
+		const struct fragment *fragment;
+		uint64_t chunk;
+		uint64_t offset;
+		uint64_t size;
+		uint64_t done;
+		size_t lo = 0;
+		size_t hi = state->n;
+
+		chunk = __atomic_fetch_add(&state->next, 1, __ATOMIC_RELAXED);
+		if (chunk >= state->n_chunk) {
+			break;
+		}
+
+		/* Find the last fragment whose first chunk is <= chunk. */
+		while (hi - lo > 1) {
+			size_t mid = lo + (hi - lo) / 2;
+
+			if (state->first_chunk[mid] <= chunk) {
+				lo = mid;
+			} else {
+				hi = mid;
+			}
+		}
+
+		fragment = &state->fragments[lo];
+		offset = (chunk - state->first_chunk[lo]) * TABLE_PREFAULT_CHUNK;
+		size = fragment->data->table_size - offset;
+		if (size > TABLE_PREFAULT_CHUNK) {
+			size = TABLE_PREFAULT_CHUNK;
+		}
+
+		if (fragment_populate(fragment, offset, size) != 0) {
+			__atomic_store_n(&state->fail, 1, __ATOMIC_RELAXED);
+		}
+
+		done = __atomic_add_fetch(&state->done, size, __ATOMIC_RELAXED);
+		if (report && options->progress != NULL) {
+			options->progress(options->progress_context,
+			    done, state->total);
+		}
+	}
+
+	return;
+}
+
+static void *
+prefault_thread(void *arg)
+{
+
+	prefault_run(arg, false);
+	return NULL;
+}
+
+/*
+ * Prefaults (and locks, with JETEX_TABLE_MLOCK) fragments[0 ... n - 1],
+ * with up to options->n_thread threads.  0 -> ok.
+ */
+static int
+table_prefault(const struct fragment *fragments, size_t n,
+    const struct jetex_table_options *options)
+{
+	struct table_prefault state = {
+		.fragments = fragments,
+		.n = n,
+		.options = options
+	};
+	pthread_t *threads = NULL;
+	uint64_t *first_chunk;
+	size_t n_started = 0;
+	size_t n_thread = (options->n_thread > 1) ? options->n_thread : 1;
+
+	first_chunk = calloc(n + 1, sizeof(first_chunk[0]));
+	if (first_chunk == NULL) {
+		return -1;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		uint64_t size = fragments[i].data->table_size;
+
+		state.total += size;
+		first_chunk[i + 1] = first_chunk[i] +
+		    (size + TABLE_PREFAULT_CHUNK - 1) / TABLE_PREFAULT_CHUNK;
+	}
+
+	state.first_chunk = first_chunk;
+	state.n_chunk = first_chunk[n];
+	if (n_thread > state.n_chunk) {
+		n_thread = (state.n_chunk > 0) ? (size_t)state.n_chunk : 1;
+	}
+
+	if (n_thread > 1) {
+		threads = calloc(n_thread - 1, sizeof(threads[0]));
+	}
+
+	/* If we can't get more threads, the caller does more of the work. */
+	for (size_t i = 0; threads != NULL && i < n_thread - 1; i++) {
+		if (pthread_create(&threads[i], NULL,
+		    prefault_thread, &state) != 0) {
+			break;
+		}
+
+		n_started++;
+	}
+
+	prefault_run(&state, true);
+	for (size_t i = 0; i < n_started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	if (options->progress != NULL) {
+		options->progress(options->progress_context,
+		    state.done, state.total);
+	}
+
+	for (size_t i = 0; i < n && state.fail == 0; i++) {
+		if ((options->flags & JETEX_TABLE_MLOCK) != 0 &&
+		    fragment_lock(&fragments[i]) != 0) {
+			state.fail = 1;
+		}
+	}
+
+	free(threads);
+	free(first_chunk);
+	return (state.fail == 0) ? 0 : -1;
+}
+
+/*
+ * Replaces fragments of up to numa_max_bytes with a copy per node, in
+ * each node's view; the file mappings are then unmapped.  Nodes that
+ * we can't bind to (no memory, not in our cpuset, or an id gap) get
+ * no copy: their views keep view 0's fragment, i.e., node 0's copy if
+ * it has one, or else the file mapping.  On failure, leaves the
+ * directory as is.  0 -> ok.
+ */
+static int
+table_replicate(struct jetex_table *table,
+    const struct jetex_table_options *options)
+{
+	struct fragment *replicas; /* [node * n + i]. */
+	uint8_t *usable; /* [n_node]. */
+	size_t n = table->n_unique;
+	size_t n_node = table->n_node;
+	unsigned int flags = 0;
+
+	replicas = calloc(n_node * n, sizeof(replicas[0]));
+	usable = calloc(n_node, sizeof(usable[0]));
+	if (replicas == NULL || usable == NULL) {
+		free(replicas);
+		free(usable);
+		return -1;
+	}
+
+	if (numa_usable_nodes(usable, n_node) == 0) {
+		free(replicas);
+		free(usable);
+		return 0;
+	}
+
+	if ((options->flags & JETEX_TABLE_HUGE_PAGES) != 0) {
+		flags |= FRAGMENT_MAP_HUGE_PAGES;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		const struct fragment *fragment = jetex_table_fragment(table, i);
+
+		if (options->numa_max_bytes != 0 &&
+		    fragment->data->table_size > options->numa_max_bytes) {
+			continue;
+		}
+
+		for (size_t node = 0; node < n_node; node++) {
+			struct fragment *replica = &replicas[node * n + i];
+
+			if (usable[node] == 0) {
+				continue;
+			}
+
+			*replica = fragment_replicate(fragment,
+			    (unsigned int)node, flags);
+			if (replica->data == NULL ||
+			    ((options->flags & JETEX_TABLE_MLOCK) != 0 &&
+			    fragment_lock(replica) != 0)) {
+				goto fail;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		struct fragment *shared = jetex_table_fragment(table, i);
+
+		if (replicas[i].data != NULL) {
+			fragment_unmap(shared);
+			*shared = replicas[i];
+		}
+
+		for (size_t node = 1; node < n_node; node++) {
+			*jetex_table_fragment(table, node * n + i) =
+			    (replicas[node * n + i].data != NULL)
+			    ? replicas[node * n + i] : *shared;
+		}
+	}
+
+	free(replicas);
+	free(usable);
+	return 0;
+
+fail:
+	for (size_t i = 0; i < n_node * n; i++) {
+		fragment_unmap(&replicas[i]);
+	}
+
+	free(replicas);
+	free(usable);
+	return -1;
+}
+
+static inline size_t
+slot_get(union table_slots slots, size_t width, size_t i)
+{
+
+	switch (width) {
+	case 1:
+		return slots.u8[i];
+	case 2:
+		return slots.u16[i];
+	default:
+		return slots.u32[i];
+	}
+}
+
+static inline void
+slot_set(union table_slots slots, size_t width, size_t i, size_t value)
+{
+
+	switch (width) {
+	case 1:
+		slots.u8[i] = (uint8_t)value;
+		break;
+	case 2:
+		slots.u16[i] = (uint16_t)value;
+		break;
+	default:
+		slots.u32[i] = (uint32_t)value;
+		break;
+	}
+
+	return;
 }
 
 struct jetex_table *
 jetex_table_create(const uint8_t uuid[static 16],
     const int *restrict fds, uint64_t *restrict refcounts, size_t n)
 {
+
+	return jetex_table_create_options(uuid, fds, refcounts, n, NULL);
+}
+
+struct jetex_table *
+jetex_table_create_options(const uint8_t uuid[static 16],
+    const int *restrict fds, uint64_t *restrict refcounts, size_t n,
+    const struct jetex_table_options *options)
+{
+	static const struct jetex_table_options default_options;
 	struct jetex_table *ret = NULL;
 	struct fragment *fragments = NULL; /* [n]. */
-	size_t *slot_index = NULL; /* slot -> fd/refcount/fragment index. */
+	size_t *unique = NULL; /* fd index -> 1 + unique index, or 0. */
+	union table_slots slots = { .u8 = NULL };
 	uint64_t max_pattern = 0;
 	uint64_t min_pattern = UINT64_MAX;
+	uint32_t min_fragment;
 	size_t n_fragment;
+	size_t n_unique = 0;
+	size_t n_node = 1;
+	size_t width;
 	uint8_t n_bits = 0;
 
-	if (n == 0) {
+	if (n == 0 || n >= UINT32_MAX) {
 		return NULL;
 	}
 
+	if (options == NULL) {
+		options = &default_options;
+	}
+
+	if ((options->flags & JETEX_TABLE_NUMA) != 0) {
+		n_node = numa_n_node();
+	}
+
 	{
 		struct table_scan_result scan_result;
 
@@ -95,124 +398,179 @@ jetex_table_create(const uint8_t uuid[static 16],
 		n_bits = (uint8_t)scan_result.n_bits;
 	}
 
+	/* Slots hold 1 + an fd index while we build, so size for n. */
 	n_fragment = 1 + extract(max_pattern - min_pattern, n_bits);
-	if (n_fragment > (SIZE_MAX - sizeof(*ret)) / sizeof(struct fragment)) {
+	width = (n < UINT8_MAX) ? 1 : ((n < UINT16_MAX) ? 2 : 4);
+	slots.u8 = calloc(n_fragment, width);
+	fragments = calloc(n, sizeof(fragments[0]));
+	unique = calloc(n, sizeof(unique[0]));
+	if (slots.u8 == NULL || fragments == NULL || unique == NULL) {
 		goto fail;
 	}
 
-	ret = calloc(1,
-	    sizeof(*ret) + sizeof(struct fragment) * n_fragment);
-	fragments = calloc(n, sizeof(fragments[0]));
-	slot_index = calloc(n_fragment, sizeof(slot_index[0]));
-
 	for (size_t i = 0; i < n; i++) {
-		fragments[i] = fragment_map(fds[i]);
+		fragments[i] = fragment_map(fds[i],
+		    ((options->flags & JETEX_TABLE_HUGE_PAGES) != 0)
+		    ? FRAGMENT_MAP_HUGE_PAGES : 0);
 		refcounts[i] = 0;
 	}
 
-	for (size_t i = 0; i < ARRAY_SIZE(ret->uuid_bytes); i++) {
-		ret->uuid_bytes[i] = uuid[i];
-	}
+	/* Callers (the serve loop) assume a single key size per table. */
+	for (size_t i = 1; i < n; i++) {
+		if (fragments[i].key_size != fragments[0].key_size) {
+			for (size_t j = 0; j < n; j++) {
+				fragment_unmap(&fragments[j]);
+			}
 
-	ret->min_fragment = (uint32_t)extract(min_pattern, n_bits);
-	ret->n_fragment = (uint32_t)n_fragment;
-	ret->fragment_shift = (uint8_t)(64 - n_bits);
+			goto fail;
+		}
+	}
 
+	min_fragment = (uint32_t)extract(min_pattern, n_bits);
 	for (size_t i = 0; i < n; i++) {
 		struct fragment *cur = &fragments[i];
 		uint64_t lo, hi;
 
 		lo = cur->data->pattern;
-		hi = lo | ((1ULL << (64 - cur->data->n_bits)) - 1);
+		hi = lo | ((cur->data->n_bits == 0)
+		    ? UINT64_MAX
+		    : (1ULL << (64 - cur->data->n_bits)) - 1);
 
-		lo >>= ret->fragment_shift;
-		hi >>= ret->fragment_shift;
-		lo -= ret->min_fragment;
-		hi -= ret->min_fragment;
+		lo = extract(lo, n_bits);
+		hi = extract(hi, n_bits);
+		lo -= min_fragment;
+		hi -= min_fragment;
 
 		for (uint64_t j = lo; j <= hi; j++) {
-			struct fragment *dst = jetex_table_fragment(ret, j);
+			size_t prev = slot_get(slots, width, j);
 
-			assert(j <= n_fragment);
-			if (dst->data != NULL) {
-				assert(slot_index[j] < n);
-				assert(refcounts[slot_index[j]] > 0);
-				refcounts[slot_index[j]]--;
+			assert(j < n_fragment);
+			if (prev != 0) {
+				assert(prev <= n);
+				assert(refcounts[prev - 1] > 0);
+				refcounts[prev - 1]--;
 			}
 
-			*dst = *cur;
+			slot_set(slots, width, j, i + 1);
 			assert(refcounts[i] < UINT64_MAX);
 			refcounts[i]++;
-			slot_index[j] = i;
 		}
 	}
 
 	for (size_t i = 0; i < n; i++) {
 		if (refcounts[i] == 0) {
 			fragment_unmap(&fragments[i]);
+		} else {
+			unique[i] = ++n_unique;
+		}
+	}
+
+	/* Renumber from fd indices to (no larger) unique indices. */
+	for (size_t j = 0; j < n_fragment; j++) {
+		size_t value = slot_get(slots, width, j);
+
+		if (value != 0) {
+			slot_set(slots, width, j, unique[value - 1]);
+		}
+	}
+
+	ret = aligned_alloc(sizeof(struct fragment),
+	    sizeof(*ret) + sizeof(struct fragment) * n_unique * n_node);
+	if (ret == NULL) {
+		for (size_t i = 0; i < n; i++) {
+			if (refcounts[i] != 0) {
+				fragment_unmap(&fragments[i]);
+			}
+
+			refcounts[i] = 0;
+		}
+
+		goto fail;
+	}
+
+	*ret = (struct jetex_table) {
+		.min_fragment = min_fragment,
+		.n_fragment = (uint32_t)n_fragment,
+		.n_unique = (uint32_t)n_unique,
+		.fragment_shift = (uint8_t)(64 - n_bits),
+		.key_size = (uint8_t)fragments[0].key_size,
+		.slot_width = (uint8_t)width,
+		.n_node = (uint16_t)n_node,
+		.slots = slots
+	};
+
+	for (size_t i = 0; i < ARRAY_SIZE(ret->uuid_bytes); i++) {
+		ret->uuid_bytes[i] = uuid[i];
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		if (unique[i] != 0) {
+			*jetex_table_fragment(ret, unique[i] - 1) = fragments[i];
+		}
+	}
+
+	for (size_t node = 1; node < n_node; node++) {
+		memcpy(jetex_table_fragment(ret, node * n_unique),
+		    jetex_table_fragment(ret, 0),
+		    n_unique * sizeof(struct fragment));
+	}
+
+	/* Prefaulting also speeds up replication: it reads the files. */
+	if (((options->flags & (JETEX_TABLE_PREFAULT | JETEX_TABLE_MLOCK)) != 0 &&
+	    table_prefault(jetex_table_fragment(ret, 0),
+	    n_unique, options) != 0) ||
+	    (n_node > 1 && table_replicate(ret, options) != 0)) {
+		jetex_table_destroy(ret);
+		ret = NULL;
+		for (size_t i = 0; i < n; i++) {
+			refcounts[i] = 0;
 		}
 	}
 
 	free(fragments);
-	free(slot_index);
+	free(unique);
 	return ret;
 
 fail:
-	free(ret);
+	free(slots.u8);
 	free(fragments);
-	free(slot_index);
+	free(unique);
 	return NULL;
 }
 
-static int
-cmp_fragment(const void *vx, const void *vy)
-{
-	const struct fragment *x = vx;
-	const struct fragment *y = vy;
-
-	if ((uintptr_t)x->data != (uintptr_t)y->data) {
-		return ((uintptr_t)x->data < (uintptr_t)y->data) ? -1 : 1;
-	}
-
-	return 0;
-}
-
 void
 jetex_table_destroy(struct jetex_table *table)
 {
-	const struct fragment_header *last_data = NULL;
+	size_t n;
 
 	if (table == NULL) {
 		return;
 	}
 
-	qsort(jetex_table_fragment(table, 0), table->n_fragment,
-	    sizeof(struct fragment), cmp_fragment);
-	for (size_t i = 0; i < table->n_fragment; i++) {
+	/* Views other than 0 may share fragments that aren't replicated. */
+	n = table->n_unique;
+	for (size_t i = 0; i < n * table->n_node; i++) {
 		struct fragment *fragment = jetex_table_fragment(table, i);
 
-		if (fragment->data != NULL && fragment->data != last_data) {
+		if (i < n ||
+		    fragment->data != jetex_table_fragment(table, i % n)->data) {
 			fragment_unmap(fragment);
 		}
-
-		last_data = fragment->data;
-		*fragment = (struct fragment) { .data = NULL };
 	}
 
+	free(table->slots.u8);
 	*table = (struct jetex_table) { .uuid = { 0, 0 } };
 	free(table);
 	return;
 }
 
-const void *
-table_lookup(const struct jetex_table *restrict table,
-    size_t *restrict OUT_item_size,
-    const uint64_t key[static 8])
+static inline const struct fragment *
+table_fragment_for(const struct jetex_table *table, unsigned int node,
+    uint64_t key0)
 {
-	uint64_t key0 = key[0];
 	uint64_t idx;
+	size_t index;
 
-	*OUT_item_size = 0;
 	idx = (table->fragment_shift >= 64) ? 0 : key0 >> table->fragment_shift;
 	if (idx < table->min_fragment) {
 		return NULL;
@@ -223,6 +581,265 @@ table_lookup(const struct jetex_table *restrict table,
 		return NULL;
 	}
 
-	return fragment_lookup(jetex_table_fragment(table, idx),
-	    OUT_item_size, key);
+	index = slot_get(table->slots, table->slot_width, idx);
+	if (index == 0) {
+		return NULL;
+	}
+
+	/* Without replication (or for hotplugged nodes), use view 0. */
+	index--;
+	if (node < table->n_node) {
+		index += (size_t)node * table->n_unique;
+	}
+
+	return jetex_table_fragment(table, index);
+}
+
+const void *
+table_lookup(const struct jetex_table *restrict table, unsigned int node,
+    size_t *restrict OUT_value_len,
+    const struct fragment **restrict OUT_fragment,
+    const uint64_t key[static 8])
+{
+	const struct fragment *fragment;
+	const void *value;
+
+	*OUT_value_len = 0;
+	*OUT_fragment = NULL;
+	fragment = table_fragment_for(table, node, key[0]);
+	if (fragment == NULL) {
+		return NULL;
+	}
+
+	value = fragment_lookup(fragment, OUT_value_len, key);
+	if (value != NULL) {
+		*OUT_fragment = fragment;
+	}
+
+	return value;
+}
+
+size_t
+table_lookup_batch(size_t n, unsigned int node,
+    const struct jetex_table *const *tables,
+    const uint64_t (*keys)[8],
+    const void **OUT_values, size_t *OUT_value_lens,
+    const struct fragment **OUT_fragments)
+{
+	const struct fragment *fragments[TABLE_LOOKUP_GROUP];
+	uint64_t hashes[TABLE_LOOKUP_GROUP];
+	size_t found = 0;
+
+	/*
+	 * Group prefetching: each stage touches memory the previous
+	 * stage prefetched for every key in the group, so the misses
+	 * for one group overlap instead of serialising.
+	 */
+	for (size_t base = 0; base < n; base += TABLE_LOOKUP_GROUP) {
+		size_t m = n - base;
+
+		if (m > TABLE_LOOKUP_GROUP) {
+			m = TABLE_LOOKUP_GROUP;
+		}
+
+		/* Stage 1: find each fragment, prefetch its descriptor. */
+		for (size_t i = 0; i < m; i++) {
+			const struct jetex_table *table = tables[base + i];
+
+			fragments[i] = (table == NULL)
+			    ? NULL
+			    : table_fragment_for(table, node, keys[base + i][0]);
+			if (fragments[i] != NULL) {
+				__builtin_prefetch(fragments[i]);
+				__builtin_prefetch((const char *)fragments[i] + 64);
+			}
+		}
+
+		/*
+		 * Stage 2: prefetch the filter block, or, without a
+		 * filter, scale() the guess and prefetch its cache lines.
+		 */
+		for (size_t i = 0; i < m; i++) {
+			const struct fragment *fragment = fragments[i];
+
+			if (fragment == NULL) {
+				continue;
+			}
+
+			if (fragment->filter == NULL) {
+				fragment_prefetch(fragment, keys[base + i]);
+				continue;
+			}
+
+			hashes[i] = fragment_filter_hash(keys[base + i],
+			    fragment->key_size);
+			fragment_filter_prefetch(fragment, hashes[i]);
+		}
+
+		/* Stage 3: drop filtered misses, prefetch the rest's lines. */
+		for (size_t i = 0; i < m; i++) {
+			const struct fragment *fragment = fragments[i];
+
+			if (fragment == NULL || fragment->filter == NULL) {
+				continue;
+			}
+
+			if (fragment_filter_check(fragment, hashes[i])) {
+				fragment_prefetch(fragment, keys[base + i]);
+			} else {
+				fragments[i] = NULL;
+			}
+		}
+
+		/* Stage 4: probe; the lines should now be in flight or cached. */
+		for (size_t i = 0; i < m; i++) {
+			const void *value = NULL;
+
+			OUT_value_lens[base + i] = 0;
+			if (fragments[i] != NULL) {
+				value = fragment_lookup_unfiltered(fragments[i],
+				    &OUT_value_lens[base + i], keys[base + i]);
+			}
+
+			OUT_values[base + i] = value;
+			OUT_fragments[base + i] = (value != NULL) ? fragments[i] : NULL;
+			found += (value != NULL);
+		}
+	}
+
+	return found;
+}
+
+void
+table_scan_init(struct table_scan *scan, const struct jetex_table *table,
+    unsigned int node, const uint64_t start[static 8], uint64_t end)
+{
+
+	*scan = (struct table_scan) {
+		.table = table,
+		.end = end,
+		.node = node
+	};
+
+	memcpy(scan->next, start, sizeof(scan->next));
+	return;
+}
+
+/*
+ * Starts the next run at scan->next: the longest range of directory
+ * slots that map to the same fragment.  Returns false once past the
+ * end of the scan.
+ */
+static bool
+scan_run(struct table_scan *scan)
+{
+	const struct jetex_table *table = scan->table;
+	unsigned int shift = table->fragment_shift;
+
+	while (scan->done == 0 && scan->next[0] <= scan->end) {
+		uint64_t idx = (shift >= 64) ? 0 : scan->next[0] >> shift;
+		uint64_t last_idx;
+		uint64_t last;
+		size_t index;
+
+		if (idx < table->min_fragment) {
+			/* min_fragment > 0, so shift < 64. */
+			memset(scan->next, 0, sizeof(scan->next));
+			scan->next[0] = (uint64_t)table->min_fragment << shift;
+			continue;
+		}
+
+		idx -= table->min_fragment;
+		if (idx >= table->n_fragment) {
+			break;
+		}
+
+		index = slot_get(table->slots, table->slot_width, idx);
+		for (last_idx = idx; last_idx + 1 < table->n_fragment &&
+		    slot_get(table->slots, table->slot_width,
+		    last_idx + 1) == index; last_idx++) {
+			continue;
+		}
+
+		/* Wraps to UINT64_MAX for the last slot. */
+		last = (shift >= 64)
+		    ? UINT64_MAX
+		    : ((table->min_fragment + last_idx + 1) << shift) - 1;
+		if (index != 0) {
+			index--;
+			if (scan->node < table->n_node) {
+				index += (size_t)scan->node * table->n_unique;
+			}
+
+			scan->fragment = jetex_table_fragment(table, index);
+			scan->slot = fragment_seek(scan->fragment, scan->next);
+			scan->last = (last < scan->end) ? last : scan->end;
+		}
+
+		if (last >= scan->end) {
+			scan->done = 1;
+		} else {
+			memset(scan->next, 0, sizeof(scan->next));
+			scan->next[0] = last + 1;
+		}
+
+		if (scan->fragment != NULL) {
+			return true;
+		}
+	}
+
+	scan->done = 1;
+	return false;
+}
+
+const uint64_t *
+table_scan_next(struct table_scan *restrict scan,
+    const void **restrict OUT_value, size_t *restrict OUT_value_len,
+    const struct fragment **restrict OUT_fragment)
+{
+	size_t key_bytes = sizeof(uint64_t) * scan->table->key_size;
+
+	*OUT_value = NULL;
+	*OUT_value_len = 0;
+	*OUT_fragment = NULL;
+	for (;;) {
+		const struct fragment *fragment = scan->fragment;
+
+		if (fragment == NULL) {
+			if (!scan_run(scan)) {
+				return NULL;
+			}
+
+			continue;
+		}
+
+		while (scan->slot < fragment->n_slot) {
+			const uint64_t *item =
+			    &fragment->items[scan->slot * fragment->item_size];
+			const void *value;
+
+			if (item[0] > scan->last) {
+				break;
+			}
+
+			scan->slot++;
+			/* Skip the repeats in slots without a key of their own. */
+			if (scan->prev != NULL &&
+			    memcmp(item, scan->prev, key_bytes) == 0) {
+				continue;
+			}
+
+			scan->prev = item;
+			value = fragment_item_value(fragment, OUT_value_len, item);
+			if (value == NULL) {
+				continue;
+			}
+
+			*OUT_value = value;
+			*OUT_fragment = fragment;
+			return item;
+		}
+
+		scan->fragment = NULL;
+	}
 }
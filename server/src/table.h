@@ -5,16 +5,41 @@
 
 #include "fragment.h"
 
+struct jetex_table_options;
+
+union table_slots {
+	uint8_t *u8;
+	uint16_t *u16;
+	uint32_t *u32;
+};
+
+/*
+ * Two-level fragment directory: each of the n_fragment slots (one per
+ * value of key[0]'s top n_bits) holds 0 if no fragment covers it, or
+ * 1 + an index in the n_unique distinct fragments, which follow the
+ * table.  Slots are as narrow as n_unique allows.
+ *
+ * Distinct fragments come in n_node views of n_unique each: view i
+ * has node i's copies (or the shared mapping, for fragments that
+ * aren't replicated).
+ */
 struct jetex_table {
 	union {
 		uint64_t uuid[2];
 		uint8_t uuid_bytes[16];
 	};
 	uint32_t min_fragment;
-	uint32_t n_fragment;
+	uint32_t n_fragment; /* slots. */
+	uint32_t n_unique;
 	uint8_t fragment_shift;
-	uint8_t padding[7];
-};
+	uint8_t key_size; /* in uint64_t, shared by all fragments. */
+	uint8_t slot_width; /* 1, 2 or 4 bytes. */
+	uint8_t padding0;
+	uint16_t n_node; /* >= 1. */
+	uint16_t padding1[3];
+	union table_slots slots; /* [n_fragment]. */
+	uint64_t padding2[2];
+} __attribute__((__aligned__(64)));
 
 static inline struct fragment *
 jetex_table_fragment(const struct jetex_table *table, size_t index)
@@ -28,11 +53,73 @@ JT_CC_PUBLIC struct jetex_table *
 jetex_table_create(const uint8_t uuid[static 16],
     const int *restrict fds, uint64_t *restrict refcounts, size_t n_fd);
 
+JT_CC_PUBLIC struct jetex_table *
+jetex_table_create_options(const uint8_t uuid[static 16],
+    const int *restrict fds, uint64_t *restrict refcounts, size_t n_fd,
+    const struct jetex_table_options *options);
+
 JT_CC_PUBLIC void
 jetex_table_destroy(struct jetex_table *table);
 
+/*
+ * Returns key's value and its length, like fragment_lookup, reading
+ * node's copy of the fragment if there is one.  Also stores that
+ * fragment in OUT_fragment (NULL on a miss): values from compressed
+ * fragments must be read with fragment_value_copy().
+ */
 const void *
-table_lookup(const struct jetex_table *restrict table,
-    size_t *restrict OUT_item_size,
+table_lookup(const struct jetex_table *restrict table, unsigned int node,
+    size_t *restrict OUT_value_len,
+    const struct fragment **restrict OUT_fragment,
     const uint64_t key[static 8]);
+
+/* Number of lookups table_lookup_batch keeps in flight. */
+#define TABLE_LOOKUP_GROUP 16
+
+/*
+ * Equivalent to calling table_lookup(tables[i], node, &OUT_value_lens[i],
+ * &OUT_fragments[i], keys[i]) for i < n and storing the results in
+ * OUT_values[i], but overlaps the
+ * cache misses of up to TABLE_LOOKUP_GROUP lookups at a time.  NULL
+ * tables always miss.
+ *
+ * Returns the number of hits.
+ */
+size_t
+table_lookup_batch(size_t n, unsigned int node,
+    const struct jetex_table *const *tables,
+    const uint64_t (*keys)[8],
+    const void **OUT_values, size_t *OUT_value_lens,
+    const struct fragment **OUT_fragments);
+
+/*
+ * Iterates over a table's keys in order, from start up to the last key
+ * whose first word is <= end, reading node's fragment copies.  Like
+ * lookups, each key[0] is only read from the fragment the directory
+ * maps it to.
+ */
+struct table_scan {
+	const struct jetex_table *table;
+	const struct fragment *fragment; /* NULL between runs. */
+	const uint64_t *prev; /* last key returned, or NULL. */
+	uint64_t slot; /* next slot in fragment. */
+	uint64_t last; /* last key[0] to read from fragment. */
+	uint64_t end;
+	uint64_t next[8]; /* where the next run starts. */
+	uint32_t node;
+	uint32_t done; /* no run after the current one. */
+};
+
+void
+table_scan_init(struct table_scan *scan, const struct jetex_table *table,
+    unsigned int node, const uint64_t start[static 8], uint64_t end);
+
+/*
+ * Returns the next key (key_size words, in the fragment), and stores
+ * its value, length and fragment like table_lookup; NULL once done.
+ */
+const uint64_t *
+table_scan_next(struct table_scan *restrict scan,
+    const void **restrict OUT_value, size_t *restrict OUT_value_len,
+    const struct fragment **restrict OUT_fragment);
 #endif /* !JETEX_TABLE_H */
@@ -0,0 +1,785 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "serve.h"
+#include "uring.h"
+#include "utility/cc.h"
+#include "zerocopy.h"
+
+#if defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  include <linux/io_uring.h>
+#  include <linux/time_types.h>
+# endif
+#endif
+
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+
+/* Provided buffers; each holds one datagram.  Must be a power of two. */
+#define URING_BUFFER_COUNT 256
+#define URING_BUFFER_SIZE						\
+	(sizeof(struct io_uring_recvmsg_out) +				\
+	    sizeof(struct sockaddr_storage) + SERVE_DATAGRAM_SIZE)
+#define URING_BUFFER_GROUP 0
+
+/* user_data is kind << 32 | fd index (zero-copy send id for SEND_ZC). */
+#define URING_KIND_RECV 1ULL
+#define URING_KIND_SEND 2ULL
+#define URING_KIND_SEND_ZC 3ULL
+
+struct uring {
+	int fd;
+	uint32_t sq_mask;
+	uint32_t cq_mask;
+	uint32_t sq_tail; /* local copy, published by uring_enter. */
+	uint32_t sq_entries;
+	uint16_t buf_tail;
+	uint16_t padding;
+	uint32_t *k_sq_head;
+	uint32_t *k_sq_tail;
+	uint32_t *k_sq_array;
+	uint32_t *k_cq_head;
+	uint32_t *k_cq_tail;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *ring_map;
+	size_t ring_map_size;
+	size_t sqes_size;
+	struct io_uring_buf_ring *buf_ring;
+	size_t buf_ring_size;
+	char *buffers;
+};
+
+/* Sort key for earliest-deadline-first scheduling of pending requests. */
+struct uring_edf {
+	int32_t slack;
+	uint32_t slot;
+};
+
+struct serve_uring {
+	struct uring ring;
+	struct serve_source *source;
+	const int *fds;
+	size_t n_fd;
+	bool *armed; /* [n_fd] */
+	bool served;
+	bool unsupported;
+	uint8_t padding[6];
+	size_t inflight; /* sendmsg SQEs without a CQE yet. */
+	/* FIFO of received datagrams, at most one per provided buffer. */
+	size_t pending_head;
+	size_t n_pending;
+	struct serve_request pending[URING_BUFFER_COUNT];
+	uint16_t pending_bid[URING_BUFFER_COUNT];
+	struct msghdr recv_template;
+	/* Scratch space to reorder pending by deadline. */
+	struct uring_edf edf[URING_BUFFER_COUNT];
+	struct serve_request edf_pending[URING_BUFFER_COUNT];
+	uint16_t edf_bid[URING_BUFFER_COUNT];
+	struct serve_request batch[SERVE_BATCH_SIZE];
+	struct msghdr send_msg[SERVE_BATCH_SIZE];
+	struct iovec send_iov[SERVE_BATCH_SIZE][2];
+	struct serve_reply replies[SERVE_BATCH_SIZE];
+	struct zerocopy zc;
+};
+
+static JT_CC_CONST uint32_t
+next_pow2(size_t x)
+{
+	uint32_t ret = 1;
+
+	while (ret < x) {
+		ret *= 2;
+	}
+
+	return ret;
+}
+
+static void
+uring_destroy(struct uring *ring)
+{
+
+	if (ring->buffers != NULL) {
+		munmap(ring->buffers, URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+	}
+
+	if (ring->buf_ring != NULL) {
+		munmap(ring->buf_ring, ring->buf_ring_size);
+	}
+
+	if (ring->sqes != NULL) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+
+	if (ring->ring_map != NULL) {
+		munmap(ring->ring_map, ring->ring_map_size);
+	}
+
+	if (ring->fd >= 0) {
+		close(ring->fd);
+	}
+
+	*ring = (struct uring) { .fd = -1 };
+	return;
+}
+
+static int
+uring_setup_fd(struct io_uring_params *params,
+    uint32_t sq_entries, uint32_t cq_entries)
+{
+	static const uint32_t flag_sets[] = {
+		IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+		IORING_SETUP_COOP_TASKRUN,
+		0
+	};
+
+	for (size_t i = 0; i < ARRAY_SIZE(flag_sets); i++) {
+		long r;
+
+		*params = (struct io_uring_params) {
+			.flags = IORING_SETUP_CQSIZE | flag_sets[i],
+			.cq_entries = cq_entries
+		};
+
+		r = syscall(__NR_io_uring_setup, sq_entries, params);
+		if (r >= 0) {
+			return (int)r;
+		}
+
+		if (errno != EINVAL) {
+			break;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Points buffer ring slot at buffer bid.  Field by field: bufs[0].resv
+ * is the ring's tail, which the kernel may be reading.
+ */
+static void
+uring_buffer_set(struct uring *ring, size_t slot, uint16_t bid)
+{
+	struct io_uring_buf *buf = &ring->buf_ring->bufs[slot];
+
+	buf->addr = (uintptr_t)&ring->buffers[(size_t)bid * URING_BUFFER_SIZE];
+	buf->len = (uint32_t)URING_BUFFER_SIZE;
+	buf->bid = bid;
+	return;
+}
+
+static int
+uring_setup(struct uring *ring, uint32_t sq_entries, uint32_t cq_entries)
+{
+	struct io_uring_params params;
+	struct io_uring_buf_reg reg;
+	char *map;
+
+	*ring = (struct uring) { .fd = -1 };
+	ring->fd = uring_setup_fd(&params, sq_entries, cq_entries);
+	if (ring->fd < 0) {
+		goto fail;
+	}
+
+	if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0 ||
+	    (params.features & IORING_FEAT_EXT_ARG) == 0) {
+		goto fail;
+	}
+
+	ring->ring_map_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	if (params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe) >
+	    ring->ring_map_size) {
+		ring->ring_map_size = params.cq_off.cqes +
+		    params.cq_entries * sizeof(struct io_uring_cqe);
+	}
+
+	map = mmap(NULL, ring->ring_map_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if ((void *)map == MAP_FAILED) {
+		goto fail;
+	}
+
+	ring->ring_map = map;
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if ((void *)ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto fail;
+	}
+
+	ring->sq_entries = params.sq_entries;
+	ring->sq_mask = *(uint32_t *)(map + params.sq_off.ring_mask);
+	ring->cq_mask = *(uint32_t *)(map + params.cq_off.ring_mask);
+	ring->k_sq_head = (uint32_t *)(map + params.sq_off.head);
+	ring->k_sq_tail = (uint32_t *)(map + params.sq_off.tail);
+	ring->k_sq_array = (uint32_t *)(map + params.sq_off.array);
+	ring->k_cq_head = (uint32_t *)(map + params.cq_off.head);
+	ring->k_cq_tail = (uint32_t *)(map + params.cq_off.tail);
+	ring->cqes = (struct io_uring_cqe *)(map + params.cq_off.cqes);
+	ring->sq_tail = *ring->k_sq_tail;
+
+	/* Provided buffer ring: the kernel picks a buffer per datagram. */
+	ring->buf_ring_size = URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+	ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if ((void *)ring->buf_ring == MAP_FAILED) {
+		ring->buf_ring = NULL;
+		goto fail;
+	}
+
+	ring->buffers = mmap(NULL, URING_BUFFER_COUNT * URING_BUFFER_SIZE,
+	    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if ((void *)ring->buffers == MAP_FAILED) {
+		ring->buffers = NULL;
+		goto fail;
+	}
+
+	reg = (struct io_uring_buf_reg) {
+		.ring_addr = (uintptr_t)ring->buf_ring,
+		.ring_entries = URING_BUFFER_COUNT,
+		.bgid = URING_BUFFER_GROUP
+	};
+
+	if (syscall(__NR_io_uring_register, ring->fd,
+	    IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+		goto fail;
+	}
+
+	for (size_t i = 0; i < URING_BUFFER_COUNT; i++) {
+		uring_buffer_set(ring, i, (uint16_t)i);
+	}
+
+	ring->buf_tail = URING_BUFFER_COUNT;
+	__atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+	return 0;
+
+fail:
+	uring_destroy(ring);
+	return -1;
+}
+
+/* Enables zc if the kernel has IORING_OP_SENDMSG_ZC. */
+static void
+uring_probe_zerocopy(const struct uring *ring, struct zerocopy *zc)
+{
+#if defined(IORING_SEND_ZC_REPORT_USAGE)
+	union {
+		struct io_uring_probe probe;
+		char bytes[sizeof(struct io_uring_probe) +
+		    256 * sizeof(struct io_uring_probe_op)];
+	} buf;
+
+	memset(&buf, 0, sizeof(buf));
+	zc->enabled = 0;
+	if (syscall(__NR_io_uring_register, ring->fd,
+	    IORING_REGISTER_PROBE, &buf, 256) != 0) {
+		return;
+	}
+
+	if (buf.probe.ops_len > IORING_OP_SENDMSG_ZC &&
+	    (buf.probe.ops[IORING_OP_SENDMSG_ZC].flags & IO_URING_OP_SUPPORTED) != 0) {
+		zc->enabled = 1;
+	}
+#else
+	(void)ring;
+	zc->enabled = 0;
+#endif
+	return;
+}
+
+/* Hands buffer bid back to the kernel; published by uring_buffer_flush. */
+static void
+uring_buffer_return(struct uring *ring, uint16_t bid)
+{
+	uint16_t mask = URING_BUFFER_COUNT - 1;
+
+	uring_buffer_set(ring, ring->buf_tail & mask, bid);
+
+	ring->buf_tail++;
+	return;
+}
+
+static void
+uring_buffer_flush(struct uring *ring)
+{
+
+	__atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+	return;
+}
+
+static int
+uring_enter(struct uring *ring, uint32_t wait_nr, int timeout_ms)
+{
+	struct __kernel_timespec ts = {
+		.tv_sec = timeout_ms / 1000,
+		.tv_nsec = 1000000LL * (timeout_ms % 1000)
+	};
+	struct io_uring_getevents_arg arg = {
+		.ts = (uintptr_t)&ts
+	};
+	uint32_t to_submit;
+	long r;
+
+	__atomic_store_n(ring->k_sq_tail, ring->sq_tail, __ATOMIC_RELEASE);
+	to_submit = ring->sq_tail - __atomic_load_n(ring->k_sq_head, __ATOMIC_ACQUIRE);
+	if (to_submit == 0 && wait_nr == 0) {
+		return 0;
+	}
+
+	r = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+	    IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	return (r < 0) ? -1 : 0;
+}
+
+static struct io_uring_sqe *
+uring_get_sqe(struct uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	uint32_t head;
+	uint32_t index;
+
+	head = __atomic_load_n(ring->k_sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sq_tail - head >= ring->sq_entries) {
+		uring_enter(ring, 0, 0);
+		head = __atomic_load_n(ring->k_sq_head, __ATOMIC_ACQUIRE);
+		if (ring->sq_tail - head >= ring->sq_entries) {
+			return NULL;
+		}
+	}
+
+	index = ring->sq_tail & ring->sq_mask;
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->k_sq_array[index] = index;
+	ring->sq_tail++;
+	return sqe;
+}
+
+static void
+arm_recv(struct serve_uring *state, size_t i)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(&state->ring);
+	if (sqe == NULL) {
+		return;
+	}
+
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = state->fds[i];
+	sqe->addr = (uintptr_t)&state->recv_template;
+	sqe->len = 1;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->user_data = (URING_KIND_RECV << 32) | i;
+	state->armed[i] = true;
+	return;
+}
+
+static void
+handle_recv(struct serve_uring *state, const struct io_uring_cqe *cqe)
+{
+	size_t index = (uint32_t)cqe->user_data;
+	struct io_uring_recvmsg_out out;
+	const char *buf;
+	uint16_t bid;
+
+	if ((cqe->flags & IORING_CQE_F_MORE) == 0) {
+		state->armed[index] = false;
+	}
+
+	if (cqe->res < 0) {
+		/* Multishot recvmsg isn't supported at all. */
+		if (cqe->res == -EINVAL && state->served == false) {
+			state->unsupported = true;
+		}
+
+		return;
+	}
+
+	if ((cqe->flags & IORING_CQE_F_BUFFER) == 0) {
+		return;
+	}
+
+	bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+	buf = &state->ring.buffers[bid * URING_BUFFER_SIZE];
+	memcpy(&out, buf, sizeof(out));
+
+	{
+		size_t slot = (state->pending_head + state->n_pending) % URING_BUFFER_COUNT;
+		const char *name = buf + sizeof(out);
+		const char *payload = name + state->recv_template.msg_namelen;
+		socklen_t srclen = out.namelen;
+
+		if (srclen > state->recv_template.msg_namelen) {
+			srclen = state->recv_template.msg_namelen;
+		}
+
+		state->pending[slot] = (struct serve_request) {
+			.data = payload,
+			.len = ((out.flags & MSG_TRUNC) != 0) ? 0 : out.payloadlen,
+			.src = (const struct sockaddr *)name,
+			.srclen = srclen,
+			.origin = (uint32_t)index
+		};
+
+		state->pending_bid[slot] = bid;
+		state->n_pending++;
+	}
+
+	return;
+}
+
+/*
+ * Zero-copy sends complete twice: once when the send is queued (with
+ * F_MORE if a notification follows), and again with F_NOTIF once the
+ * kernel is done with the buffers.
+ */
+static void
+handle_send_zc(struct serve_uring *state, const struct io_uring_cqe *cqe)
+{
+	uint32_t id = (uint32_t)cqe->user_data;
+
+#if defined(IORING_SEND_ZC_REPORT_USAGE)
+	if ((cqe->flags & IORING_CQE_F_NOTIF) != 0) {
+		/* The kernel copied anyway (e.g., loopback): stop trying. */
+		if (((uint32_t)cqe->res & IORING_NOTIF_USAGE_ZC_COPIED) != 0) {
+			state->zc.enabled = 0;
+		}
+
+		zerocopy_complete(&state->zc, id, id);
+		return;
+	}
+#endif
+
+	if (state->inflight > 0) {
+		state->inflight--;
+	}
+
+	if ((cqe->flags & IORING_CQE_F_MORE) == 0) {
+		zerocopy_complete(&state->zc, id, id);
+	}
+
+	return;
+}
+
+static void
+reap(struct serve_uring *state)
+{
+	struct uring *ring = &state->ring;
+	uint32_t head = *ring->k_cq_head;
+	uint32_t tail = __atomic_load_n(ring->k_cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		const struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+
+		switch (cqe->user_data >> 32) {
+		case URING_KIND_RECV:
+			handle_recv(state, cqe);
+			break;
+		case URING_KIND_SEND:
+			if (state->inflight > 0) {
+				state->inflight--;
+			}
+			break;
+		case URING_KIND_SEND_ZC:
+			handle_send_zc(state, cqe);
+			break;
+		default:
+			break;
+		}
+	}
+
+	__atomic_store_n(ring->k_cq_head, head, __ATOMIC_RELEASE);
+	return;
+}
+
+static int
+cmp_uring_edf(const void *vx, const void *vy)
+{
+	const struct uring_edf *x = vx;
+	const struct uring_edf *y = vy;
+
+	if (x->slack != y->slack) {
+		return (x->slack < y->slack) ? -1 : 1;
+	}
+
+	/* Otherwise, keep arrival order. */
+	if (x->slot != y->slot) {
+		return (x->slot < y->slot) ? -1 : 1;
+	}
+
+	return 0;
+}
+
+/*
+ * When we're backlogged (more pending datagrams than one batch),
+ * reorders the pending FIFO earliest deadline first.  Requests that
+ * have already expired sort first too: serve_batch drops them before
+ * any lookup, which frees their buffers quickly.
+ */
+static void
+order_pending(struct serve_uring *state)
+{
+	struct timeval now;
+	size_t n = state->n_pending;
+
+	gettimeofday(&now, NULL);
+	for (size_t i = 0; i < n; i++) {
+		size_t slot = (state->pending_head + i) % URING_BUFFER_COUNT;
+
+		state->edf[i] = (struct uring_edf) {
+			.slack = serve_request_slack(&state->pending[slot], &now),
+			.slot = (uint32_t)i
+		};
+	}
+
+	qsort(state->edf, n, sizeof(state->edf[0]), cmp_uring_edf);
+	for (size_t i = 0; i < n; i++) {
+		size_t slot = (state->pending_head + state->edf[i].slot) % URING_BUFFER_COUNT;
+
+		state->edf_pending[i] = state->pending[slot];
+		state->edf_bid[i] = state->pending_bid[slot];
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		size_t slot = (state->pending_head + i) % URING_BUFFER_COUNT;
+
+		state->pending[slot] = state->edf_pending[i];
+		state->pending_bid[slot] = state->edf_bid[i];
+	}
+
+	return;
+}
+
+/* Serves up to one batch of pending datagrams. */
+static void
+flush_batch(struct serve_uring *state)
+{
+	size_t n = state->n_pending;
+	size_t n_reply;
+
+	if (n > SERVE_BATCH_SIZE) {
+		n = SERVE_BATCH_SIZE;
+		order_pending(state);
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		size_t slot = (state->pending_head + i) % URING_BUFFER_COUNT;
+
+		state->batch[i] = state->pending[slot];
+	}
+
+	n_reply = serve_batch(serve_source_acquire(state->source),
+	    state->source->node, state->batch, n, state->replies,
+	    ARRAY_SIZE(state->replies));
+	state->served = true;
+
+	/* Replies are self-contained: we're done with the receive buffers. */
+	for (size_t i = 0; i < n; i++) {
+		size_t slot = (state->pending_head + i) % URING_BUFFER_COUNT;
+
+		uring_buffer_return(&state->ring, state->pending_bid[slot]);
+	}
+
+	uring_buffer_flush(&state->ring);
+	state->pending_head = (state->pending_head + n) % URING_BUFFER_COUNT;
+	state->n_pending -= n;
+
+	for (size_t i = 0; i < n_reply; i++) {
+		struct serve_reply *reply = &state->replies[i];
+		struct iovec *iov = state->send_iov[i];
+		struct io_uring_sqe *sqe;
+
+		/* Coalesced into an earlier reply. */
+		if (reply->len == 0) {
+			continue;
+		}
+
+		sqe = uring_get_sqe(&state->ring);
+		if (sqe == NULL) {
+			break;
+		}
+
+		iov[0] = (struct iovec) {
+			.iov_base = reply->bytes,
+			.iov_len = reply->len
+		};
+
+		iov[1] = (struct iovec) {
+			.iov_base = (void *)(uintptr_t)reply->value,
+			.iov_len = reply->value_len
+		};
+
+		state->send_msg[i] = (struct msghdr) {
+			.msg_name = &reply->dst,
+			.msg_namelen = reply->dstlen,
+			.msg_iov = iov,
+			.msg_iovlen = (reply->value_len > 0) ? 2 : 1
+		};
+
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = state->fds[reply->origin];
+		sqe->addr = (uintptr_t)&state->send_msg[i];
+		sqe->len = 1;
+		/* Fail instead of queueing when the socket buffer is full. */
+		sqe->msg_flags = MSG_DONTWAIT;
+		sqe->user_data = (URING_KIND_SEND << 32) | reply->origin;
+#if defined(IORING_SEND_ZC_REPORT_USAGE)
+		/*
+		 * The header must outlive the replies buffer, until the
+		 * notification: copy it to the zero-copy slot.
+		 */
+		if (reply->value_len >= ZEROCOPY_MIN_VALUE &&
+		    zerocopy_available(&state->zc)) {
+			uint32_t id = state->zc.tail++;
+
+			iov[0].iov_base = memcpy(zerocopy_header(&state->zc, id),
+			    reply->bytes, reply->len);
+			sqe->opcode = IORING_OP_SENDMSG_ZC;
+			sqe->ioprio = IORING_SEND_ZC_REPORT_USAGE;
+			sqe->user_data = (URING_KIND_SEND_ZC << 32) | id;
+		}
+#endif
+		state->inflight++;
+	}
+
+	return;
+}
+
+int
+serve_uring(struct serve_source *source,
+    double deadline, const int *fds, size_t n_fd)
+{
+	struct serve_uring *state;
+	double wait_end;
+	uint32_t sq_entries;
+	uint32_t cq_entries;
+	bool leak = false;
+	int ret = -1;
+
+	if (n_fd == 0 || n_fd > UINT32_MAX) {
+		return -1;
+	}
+
+	state = calloc(1, sizeof(*state));
+	if (state == NULL) {
+		return -1;
+	}
+
+	state->ring = (struct uring) { .fd = -1 };
+	state->source = source;
+	state->fds = fds;
+	state->n_fd = n_fd;
+	state->armed = calloc(n_fd, sizeof(state->armed[0]));
+	state->recv_template = (struct msghdr) {
+		.msg_namelen = sizeof(struct sockaddr_storage)
+	};
+
+	/*
+	 * Size the rings for this thread: a batch of sends plus one
+	 * (re)arm per fd in the SQ, and enough CQ space for every
+	 * provided buffer and send to complete before we reap.
+	 */
+	sq_entries = next_pow2(2 * (SERVE_BATCH_SIZE + n_fd));
+	cq_entries = next_pow2(2 * (URING_BUFFER_COUNT + sq_entries));
+	if (state->armed == NULL ||
+	    uring_setup(&state->ring, sq_entries, cq_entries) != 0) {
+		goto out;
+	}
+
+	uring_probe_zerocopy(&state->ring, &state->zc);
+
+	for (;;) {
+		int timeout = serve_timeout_ms(deadline);
+		uint32_t wait_nr;
+
+		if (timeout <= 0 || state->unsupported) {
+			break;
+		}
+
+		/* Replies are only reused once their sends have completed. */
+		if (state->inflight == 0 && state->n_pending > 0) {
+			flush_batch(state);
+		}
+
+		for (size_t i = 0; i < n_fd; i++) {
+			if (state->armed[i] == false) {
+				arm_recv(state, i);
+			}
+		}
+
+		if (state->inflight > 0) {
+			wait_nr = (uint32_t)state->inflight;
+		} else {
+			wait_nr = (state->n_pending > 0) ? 0 : 1;
+		}
+
+		/* Sends read values straight from fragments. */
+		source->in_flight = state->inflight + zerocopy_pending(&state->zc);
+		if (wait_nr > 0) {
+			serve_source_release(source);
+		}
+
+		uring_enter(&state->ring, wait_nr, timeout);
+		reap(state);
+		source->in_flight = state->inflight + zerocopy_pending(&state->zc);
+	}
+
+	/* As in serve_loop: wait a little for the last sends. */
+	wait_end = serve_now() + 1e-3 * SERVE_ZEROCOPY_WAIT_MS;
+	while (source->in_flight > 0) {
+		int timeout = serve_timeout_ms(wait_end);
+
+		if (timeout <= 0) {
+			/* Stuck: their headers must stay put. */
+			leak = true;
+			break;
+		}
+
+		uring_enter(&state->ring, 1, timeout);
+		reap(state);
+		source->in_flight = state->inflight + zerocopy_pending(&state->zc);
+	}
+
+	source->in_flight = 0;
+	serve_source_release(source);
+	ret = (state->unsupported && state->served == false) ? -1 : 0;
+
+out:
+	uring_destroy(&state->ring);
+	free(state->armed);
+	if (!leak) {
+		free(state);
+	}
+
+	return ret;
+}
+
+#else /* !IORING_RECV_MULTISHOT */
+
+int
+serve_uring(struct serve_source *source,
+    double deadline, const int *fds, size_t n_fd)
+{
+
+	(void)source;
+	(void)deadline;
+	(void)fds;
+	(void)n_fd;
+	return -1;
+}
+
+#endif /* IORING_RECV_MULTISHOT */
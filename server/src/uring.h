@@ -0,0 +1,19 @@
+#ifndef JETEX_URING_H
+#define JETEX_URING_H
+#include <stddef.h>
+
+struct serve_source;
+
+/*
+ * io_uring flavour of jetex_serve: one multishot recvmsg per fd, fed
+ * from a provided buffer ring, and batched sendmsg SQEs for replies.
+ *
+ * Returns -1, before serving any request, if the kernel (or the
+ * headers we were built against) lacks multishot recvmsg, provided
+ * buffer rings or timed waits; the caller should fall back to
+ * recvmmsg.  Returns 0 once the deadline has passed.
+ */
+int
+serve_uring(struct serve_source *source,
+    double deadline, const int *fds, size_t n_fd);
+#endif /* !JETEX_URING_H */
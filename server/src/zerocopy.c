@@ -0,0 +1,108 @@
+/* linux/errqueue.h uses struct timespec. */
+#include <time.h>
+
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "zerocopy.h"
+
+int
+zerocopy_enable(struct zerocopy *zc, int fd, bool fresh)
+{
+	int one = 1;
+
+	zc->enabled = 0;
+	zc->unsynced = fresh ? 0 : 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0) {
+		return -1;
+	}
+
+	zc->enabled = 1;
+	return 0;
+}
+
+void
+zerocopy_complete(struct zerocopy *zc, uint32_t lo, uint32_t hi)
+{
+
+	for (uint32_t id = lo; ; id++) {
+		/* Ignore ids outside the window: they can't be ours. */
+		if (id - zc->head < zc->tail - zc->head) {
+			zc->done[id % ZEROCOPY_SLOTS] = 1;
+		}
+
+		if (id == hi) {
+			break;
+		}
+	}
+
+	while (zc->head != zc->tail && zc->done[zc->head % ZEROCOPY_SLOTS] != 0) {
+		zc->done[zc->head % ZEROCOPY_SLOTS] = 0;
+		zc->head++;
+	}
+
+	return;
+}
+
+void
+zerocopy_drain(struct zerocopy *zc, int fd)
+{
+
+	while (zerocopy_pending(zc) > 0) {
+		char control[CMSG_SPACE(sizeof(struct sock_extended_err) +
+		    sizeof(struct sockaddr_in6))];
+		struct msghdr msg = {
+			.msg_control = control,
+			.msg_controllen = sizeof(control)
+		};
+
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			return;
+		}
+
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		     cmsg != NULL;
+		     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			struct sock_extended_err err;
+
+			if (!((cmsg->cmsg_level == SOL_IP &&
+			    cmsg->cmsg_type == IP_RECVERR) ||
+			    (cmsg->cmsg_level == SOL_IPV6 &&
+			    cmsg->cmsg_type == IPV6_RECVERR))) {
+				continue;
+			}
+
+			memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+			if (err.ee_errno != 0 ||
+			    err.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+				continue;
+			}
+
+			/*
+			 * The oldest send still reported is our first, if
+			 * whoever sent on fd before waited for theirs (as
+			 * serve_loop does).
+			 */
+			if (zc->unsynced != 0) {
+				zc->base = err.ee_info - zc->head;
+				zc->unsynced = 0;
+			}
+
+			zerocopy_complete(zc, err.ee_info - zc->base,
+			    err.ee_data - zc->base);
+			/*
+			 * The kernel had to copy anyway (e.g., loopback):
+			 * zero-copy only adds overhead on this socket.
+			 */
+			if ((err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0) {
+				zc->enabled = 0;
+			}
+		}
+	}
+
+	return;
+}
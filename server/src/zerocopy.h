@@ -0,0 +1,74 @@
+#ifndef JETEX_ZEROCOPY_H
+#define JETEX_ZEROCOPY_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "shared/packet.h"
+
+/* Values at least this long are sent with MSG_ZEROCOPY (or SENDMSG_ZC). */
+#define ZEROCOPY_MIN_VALUE 8192
+/* Max number of zero-copy sends in flight per socket (or ring). */
+#define ZEROCOPY_SLOTS 256
+
+/*
+ * The kernel keeps reading a zero-copy send's iovecs until it posts a
+ * completion notification, so the encoded headers live here, indexed
+ * by send id, instead of in the reusable serve_reply buffers.  Values
+ * point straight into fragments: while sends are pending, the serving
+ * thread must not pass a quiescent point (see serve_source).
+ *
+ * The kernel numbers a socket's zero-copy sends from 0 for its whole
+ * life, so this state should live as long as the socket.  If it can't
+ * (jetex_serve), base is learnt from the first notification instead.
+ */
+struct zerocopy {
+	uint32_t head; /* oldest id that may still be in flight. */
+	uint32_t tail; /* next id. */
+	uint32_t enabled;
+	uint32_t base; /* kernel id of our id 0. */
+	uint32_t unsynced; /* base isn't known yet. */
+	uint32_t padding;
+	uint8_t done[ZEROCOPY_SLOTS];
+	struct jetex_header_found headers[ZEROCOPY_SLOTS];
+};
+
+static inline size_t
+zerocopy_pending(const struct zerocopy *zc)
+{
+
+	return zc->tail - zc->head;
+}
+
+static inline bool
+zerocopy_available(const struct zerocopy *zc)
+{
+
+	return zc->enabled != 0 && zerocopy_pending(zc) < ZEROCOPY_SLOTS;
+}
+
+static inline struct jetex_header_found *
+zerocopy_header(struct zerocopy *zc, uint32_t id)
+{
+
+	return &zc->headers[id % ZEROCOPY_SLOTS];
+}
+
+/*
+ * Enables MSG_ZEROCOPY on fd.  fresh: fd never sent with MSG_ZEROCOPY
+ * before, so its ids match ours.  0 -> ok.
+ */
+int
+zerocopy_enable(struct zerocopy *zc, int fd, bool fresh);
+
+/* Marks ids lo ... hi (inclusive, modulo 2^32) as completed. */
+void
+zerocopy_complete(struct zerocopy *zc, uint32_t lo, uint32_t hi);
+
+/*
+ * Consumes completion notifications from fd's error queue.  Only
+ * nonblocking: poll fd for POLLERR to wait for them.
+ */
+void
+zerocopy_drain(struct zerocopy *zc, int fd);
+#endif /* !JETEX_ZEROCOPY_H */
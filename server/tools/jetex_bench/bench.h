@@ -0,0 +1,155 @@
+#ifndef JETEX_BENCH_H
+#define JETEX_BENCH_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "src/table.h"
+#include "utility/cc.h"
+
+/*
+ * jetex_bench builds synthetic tables in memory (memfds), one per key
+ * and value size, and times lookups against them: every combination
+ * of the listed kernels, access patterns, hit ratios, thread counts
+ * and cache states gets one report line.
+ */
+
+/* Kernels: what one timed lookup calls. */
+enum bench_kernel {
+	BENCH_KERNEL_FRAGMENT = 0, /* fragment_lookup, by key[0] prefix. */
+	BENCH_KERNEL_TABLE, /* table_lookup. */
+	BENCH_KERNEL_BATCH, /* table_lookup_batch, BENCH_BATCH at a time. */
+	BENCH_KERNEL_COUNT
+};
+
+/* Which keys hits look up. */
+enum bench_access {
+	BENCH_ACCESS_UNIFORM = 0,
+	BENCH_ACCESS_ZIPF, /* hot keys are scattered over the table. */
+	BENCH_ACCESS_COUNT
+};
+
+enum bench_cache {
+	BENCH_CACHE_WARM = 0, /* after an untimed pass. */
+	BENCH_CACHE_COLD, /* after sweeping an eviction buffer. */
+	BENCH_CACHE_COUNT
+};
+
+/* Lookups per table_lookup_batch call. */
+#define BENCH_BATCH 64
+
+/* Up to this many values per list option. */
+#define BENCH_MAX_LIST 16
+
+struct bench_options {
+	uint64_t n_key;
+	uint64_t n_query; /* per thread and pass. */
+	uint64_t evict_bytes;
+	double zipf_theta; /* in (0, 1). */
+	uint32_t n_bits; /* key[0] prefix bits: 2^n_bits fragments. */
+	uint32_t filter_bits; /* per key; 0 -> no filter. */
+	uint32_t n_pass; /* timed passes per report line. */
+	bool split;
+	bool huge_pages;
+	uint8_t padding[2];
+};
+
+/* A synthetic table, and the keys in it. */
+struct bench_data {
+	struct jetex_table *table;
+	/* Mapped separately, for fragment_lookup; by key[0] prefix. */
+	struct fragment *fragments;
+	uint64_t *keys; /* n_key * key_size words, sorted. */
+	uint64_t n_key;
+	uint64_t n_byte; /* of all fragments. */
+	uint64_t max_displacement;
+	/* Zipfian sampling constants, for n_key and zipf_theta. */
+	double zeta_n;
+	double zipf_eta;
+	double zipf_alpha;
+	double zipf_half; /* 1 + 0.5^theta. */
+	uint32_t key_size; /* in uint64_t. */
+	uint32_t value_size; /* in uint64_t. */
+	uint32_t n_fragment;
+	uint32_t padding;
+};
+
+/* One report line's setup. */
+struct bench_config {
+	enum bench_kernel kernel;
+	enum bench_access access;
+	enum bench_cache cache;
+	uint32_t hit_percent;
+	uint32_t n_thread;
+	uint32_t padding;
+};
+
+/* perf_event_open counters, per lookup. */
+enum bench_counter {
+	BENCH_COUNTER_CYCLES = 0,
+	BENCH_COUNTER_LLC_MISSES,
+	BENCH_COUNTER_DTLB_MISSES,
+	BENCH_COUNTER_COUNT
+};
+
+struct bench_result {
+	uint64_t n_lookup;
+	uint64_t n_hit;
+	double thread_seconds; /* summed over threads. */
+	double wall_seconds; /* summed over passes: slowest thread. */
+	uint64_t counters[BENCH_COUNTER_COUNT];
+	bool has_counter[BENCH_COUNTER_COUNT];
+	uint8_t padding[5];
+};
+
+/* Per-thread counters; fds are -1 where perf_event_open failed. */
+struct bench_perf {
+	/* Count, time enabled and time running at the last read. */
+	uint64_t last[BENCH_COUNTER_COUNT][3];
+	int fds[BENCH_COUNTER_COUNT];
+	uint32_t padding;
+};
+
+/* A small, fast PRNG (splitmix64); not for anything but benchmarks. */
+static inline uint64_t
+bench_random(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+/* data.c: 0 -> ok. */
+int
+bench_data_create(const struct bench_options *options, uint32_t key_size,
+    uint32_t value_size, struct bench_data *OUT_data);
+
+void
+bench_data_destroy(struct bench_data *data);
+
+/* run.c: runs config's passes over data.  0 -> ok. */
+int
+bench_run(const struct bench_options *options, const struct bench_data *data,
+    const struct bench_config *config, struct bench_result *OUT_result);
+
+/* perf.c: opens what counters this kernel and its settings allow. */
+void
+bench_perf_open(struct bench_perf *OUT_perf);
+
+void
+bench_perf_close(struct bench_perf *perf);
+
+void
+bench_perf_enable(const struct bench_perf *perf);
+
+void
+bench_perf_disable(const struct bench_perf *perf);
+
+/* Adds each open counter's (scaled) count since the last read to counts. */
+void
+bench_perf_read(struct bench_perf *perf,
+    uint64_t counts[static BENCH_COUNTER_COUNT],
+    bool has_counter[static BENCH_COUNTER_COUNT]);
+#endif /* !JETEX_BENCH_H */
@@ -0,0 +1,394 @@
+#include <err.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "include/jetex_server.h"
+#include "bench.h"
+
+/* Fragments get this many slots per 100 keys, like a typical fit. */
+#define DATA_SLOT_PERCENT 125
+
+static inline JT_CC_CONST uint64_t
+scale(uint64_t delta, uint64_t multiplier)
+{
+	unsigned __int128 offset = multiplier;
+
+	offset *= delta;
+	return (uint64_t)(offset >> 64);
+}
+
+static int
+key0_compare(const void *a, const void *b)
+{
+	uint64_t x, y;
+
+	memcpy(&x, a, sizeof(x));
+	memcpy(&y, b, sizeof(y));
+	return (x > y) - (x < y);
+}
+
+/* Value word i of key; any function of the key would do. */
+static inline JT_CC_CONST uint64_t
+value_word(uint64_t key0, size_t i)
+{
+
+	return key0 ^ (i + 1);
+}
+
+static void
+slot_put(uint64_t *items, const struct bench_data *data, bool split,
+    uint64_t n_slot, uint64_t slot, const uint64_t *key)
+{
+	size_t key_size = data->key_size;
+	size_t value_size = data->value_size;
+	uint64_t *dst_key;
+	uint64_t *dst_value;
+
+	if (split) {
+		dst_key = items + slot * key_size;
+		dst_value = items + n_slot * key_size + slot * value_size;
+	} else {
+		dst_key = items + slot * (key_size + value_size);
+		dst_value = dst_key + key_size;
+	}
+
+	memcpy(dst_key, key, key_size * sizeof(uint64_t));
+	for (size_t i = 0; i < value_size; i++) {
+		dst_value[i] = value_word(key[0], i);
+	}
+
+	return;
+}
+
+/*
+ * Writes a version 0 fragment for the n sorted keys, which share
+ * pattern's n_bits prefix, to a new memfd.  Same placement as
+ * jetex_build: each key in the first free slot at or after its guess,
+ * and empty slots repeat the next key.  Returns the fd, or -1.
+ */
+static int
+fragment_create(const struct bench_options *options,
+    struct bench_data *data, const uint64_t *keys, uint64_t n,
+    uint64_t pattern)
+{
+	size_t key_size = data->key_size;
+	size_t item_size = key_size + data->value_size;
+	uint64_t min = keys[0];
+	uint64_t range = keys[(n - 1) * key_size] - min;
+	uint64_t n_target = n * DATA_SLOT_PERCENT / 100;
+	uint64_t multiplier = 0;
+	uint64_t max_displacement = 0;
+	uint64_t next_slot = 0;
+	uint64_t n_block = 0;
+	uint64_t filter_size = 0;
+	uint64_t n_slot;
+	uint64_t table_size;
+	struct fragment_header *header;
+	uint64_t *items;
+	uint64_t slot = 0;
+	void *map;
+	int fd;
+
+	if (range > 0 && n_target > 1) {
+		unsigned __int128 m = (unsigned __int128)(n_target - 1) << 64;
+
+		m /= range;
+		multiplier = (m > UINT64_MAX) ? UINT64_MAX : (uint64_t)m;
+	}
+
+	for (uint64_t i = 0; i < n; i++) {
+		uint64_t guess = scale(keys[i * key_size] - min, multiplier);
+		uint64_t at = (guess > next_slot) ? guess : next_slot;
+
+		if (at - guess > max_displacement) {
+			max_displacement = at - guess;
+		}
+
+		next_slot = at + 1;
+	}
+
+	if (max_displacement > UINT16_MAX) {
+		warnx("fragment %016" PRIx64 ": max displacement %" PRIu64
+		    " doesn't fit", pattern, max_displacement);
+		return -1;
+	}
+
+	if (options->filter_bits > 0) {
+		n_block = (n * options->filter_bits + 511) / 512;
+		n_block = (n_block == 0) ? 1 : n_block;
+		filter_size = sizeof(struct fragment_filter) + 64 * n_block;
+	}
+
+	n_slot = scale(range, multiplier) + max_displacement + 1;
+	table_size = sizeof(*header) + filter_size +
+	    n_slot * item_size * sizeof(uint64_t);
+
+	fd = memfd_create("jetex_bench", MFD_CLOEXEC);
+	if (fd < 0) {
+		warn("memfd_create");
+		return -1;
+	}
+
+	if (ftruncate(fd, (off_t)table_size) != 0) {
+		warn("growing a fragment to %" PRIu64 " bytes", table_size);
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, table_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	    fd, 0);
+	if (map == MAP_FAILED) {
+		warn("mapping a fragment of %" PRIu64 " bytes", table_size);
+		close(fd);
+		return -1;
+	}
+
+	header = map;
+	*header = (struct fragment_header) {
+		.magic = FRAGMENT_HEADER_MAGIC,
+		.version = 0,
+		.pattern = pattern,
+		.n_bits = (uint8_t)options->n_bits,
+		.key_size = (uint8_t)key_size,
+		.item_size = (uint16_t)item_size,
+		.max_displacement = (uint16_t)max_displacement,
+		.flags = (uint16_t)((options->split ? FRAGMENT_FLAG_SPLIT : 0) |
+		    (n_block > 0 ? FRAGMENT_FLAG_FILTER : 0)),
+		.table_size = table_size,
+		.min = min,
+		.max = keys[(n - 1) * key_size],
+		.multiplier = multiplier
+	};
+
+	items = (uint64_t *)(header + 1);
+	if (n_block > 0) {
+		struct fragment_filter *filter = (void *)items;
+		uint64_t *blocks = (uint64_t *)(filter + 1);
+
+		filter->n_blocks = n_block;
+		for (uint64_t i = 0; i < n; i++) {
+			uint64_t hash = fragment_filter_hash(&keys[i * key_size],
+			    key_size);
+			uint64_t *block = blocks +
+			    8 * fragment_filter_block(hash, n_block);
+
+			for (size_t j = 0; j < 8; j++) {
+				block[j] |= fragment_filter_bit(hash, j);
+			}
+		}
+
+		items = blocks + 8 * n_block;
+	}
+
+	for (uint64_t i = 0; i < n; i++) {
+		const uint64_t *key = &keys[i * key_size];
+		uint64_t guess = scale(key[0] - min, multiplier);
+
+		do {
+			slot_put(items, data, options->split, n_slot, slot, key);
+		} while (slot++ < guess);
+	}
+
+	for (; slot < n_slot; slot++) {
+		slot_put(items, data, options->split, n_slot, slot,
+		    &keys[(n - 1) * key_size]);
+	}
+
+	munmap(map, table_size);
+	if (jetex_table_fragment_validate(fd) != 0) {
+		warnx("fragment %016" PRIx64 " failed validation", pattern);
+		close(fd);
+		return -1;
+	}
+
+	data->n_byte += table_size;
+	if (max_displacement > data->max_displacement) {
+		data->max_displacement = max_displacement;
+	}
+
+	return fd;
+}
+
+/*
+ * Sorted keys with distinct, uniformly random key[0]s: a handful of
+ * random collisions are dropped, so n_key may come out a bit short.
+ */
+static int
+keys_create(const struct bench_options *options, struct bench_data *data)
+{
+	size_t key_size = data->key_size;
+	uint64_t state = 0x6A657465785F6BULL ^ key_size;
+	uint64_t n = options->n_key;
+	uint64_t n_unique = 0;
+	uint64_t *keys;
+
+	keys = calloc(n, key_size * sizeof(uint64_t));
+	if (keys == NULL) {
+		warn("allocating %" PRIu64 " keys", n);
+		return -1;
+	}
+
+	for (uint64_t i = 0; i < n; i++) {
+		keys[i * key_size] = bench_random(&state);
+	}
+
+	qsort(keys, n, key_size * sizeof(uint64_t), key0_compare);
+	for (uint64_t i = 0; i < n; i++) {
+		uint64_t key0 = keys[i * key_size];
+
+		if (n_unique > 0 && keys[(n_unique - 1) * key_size] == key0) {
+			continue;
+		}
+
+		keys[n_unique * key_size] = key0;
+		for (size_t j = 1; j < key_size; j++) {
+			keys[n_unique * key_size + j] = bench_random(&state);
+		}
+
+		n_unique++;
+	}
+
+	data->keys = keys;
+	data->n_key = n_unique;
+	return 0;
+}
+
+/* Constants for Gray et al.'s Zipfian generator, as in YCSB. */
+static void
+zipf_init(const struct bench_options *options, struct bench_data *data)
+{
+	double theta = options->zipf_theta;
+	double n = (double)data->n_key;
+	double zeta_2 = 1 + pow(0.5, theta);
+	double zeta_n = 0;
+
+	for (uint64_t i = data->n_key; i > 0; i--) {
+		zeta_n += pow((double)i, -theta);
+	}
+
+	data->zeta_n = zeta_n;
+	data->zipf_alpha = 1 / (1 - theta);
+	data->zipf_eta = (1 - pow(2 / n, 1 - theta)) / (1 - zeta_2 / zeta_n);
+	data->zipf_half = zeta_2;
+	return;
+}
+
+int
+bench_data_create(const struct bench_options *options, uint32_t key_size,
+    uint32_t value_size, struct bench_data *OUT_data)
+{
+	static const uint8_t uuid[16] = { 'j', 'e', 't', 'e', 'x', '_', 'b' };
+	struct jetex_table_options table_options = {
+		.flags = JETEX_TABLE_PREFAULT |
+		    (options->huge_pages ? JETEX_TABLE_HUGE_PAGES : 0)
+	};
+	uint32_t n_fragment = 1U << options->n_bits;
+	int *fds = NULL;
+	uint64_t *refcounts = NULL;
+	size_t n_fd = 0;
+	uint64_t begin = 0;
+	int ret = -1;
+
+	*OUT_data = (struct bench_data) {
+		.key_size = key_size,
+		.value_size = value_size,
+		.n_fragment = n_fragment
+	};
+
+	if (keys_create(options, OUT_data) != 0) {
+		return -1;
+	}
+
+	fds = calloc(n_fragment, sizeof(*fds));
+	refcounts = calloc(n_fragment, sizeof(*refcounts));
+	OUT_data->fragments = calloc(n_fragment,
+	    sizeof(*OUT_data->fragments));
+	if (fds == NULL || refcounts == NULL || OUT_data->fragments == NULL) {
+		warn("allocating %" PRIu32 " fragments", n_fragment);
+		goto out;
+	}
+
+	for (uint32_t prefix = 0; prefix < n_fragment; prefix++) {
+		uint64_t end = begin;
+		uint64_t pattern = (options->n_bits == 0)
+		    ? 0 : (uint64_t)prefix << (64 - options->n_bits);
+		int fd;
+
+		while (end < OUT_data->n_key &&
+		    (options->n_bits == 0 ||
+		    OUT_data->keys[end * key_size] >> (64 - options->n_bits) ==
+		    prefix)) {
+			end++;
+		}
+
+		if (end == begin) {
+			continue;
+		}
+
+		fd = fragment_create(options, OUT_data,
+		    &OUT_data->keys[begin * key_size], end - begin, pattern);
+		if (fd < 0) {
+			goto out;
+		}
+
+		fds[n_fd++] = fd;
+		OUT_data->fragments[prefix] = fragment_map(fd,
+		    options->huge_pages ? FRAGMENT_MAP_HUGE_PAGES : 0);
+		if (fragment_populate(&OUT_data->fragments[prefix], 0,
+		    OUT_data->fragments[prefix].data->table_size) != 0) {
+			warnx("faulting in fragment %016" PRIx64, pattern);
+			goto out;
+		}
+
+		begin = end;
+	}
+
+	OUT_data->table = jetex_table_create_options(uuid, fds, refcounts,
+	    n_fd, &table_options);
+	if (OUT_data->table == NULL) {
+		warnx("creating a table of %zu fragments", n_fd);
+		goto out;
+	}
+
+	zipf_init(options, OUT_data);
+	ret = 0;
+
+out:
+	for (size_t i = 0; i < n_fd; i++) {
+		close(fds[i]);
+	}
+
+	free(fds);
+	free(refcounts);
+	if (ret != 0) {
+		bench_data_destroy(OUT_data);
+	}
+
+	return ret;
+}
+
+void
+bench_data_destroy(struct bench_data *data)
+{
+
+	if (data->table != NULL) {
+		jetex_table_destroy(data->table);
+	}
+
+	if (data->fragments != NULL) {
+		for (uint32_t i = 0; i < data->n_fragment; i++) {
+			if (data->fragments[i].data != NULL) {
+				fragment_unmap(&data->fragments[i]);
+			}
+		}
+	}
+
+	free(data->fragments);
+	free(data->keys);
+	*data = (struct bench_data) { .table = NULL };
+	return;
+}
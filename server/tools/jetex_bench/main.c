@@ -0,0 +1,379 @@
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+static const char usage[] =
+    "usage: jetex_bench [-k key_words,...] [-v value_words,...]\n"
+    "           [-K kernel,...] [-a access,...] [-H hit_percent,...]\n"
+    "           [-j threads,...] [-c cache,...] [-n keys] [-b n_bits]\n"
+    "           [-f filter_bits] [-s] [-g] [-z theta] [-q queries]\n"
+    "           [-r passes] [-e evict_mib]\n"
+    "\n"
+    "Builds a table of random keys for each key and value size, then\n"
+    "times every combination of the other lists, one line each: ns per\n"
+    "lookup (per thread), total Mops/s, and, where perf_event_open is\n"
+    "allowed, cycles, LLC misses and dTLB misses per lookup.\n"
+    "\n"
+    "  -k  key words, 1, 2, 4 or 8 (1,2,4,8)\n"
+    "  -v  value words (1)\n"
+    "  -K  kernels: fragment (fragment_lookup), table (table_lookup),\n"
+    "      batch (table_lookup_batch) (fragment,table,batch)\n"
+    "  -a  hit keys: uniform, or zipf over scattered keys (uniform,zipf)\n"
+    "  -H  percent of lookups that hit (100)\n"
+    "  -j  threads, each pinned to its own CPU (1,online CPUs)\n"
+    "  -c  cache state: warm (after an untimed pass), cold (after\n"
+    "      reading evict_mib of other memory) (warm,cold)\n"
+    "  -n  keys per table (1048576)\n"
+    "  -b  key[0] prefix bits: 2^n_bits fragments per table (4)\n"
+    "  -f  Bloom filter bits per key; 0 -> none (0)\n"
+    "  -s  split key/value layout\n"
+    "  -g  ask for huge pages\n"
+    "  -z  zipf theta, in (0, 1) (0.99)\n"
+    "  -q  lookups per thread and pass (262144)\n"
+    "  -r  timed passes (5)\n"
+    "  -e  MiB to read before each cold pass (256)\n";
+
+static const char *const kernel_names[BENCH_KERNEL_COUNT] = {
+	[BENCH_KERNEL_FRAGMENT] = "fragment",
+	[BENCH_KERNEL_TABLE] = "table",
+	[BENCH_KERNEL_BATCH] = "batch"
+};
+
+static const char *const access_names[BENCH_ACCESS_COUNT] = {
+	[BENCH_ACCESS_UNIFORM] = "uniform",
+	[BENCH_ACCESS_ZIPF] = "zipf"
+};
+
+static const char *const cache_names[BENCH_CACHE_COUNT] = {
+	[BENCH_CACHE_WARM] = "warm",
+	[BENCH_CACHE_COLD] = "cold"
+};
+
+/* A comma-separated list of integers from min to max. */
+struct list {
+	uint64_t values[BENCH_MAX_LIST];
+	size_t n;
+};
+
+static uint64_t
+parse_u64(const char *arg, char option, uint64_t min, uint64_t max)
+{
+	unsigned long long value;
+	char *end;
+
+	errno = 0;
+	value = strtoull(arg, &end, 0);
+	if (errno != 0 || end == arg || *end != '\0' || arg[0] == '-' ||
+	    value < min || value > max) {
+		errx(1, "-%c: expected an integer from %" PRIu64 " to %" PRIu64
+		    ", not %s", option, min, max, arg);
+	}
+
+	return value;
+}
+
+static void
+parse_list(struct list *OUT_list, const char *arg, char option,
+    uint64_t min, uint64_t max)
+{
+	char *copy = strdup(arg);
+	char *save = NULL;
+
+	if (copy == NULL) {
+		err(1, "strdup");
+	}
+
+	OUT_list->n = 0;
+	for (char *item = strtok_r(copy, ",", &save); item != NULL;
+	     item = strtok_r(NULL, ",", &save)) {
+		if (OUT_list->n == BENCH_MAX_LIST) {
+			errx(1, "-%c: at most %d values", option, BENCH_MAX_LIST);
+		}
+
+		OUT_list->values[OUT_list->n++] = parse_u64(item, option,
+		    min, max);
+	}
+
+	if (OUT_list->n == 0) {
+		errx(1, "-%c: expected at least one value", option);
+	}
+
+	free(copy);
+	return;
+}
+
+/* A comma-separated list of names, as their index. */
+static void
+parse_names(struct list *OUT_list, const char *arg, char option,
+    const char *const *names, size_t n_name)
+{
+	char *copy = strdup(arg);
+	char *save = NULL;
+
+	if (copy == NULL) {
+		err(1, "strdup");
+	}
+
+	OUT_list->n = 0;
+	for (char *item = strtok_r(copy, ",", &save); item != NULL;
+	     item = strtok_r(NULL, ",", &save)) {
+		size_t i;
+
+		for (i = 0; i < n_name && strcmp(item, names[i]) != 0; i++) {
+			continue;
+		}
+
+		if (i == n_name) {
+			errx(1, "-%c: unknown value %s", option, item);
+		}
+
+		if (OUT_list->n == BENCH_MAX_LIST) {
+			errx(1, "-%c: at most %d values", option, BENCH_MAX_LIST);
+		}
+
+		OUT_list->values[OUT_list->n++] = i;
+	}
+
+	if (OUT_list->n == 0) {
+		errx(1, "-%c: expected at least one value", option);
+	}
+
+	free(copy);
+	return;
+}
+
+static void
+print_per_lookup(const struct bench_result *result, enum bench_counter i)
+{
+
+	if (!result->has_counter[i]) {
+		printf("\t%10s", "-");
+		return;
+	}
+
+	printf("\t%10.2f", (double)result->counters[i] /
+	    (double)result->n_lookup);
+	return;
+}
+
+static void
+print_result(const struct bench_data *data, const struct bench_config *config,
+    const struct bench_result *result)
+{
+
+	printf("%-8s\t%3" PRIu32 "\t%5" PRIu32 "\t%-7s\t%3" PRIu32 "\t%3"
+	    PRIu32 "\t%-5s\t%8.1f\t%8.2f",
+	    kernel_names[config->kernel], 8 * data->key_size,
+	    8 * data->value_size, access_names[config->access],
+	    config->hit_percent, config->n_thread, cache_names[config->cache],
+	    1e9 * result->thread_seconds / (double)result->n_lookup,
+	    1e-6 * (double)result->n_lookup / result->wall_seconds);
+	for (size_t i = 0; i < BENCH_COUNTER_COUNT; i++) {
+		print_per_lookup(result, (enum bench_counter)i);
+	}
+
+	printf("\n");
+	fflush(stdout);
+	return;
+}
+
+/* Runs every configuration on data.  0 -> ok. */
+static int
+bench_data(const struct bench_options *options, const struct bench_data *data,
+    const struct list *kernels, const struct list *accesses,
+    const struct list *hits, const struct list *threads,
+    const struct list *caches)
+{
+	size_t n_config = kernels->n * accesses->n * hits->n * threads->n *
+	    caches->n;
+	int ret = 0;
+
+	/* Caches vary fastest, kernels slowest. */
+	for (size_t i = 0; i < n_config; i++) {
+		size_t rest = i;
+		struct bench_config config;
+		struct bench_result result;
+
+		config.cache = (enum bench_cache)caches->values[rest % caches->n];
+		rest /= caches->n;
+		config.n_thread = (uint32_t)threads->values[rest % threads->n];
+		rest /= threads->n;
+		config.hit_percent = (uint32_t)hits->values[rest % hits->n];
+		rest /= hits->n;
+		config.access =
+		    (enum bench_access)accesses->values[rest % accesses->n];
+		rest /= accesses->n;
+		config.kernel = (enum bench_kernel)kernels->values[rest];
+		config.padding = 0;
+		if (bench_run(options, data, &config, &result) != 0) {
+			ret = -1;
+			continue;
+		}
+
+		print_result(data, &config, &result);
+	}
+
+	return ret;
+}
+
+int
+main(int argc, char **argv)
+{
+	long n_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+	struct bench_options options = {
+		.n_key = 1UL << 20,
+		.n_query = 1UL << 18,
+		.evict_bytes = 256UL << 20,
+		.zipf_theta = 0.99,
+		.n_bits = 4,
+		.n_pass = 5
+	};
+	struct list key_sizes = { .values = { 1, 2, 4, 8 }, .n = 4 };
+	struct list value_sizes = { .values = { 1 }, .n = 1 };
+	struct list kernels = {
+		.values = {
+			BENCH_KERNEL_FRAGMENT,
+			BENCH_KERNEL_TABLE,
+			BENCH_KERNEL_BATCH
+		},
+		.n = 3
+	};
+	struct list accesses = {
+		.values = { BENCH_ACCESS_UNIFORM, BENCH_ACCESS_ZIPF },
+		.n = 2
+	};
+	struct list hits = { .values = { 100 }, .n = 1 };
+	struct list threads = {
+		.values = { 1, (n_cpu > 1) ? (uint64_t)n_cpu : 1 },
+		.n = (n_cpu > 1) ? 2 : 1
+	};
+	struct list caches = {
+		.values = { BENCH_CACHE_WARM, BENCH_CACHE_COLD },
+		.n = 2
+	};
+	char *end;
+	int ret = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "k:v:K:a:H:j:c:n:b:f:sgz:q:r:e:h"))
+	    != -1) {
+		switch (opt) {
+		case 'k':
+			parse_list(&key_sizes, optarg, 'k', 1, 8);
+			for (size_t i = 0; i < key_sizes.n; i++) {
+				uint64_t k = key_sizes.values[i];
+
+				if ((k & (k - 1)) != 0) {
+					errx(1, "-k: key_words must be 1, 2, "
+					    "4 or 8");
+				}
+			}
+			break;
+		case 'v':
+			parse_list(&value_sizes, optarg, 'v', 0,
+			    UINT16_MAX - 8);
+			break;
+		case 'K':
+			parse_names(&kernels, optarg, 'K', kernel_names,
+			    BENCH_KERNEL_COUNT);
+			break;
+		case 'a':
+			parse_names(&accesses, optarg, 'a', access_names,
+			    BENCH_ACCESS_COUNT);
+			break;
+		case 'H':
+			parse_list(&hits, optarg, 'H', 0, 100);
+			break;
+		case 'j':
+			parse_list(&threads, optarg, 'j', 1, 1024);
+			break;
+		case 'c':
+			parse_names(&caches, optarg, 'c', cache_names,
+			    BENCH_CACHE_COUNT);
+			break;
+		case 'n':
+			options.n_key = parse_u64(optarg, 'n', 1, UINT32_MAX);
+			break;
+		case 'b':
+			options.n_bits = (uint32_t)parse_u64(optarg, 'b', 0, 16);
+			break;
+		case 'f':
+			options.filter_bits = (uint32_t)parse_u64(optarg, 'f',
+			    0, 64);
+			break;
+		case 's':
+			options.split = true;
+			break;
+		case 'g':
+			options.huge_pages = true;
+			break;
+		case 'z':
+			errno = 0;
+			options.zipf_theta = strtod(optarg, &end);
+			if (errno != 0 || end == optarg || *end != '\0' ||
+			    !(options.zipf_theta > 0 &&
+			    options.zipf_theta < 1)) {
+				errx(1, "-z: expected a number in (0, 1), "
+				    "not %s", optarg);
+			}
+			break;
+		case 'q':
+			options.n_query = parse_u64(optarg, 'q', 1,
+			    UINT64_MAX >> 7);
+			break;
+		case 'r':
+			options.n_pass = (uint32_t)parse_u64(optarg, 'r', 1,
+			    1000);
+			break;
+		case 'e':
+			options.evict_bytes = parse_u64(optarg, 'e', 1,
+			    UINT64_MAX >> 21) << 20;
+			break;
+		case 'h':
+			fputs(usage, stdout);
+			return 0;
+		default:
+			fputs(usage, stderr);
+			return 1;
+		}
+	}
+
+	if (argc != optind) {
+		fputs(usage, stderr);
+		return 1;
+	}
+
+	printf("%-8s\t%3s\t%5s\t%-7s\t%3s\t%3s\t%-5s\t%8s\t%8s\t%10s\t%10s"
+	    "\t%10s\n", "kernel", "key", "value", "access", "hit", "thr",
+	    "cache", "ns/op", "Mops/s", "cycles/op", "LLC/op", "dTLB/op");
+	for (size_t i = 0; i < key_sizes.n * value_sizes.n; i++) {
+		struct bench_data data;
+
+		if (bench_data_create(&options,
+		    (uint32_t)key_sizes.values[i / value_sizes.n],
+		    (uint32_t)value_sizes.values[i % value_sizes.n],
+		    &data) != 0) {
+			return 1;
+		}
+
+		printf("# %" PRIu64 " keys of %" PRIu32 " B, values of %"
+		    PRIu32 " B: %" PRIu32 " fragments, %.1f MiB, max "
+		    "displacement %" PRIu64 "\n", data.n_key,
+		    8 * data.key_size, 8 * data.value_size, data.n_fragment,
+		    (double)data.n_byte / (1 << 20), data.max_displacement);
+		if (bench_data(&options, &data, &kernels, &accesses, &hits,
+		    &threads, &caches) != 0) {
+			ret = 1;
+		}
+
+		bench_data_destroy(&data);
+	}
+
+	return ret;
+}
@@ -0,0 +1,146 @@
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define CACHE_MISS(cache)						\
+	((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) |			\
+	    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+	uint32_t type;
+	uint32_t padding;
+	uint64_t config;
+} events[BENCH_COUNTER_COUNT] = {
+	[BENCH_COUNTER_CYCLES] = {
+		.type = PERF_TYPE_HARDWARE,
+		.config = PERF_COUNT_HW_CPU_CYCLES
+	},
+	[BENCH_COUNTER_LLC_MISSES] = {
+		.type = PERF_TYPE_HW_CACHE,
+		.config = CACHE_MISS(PERF_COUNT_HW_CACHE_LL)
+	},
+	[BENCH_COUNTER_DTLB_MISSES] = {
+		.type = PERF_TYPE_HW_CACHE,
+		.config = CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB)
+	}
+};
+
+/*
+ * Counts the calling thread, in user space only: that's all
+ * perf_event_paranoid 2 allows, and lookups never enter the kernel.
+ * Counters are opened one by one, not as a group, so one that the CPU
+ * (or a VM) lacks doesn't take the others down.
+ */
+void
+bench_perf_open(struct bench_perf *OUT_perf)
+{
+
+	for (size_t i = 0; i < BENCH_COUNTER_COUNT; i++) {
+		struct perf_event_attr attr;
+		long fd;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = events[i].type;
+		attr.config = events[i].config;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+		    PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1,
+		    PERF_FLAG_FD_CLOEXEC);
+		OUT_perf->fds[i] = (fd < 0) ? -1 : (int)fd;
+		memset(OUT_perf->last[i], 0, sizeof(OUT_perf->last[i]));
+	}
+
+	return;
+}
+
+void
+bench_perf_close(struct bench_perf *perf)
+{
+
+	for (size_t i = 0; i < BENCH_COUNTER_COUNT; i++) {
+		if (perf->fds[i] >= 0) {
+			close(perf->fds[i]);
+			perf->fds[i] = -1;
+		}
+	}
+
+	return;
+}
+
+void
+bench_perf_enable(const struct bench_perf *perf)
+{
+
+	for (size_t i = 0; i < BENCH_COUNTER_COUNT; i++) {
+		if (perf->fds[i] >= 0) {
+			(void)ioctl(perf->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+
+	return;
+}
+
+void
+bench_perf_disable(const struct bench_perf *perf)
+{
+
+	for (size_t i = 0; i < BENCH_COUNTER_COUNT; i++) {
+		if (perf->fds[i] >= 0) {
+			(void)ioctl(perf->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+		}
+	}
+
+	return;
+}
+
+/*
+ * Multiplexed counters only ran part of the time since the last read:
+ * scale them up to the whole.
+ */
+void
+bench_perf_read(struct bench_perf *perf,
+    uint64_t counts[static BENCH_COUNTER_COUNT],
+    bool has_counter[static BENCH_COUNTER_COUNT])
+{
+
+	for (size_t i = 0; i < BENCH_COUNTER_COUNT; i++) {
+		uint64_t values[3]; /* count, time enabled, time running. */
+		uint64_t delta[3];
+		double count;
+
+		if (perf->fds[i] < 0 ||
+		    read(perf->fds[i], values, sizeof(values)) !=
+		    (ssize_t)sizeof(values)) {
+			has_counter[i] = false;
+			continue;
+		}
+
+		for (size_t j = 0; j < 3; j++) {
+			delta[j] = values[j] - perf->last[i][j];
+			perf->last[i][j] = values[j];
+		}
+
+		if (delta[2] == 0) {
+			has_counter[i] = false;
+			continue;
+		}
+
+		count = (double)delta[0];
+		if (delta[2] < delta[1]) {
+			count *= (double)delta[1] / (double)delta[2];
+		}
+
+		counts[i] += (uint64_t)count;
+	}
+
+	return;
+}
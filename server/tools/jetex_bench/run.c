@@ -0,0 +1,413 @@
+#include <err.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+
+/* Spreads Zipfian ranks over the table, so hot keys aren't neighbours. */
+#define SCATTER_PRIME 2305843009213693951ULL /* 2^61 - 1. */
+
+struct bench_thread {
+	const struct bench_options *options;
+	const struct bench_data *data;
+	const struct bench_config *config;
+	pthread_barrier_t *barrier;
+	const uint8_t *evict; /* evict_bytes, or NULL when warm. */
+	uint64_t (*queries)[8];
+	double *seconds; /* [n_pass]. */
+	uint64_t n_expected; /* hits per pass, as generated. */
+	uint64_t n_hit;
+	uint64_t checksum;
+	uint64_t counters[BENCH_COUNTER_COUNT];
+	bool has_counter[BENCH_COUNTER_COUNT];
+	uint8_t padding[1];
+	uint32_t index;
+	pthread_t thread;
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+static uint64_t
+zipf_rank(const struct bench_data *data, uint64_t *state)
+{
+	double u = (double)(bench_random(state) >> 11) * 0x1p-53;
+	double uz = u * data->zeta_n;
+	uint64_t rank;
+
+	if (uz < 1) {
+		return 0;
+	}
+
+	if (uz < data->zipf_half) {
+		return 1;
+	}
+
+	rank = (uint64_t)((double)data->n_key *
+	    pow(data->zipf_eta * u - data->zipf_eta + 1, data->zipf_alpha));
+	return (rank < data->n_key) ? rank : data->n_key - 1;
+}
+
+/*
+ * Fills the thread's queries: hit_percent% existing keys, picked by
+ * the access pattern, and random (absent) keys for the rest.
+ */
+static void
+queries_fill(struct bench_thread *thread)
+{
+	const struct bench_data *data = thread->data;
+	const struct bench_config *config = thread->config;
+	size_t key_size = data->key_size;
+	uint64_t state = 0x62656E6368ULL + thread->index;
+
+	thread->n_expected = 0;
+	for (uint64_t i = 0; i < thread->options->n_query; i++) {
+		uint64_t *query = thread->queries[i];
+
+		memset(query, 0, sizeof(thread->queries[i]));
+		if (bench_random(&state) % 100 < config->hit_percent) {
+			unsigned __int128 scattered;
+			uint64_t rank;
+
+			if (config->access == BENCH_ACCESS_ZIPF) {
+				rank = zipf_rank(data, &state);
+			} else {
+				rank = bench_random(&state) % data->n_key;
+			}
+
+			scattered = (unsigned __int128)rank * SCATTER_PRIME;
+			memcpy(query, &data->keys[
+			    (uint64_t)(scattered % data->n_key) * key_size],
+			    key_size * sizeof(uint64_t));
+			thread->n_expected++;
+		} else {
+			for (size_t j = 0; j < key_size; j++) {
+				query[j] = bench_random(&state);
+			}
+		}
+	}
+
+	return;
+}
+
+/* Reads the start of each value, as a server copying it out would. */
+static inline uint64_t
+value_read(const void *value, size_t value_len)
+{
+	uint64_t word = 0;
+
+	memcpy(&word, value, (value_len < sizeof(word)) ? value_len :
+	    sizeof(word));
+	return word + value_len;
+}
+
+static uint64_t
+lookup_fragment(const struct bench_data *data, uint32_t n_bits,
+    const uint64_t (*queries)[8], uint64_t n, uint64_t *checksum)
+{
+	uint64_t n_hit = 0;
+
+	for (uint64_t i = 0; i < n; i++) {
+		const struct fragment *fragment = &data->fragments[
+		    (n_bits == 0) ? 0 : queries[i][0] >> (64 - n_bits)];
+		const void *value;
+		size_t value_len;
+
+		value = fragment_lookup(fragment, &value_len, queries[i]);
+		if (value != NULL) {
+			*checksum += value_read(value, value_len);
+			n_hit++;
+		}
+	}
+
+	return n_hit;
+}
+
+static uint64_t
+lookup_table(const struct bench_data *data, const uint64_t (*queries)[8],
+    uint64_t n, uint64_t *checksum)
+{
+	uint64_t n_hit = 0;
+
+	for (uint64_t i = 0; i < n; i++) {
+		const struct fragment *fragment;
+		const void *value;
+		size_t value_len;
+
+		value = table_lookup(data->table, 0, &value_len, &fragment,
+		    queries[i]);
+		if (value != NULL) {
+			*checksum += value_read(value, value_len);
+			n_hit++;
+		}
+	}
+
+	return n_hit;
+}
+
+static uint64_t
+lookup_batch(const struct bench_data *data, const uint64_t (*queries)[8],
+    uint64_t n, uint64_t *checksum)
+{
+	const struct jetex_table *tables[BENCH_BATCH];
+	const struct fragment *fragments[BENCH_BATCH];
+	const void *values[BENCH_BATCH];
+	size_t value_lens[BENCH_BATCH];
+	uint64_t n_hit = 0;
+
+	for (size_t i = 0; i < BENCH_BATCH; i++) {
+		tables[i] = data->table;
+	}
+
+	for (uint64_t i = 0; i < n; i += BENCH_BATCH) {
+		size_t m = (n - i < BENCH_BATCH) ? (size_t)(n - i) : BENCH_BATCH;
+
+		n_hit += table_lookup_batch(m, 0, tables, &queries[i], values,
+		    value_lens, fragments);
+		for (size_t j = 0; j < m; j++) {
+			if (values[j] != NULL) {
+				*checksum += value_read(values[j],
+				    value_lens[j]);
+			}
+		}
+	}
+
+	return n_hit;
+}
+
+static uint64_t
+lookup(const struct bench_thread *thread, uint64_t *checksum)
+{
+	const struct bench_data *data = thread->data;
+	const uint64_t (*queries)[8] = (const void *)thread->queries;
+	uint64_t n = thread->options->n_query;
+
+	switch (thread->config->kernel) {
+	case BENCH_KERNEL_FRAGMENT:
+		return lookup_fragment(data, thread->options->n_bits, queries,
+		    n, checksum);
+	case BENCH_KERNEL_TABLE:
+		return lookup_table(data, queries, n, checksum);
+	case BENCH_KERNEL_BATCH:
+		return lookup_batch(data, queries, n, checksum);
+	case BENCH_KERNEL_COUNT:
+	default:
+		abort();
+	}
+}
+
+/* Reads every cache line of the eviction buffer, and its pages. */
+static uint64_t
+evict(const uint8_t *buf, uint64_t len)
+{
+	uint64_t sum = 0;
+
+	for (uint64_t i = 0; i < len; i += 64) {
+		sum += ((const volatile uint8_t *)buf)[i];
+	}
+
+	return sum;
+}
+
+/* Pins thread to the index-th CPU it may run on (modulo their count). */
+static void
+pin(uint32_t index)
+{
+	cpu_set_t allowed;
+	cpu_set_t cpu;
+	uint32_t n_cpu;
+	uint32_t seen = 0;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+		return;
+	}
+
+	n_cpu = (uint32_t)CPU_COUNT(&allowed);
+	if (n_cpu == 0) {
+		return;
+	}
+
+	for (size_t i = 0; i < CPU_SETSIZE; i++) {
+		if (!CPU_ISSET(i, &allowed)) {
+			continue;
+		}
+
+		if (seen++ == index % n_cpu) {
+			CPU_ZERO(&cpu);
+			CPU_SET(i, &cpu);
+			(void)sched_setaffinity(0, sizeof(cpu), &cpu);
+			return;
+		}
+	}
+
+	return;
+}
+
+static void *
+thread_main(void *arg)
+{
+	struct bench_thread *thread = arg;
+	const struct bench_options *options = thread->options;
+	struct bench_perf perf;
+	uint64_t checksum = 0;
+
+	pin(thread->index);
+	queries_fill(thread);
+	bench_perf_open(&perf);
+	if (thread->evict == NULL) {
+		(void)lookup(thread, &checksum);
+	}
+
+	for (uint32_t pass = 0; pass < options->n_pass; pass++) {
+		double begin;
+
+		if (thread->evict != NULL) {
+			checksum += evict(thread->evict, options->evict_bytes);
+		}
+
+		pthread_barrier_wait(thread->barrier);
+		bench_perf_enable(&perf);
+		begin = now();
+		thread->n_hit += lookup(thread, &checksum);
+		thread->seconds[pass] = now() - begin;
+		bench_perf_disable(&perf);
+		bench_perf_read(&perf, thread->counters, thread->has_counter);
+	}
+
+	bench_perf_close(&perf);
+	thread->checksum = checksum;
+	return NULL;
+}
+
+/*
+ * Every thread looks up its own queries, n_pass times; passes start
+ * together, so each pass's wall time is its slowest thread's.  Fails
+ * if any pass hit a different number of keys than it looked up.
+ */
+int
+bench_run(const struct bench_options *options, const struct bench_data *data,
+    const struct bench_config *config, struct bench_result *OUT_result)
+{
+	uint32_t n_thread = config->n_thread;
+	struct bench_thread *threads;
+	pthread_barrier_t barrier;
+	uint8_t *evict_buf = NULL;
+	uint32_t n_started = 0;
+	int ret = -1;
+
+	*OUT_result = (struct bench_result) { .n_lookup = 0 };
+	for (size_t i = 0; i < BENCH_COUNTER_COUNT; i++) {
+		OUT_result->has_counter[i] = true;
+	}
+
+	threads = calloc(n_thread, sizeof(*threads));
+	if (threads == NULL) {
+		warn("allocating %" PRIu32 " threads", n_thread);
+		return -1;
+	}
+
+	if (config->cache == BENCH_CACHE_COLD) {
+		evict_buf = malloc(options->evict_bytes);
+		if (evict_buf == NULL) {
+			warn("allocating %" PRIu64 " bytes to evict caches",
+			    options->evict_bytes);
+			free(threads);
+			return -1;
+		}
+
+		memset(evict_buf, 1, options->evict_bytes);
+	}
+
+	pthread_barrier_init(&barrier, NULL, n_thread);
+	for (uint32_t i = 0; i < n_thread; i++) {
+		struct bench_thread *thread = &threads[i];
+
+		*thread = (struct bench_thread) {
+			.options = options,
+			.data = data,
+			.config = config,
+			.barrier = &barrier,
+			.evict = evict_buf,
+			.queries = calloc(options->n_query,
+			    sizeof(thread->queries[0])),
+			.seconds = calloc(options->n_pass,
+			    sizeof(thread->seconds[0])),
+			.index = i
+		};
+
+		for (size_t j = 0; j < BENCH_COUNTER_COUNT; j++) {
+			thread->has_counter[j] = true;
+		}
+
+		if (thread->queries == NULL || thread->seconds == NULL) {
+			warn("allocating %" PRIu64 " queries", options->n_query);
+			goto out;
+		}
+	}
+
+	/* The barrier needs all threads: start them all, or none. */
+	for (; n_started < n_thread; n_started++) {
+		if (pthread_create(&threads[n_started].thread, NULL,
+		    thread_main, &threads[n_started]) != 0) {
+			errx(1, "creating thread %" PRIu32, n_started);
+		}
+	}
+
+	for (uint32_t i = 0; i < n_thread; i++) {
+		pthread_join(threads[i].thread, NULL);
+	}
+
+	ret = 0;
+	for (uint32_t pass = 0; pass < options->n_pass; pass++) {
+		double slowest = 0;
+
+		for (uint32_t i = 0; i < n_thread; i++) {
+			double seconds = threads[i].seconds[pass];
+
+			OUT_result->thread_seconds += seconds;
+			slowest = (seconds > slowest) ? seconds : slowest;
+		}
+
+		OUT_result->wall_seconds += slowest;
+	}
+
+	for (uint32_t i = 0; i < n_thread; i++) {
+		const struct bench_thread *thread = &threads[i];
+
+		OUT_result->n_lookup += options->n_pass * options->n_query;
+		OUT_result->n_hit += thread->n_hit;
+		if (thread->n_hit != options->n_pass * thread->n_expected) {
+			warnx("thread %" PRIu32 " hit %" PRIu64 " keys, not %"
+			    PRIu64, i, thread->n_hit,
+			    options->n_pass * thread->n_expected);
+			ret = -1;
+		}
+
+		for (size_t j = 0; j < BENCH_COUNTER_COUNT; j++) {
+			OUT_result->counters[j] += thread->counters[j];
+			OUT_result->has_counter[j] &= thread->has_counter[j];
+		}
+	}
+
+out:
+	for (uint32_t i = 0; i < n_thread; i++) {
+		free(threads[i].queries);
+		free(threads[i].seconds);
+	}
+
+	pthread_barrier_destroy(&barrier);
+	free(evict_buf);
+	free(threads);
+	return ret;
+}
@@ -0,0 +1,203 @@
+#ifndef JETEX_BUILD_H
+#define JETEX_BUILD_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "utility/cc.h"
+
+/*
+ * jetex_build reads fixed-size records, key_size key words followed
+ * by value_size value words (all LE uint64_t), sorts them on the whole
+ * key, and writes one version 0 fragment per non-empty n_bits prefix
+ * of key[0].  With a target_bytes, the prefixes come from a plan
+ * instead (see build_plan), and have mixed lengths.
+ */
+struct build_options {
+	const char *input; /* NULL -> stdin. */
+	const char *output_dir;
+	const char *tmp_dir;
+	size_t memory; /* bytes of sort buffers, and of merge buffers. */
+	uint32_t n_thread;
+	uint32_t key_size; /* in uint64_t. */
+	uint32_t value_size; /* in uint64_t. */
+	uint32_t n_bits;
+	/* Fits aim for the smallest table within this displacement. */
+	uint32_t max_displacement;
+	uint32_t filter_bits; /* per key; 0 -> no filter. */
+	/* Planned prefixes: fragment size target, 0 -> n_bits for all. */
+	uint64_t target_bytes;
+	uint32_t max_bits; /* longest planned prefix. */
+	bool split;
+	uint8_t padding[3];
+};
+
+/* Longest planned prefix: plans count records on that many bits. */
+#define BUILD_PLAN_MAX_BITS 24
+
+/* A sorted run, in an unlinked temporary file. */
+struct build_run {
+	int fd;
+	uint32_t padding;
+	uint64_t n_record;
+};
+
+struct build_runs {
+	struct build_run *runs;
+	size_t n_run;
+	/* Sorted key[0] samples, to split the merge in even units. */
+	uint64_t *samples;
+	size_t n_sample;
+	uint64_t n_record;
+	/*
+	 * With a target_bytes, the number of records before each
+	 * max_bits prefix: 2^max_bits + 1 entries.
+	 */
+	uint64_t *histogram;
+};
+
+/* A prefix of key[0] that gets its own fragment. */
+struct build_leaf {
+	uint64_t pattern;
+	uint64_t n_record; /* estimate, including duplicates. */
+	uint32_t n_bits;
+	uint32_t padding;
+};
+
+/* Disjoint leaves, in key order. */
+struct build_plan {
+	struct build_leaf *leaves;
+	size_t n_leaf;
+};
+
+/*
+ * Records that share a prefix, in key order, without duplicates.  They
+ * also share their top depth >= n_bits bits: splits that leave a half
+ * empty go deeper without narrowing the fragment's prefix.
+ */
+struct build_partition {
+	const uint64_t *records;
+	uint64_t n_record;
+	uint64_t pattern;
+	uint32_t n_bits;
+	uint32_t depth;
+};
+
+/* Totals for the whole build. */
+struct build_stats {
+	uint64_t n_fragment;
+	uint64_t n_record;
+	uint64_t n_duplicate;
+	uint64_t n_byte;
+	uint64_t max_displacement;
+};
+
+static inline size_t
+build_record_size(const struct build_options *options)
+{
+
+	return (size_t)options->key_size + options->value_size;
+}
+
+static inline JT_CC_PURE int
+build_key_compare(const uint64_t *a, const uint64_t *b, size_t key_size)
+{
+
+	for (size_t i = 0; i < key_size; i++) {
+		if (a[i] != b[i]) {
+			return (a[i] < b[i]) ? -1 : 1;
+		}
+	}
+
+	return 0;
+}
+
+/* key[0]'s top n_bits, as an integer. */
+static inline JT_CC_CONST uint64_t
+build_prefix(uint64_t key0, uint32_t n_bits)
+{
+
+	return (n_bits == 0) ? 0 : key0 >> (64 - n_bits);
+}
+
+/* Smallest key[0] with that prefix. */
+static inline JT_CC_CONST uint64_t
+build_prefix_min(uint64_t prefix, uint32_t n_bits)
+{
+
+	return (n_bits == 0) ? 0 : prefix << (64 - n_bits);
+}
+
+/* Largest key[0] that matches pattern's top n_bits. */
+static inline JT_CC_CONST uint64_t
+build_pattern_max(uint64_t pattern, uint32_t n_bits)
+{
+
+	return (n_bits == 0) ? UINT64_MAX : pattern | (UINT64_MAX >> n_bits);
+}
+
+/* io.c: 0 -> ok; read_full returns the byte count, -1 on error. */
+ssize_t
+build_read_full(int fd, void *buf, size_t len);
+
+int
+build_write_full(int fd, const void *buf, size_t len);
+
+int
+build_pread_full(int fd, void *buf, size_t len, uint64_t offset);
+
+int
+build_pwrite_full(int fd, const void *buf, size_t len, uint64_t offset);
+
+/* An unlinked, read-write temporary file in dir, or -1. */
+int
+build_temp_file(const char *dir);
+
+/*
+ * sort.c: reads all records into sorted runs of up to memory / 2
+ * bytes, sorting each run's slices in parallel.  Sorts are stable and
+ * runs follow input order, so records with equal keys stay in input
+ * order.  0 -> ok.
+ */
+int
+build_sort(const struct build_options *options, struct build_runs *OUT_runs);
+
+void
+build_runs_destroy(struct build_runs *runs);
+
+/*
+ * plan.c: splits prefixes, from the whole key space down, until each
+ * one's estimated fragment fits in target_bytes or is max_bits long.
+ * 0 -> ok.
+ */
+int
+build_plan(const struct build_options *options,
+    const struct build_runs *runs, struct build_plan *OUT_plan);
+
+void
+build_plan_destroy(struct build_plan *plan);
+
+/*
+ * merge.c: merges runs, n_thread units of prefixes at a time, and
+ * writes each partition's fragment.  Partitions are plan's leaves, or
+ * n_bits prefixes without a plan.  Of records with equal keys, only
+ * the earliest in the input is kept, whatever -j and -m.  0 -> ok.
+ */
+int
+build_merge(const struct build_options *options,
+    const struct build_runs *runs, const struct build_plan *plan,
+    struct build_stats *OUT_stats);
+
+/*
+ * write.c: fits a linear model to partition, writes its fragment in
+ * output_dir, checks it with jetex_table_fragment_validate, and prints
+ * its manifest line.  With a target_bytes, partitions whose fragment
+ * would miss that size or max_displacement are split in two instead,
+ * down to max_bits.  Partitions that still miss max_displacement get a
+ * piecewise (version 1) model.  Adds what it wrote to stats.  0 -> ok.
+ */
+int
+build_fragment_write(const struct build_options *options,
+    const struct build_partition *partition, struct build_stats *stats);
+#endif /* !JETEX_BUILD_H */
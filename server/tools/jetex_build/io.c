@@ -0,0 +1,130 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "build.h"
+
+ssize_t
+build_read_full(int fd, void *buf, size_t len)
+{
+	char *dst = buf;
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t r;
+
+		r = read(fd, dst + done, len - done);
+		if (r == -1 && errno == EINTR) {
+			continue;
+		}
+
+		if (r < 0) {
+			return -1;
+		}
+
+		if (r == 0) {
+			break;
+		}
+
+		done += (size_t)r;
+	}
+
+	return (ssize_t)done;
+}
+
+int
+build_write_full(int fd, const void *buf, size_t len)
+{
+	const char *src = buf;
+
+	while (len > 0) {
+		ssize_t r;
+
+		r = write(fd, src, len);
+		if (r == -1 && errno == EINTR) {
+			continue;
+		}
+
+		if (r <= 0) {
+			return -1;
+		}
+
+		src += r;
+		len -= (size_t)r;
+	}
+
+	return 0;
+}
+
+int
+build_pread_full(int fd, void *buf, size_t len, uint64_t offset)
+{
+	char *dst = buf;
+
+	while (len > 0) {
+		ssize_t r;
+
+		r = pread(fd, dst, len, (off_t)offset);
+		if (r == -1 && errno == EINTR) {
+			continue;
+		}
+
+		if (r <= 0) {
+			return -1;
+		}
+
+		dst += r;
+		len -= (size_t)r;
+		offset += (uint64_t)r;
+	}
+
+	return 0;
+}
+
+int
+build_pwrite_full(int fd, const void *buf, size_t len, uint64_t offset)
+{
+	const char *src = buf;
+
+	while (len > 0) {
+		ssize_t r;
+
+		r = pwrite(fd, src, len, (off_t)offset);
+		if (r == -1 && errno == EINTR) {
+			continue;
+		}
+
+		if (r <= 0) {
+			return -1;
+		}
+
+		src += r;
+		len -= (size_t)r;
+		offset += (uint64_t)r;
+	}
+
+	return 0;
+}
+
+int
+build_temp_file(const char *dir)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	if (snprintf(path, sizeof(path), "%s/jetex_build.XXXXXX", dir) >=
+	    (int)sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		return -1;
+	}
+
+	(void)unlink(path);
+	return fd;
+}
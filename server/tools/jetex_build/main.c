@@ -0,0 +1,211 @@
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "build.h"
+
+static const char usage[] =
+    "usage: jetex_build [-k key_words] [-v value_words]\n"
+    "           [-n n_bits | -p target_mib [-N max_bits]]\n"
+    "           [-d max_displacement] [-f filter_bits] [-s]\n"
+    "           [-j threads] [-m memory_mib] [-t tmp_dir] input output_dir\n"
+    "\n"
+    "Reads records of key_words (1, 2, 4 or 8) then value_words LE\n"
+    "uint64_t from input (- for stdin), and writes one fragment per\n"
+    "n_bits prefix of key[0] to output_dir.  With -p, plans prefixes of\n"
+    "mixed lengths instead: dense ones are split until their fragments\n"
+    "fit in target_mib and max_displacement, sparse ones stay whole.\n"
+    "Either way, the fragments are disjoint and load into one table.\n"
+    "Of records with the same key, the first in input wins.\n"
+    "Prints one line per fragment: path, records, slots, max\n"
+    "displacement, bytes.\n"
+    "\n"
+    "  -k  key words (1)\n"
+    "  -v  value words (1)\n"
+    "  -n  prefix bits, 0 ... 31 (0)\n"
+    "  -p  plan prefixes for fragments of up to target_mib MiB\n"
+    "  -N  longest planned prefix, 1 ... 24 (20)\n"
+    "  -d  target max displacement (16)\n"
+    "  -f  Bloom filter bits per key; 0 -> none (0)\n"
+    "  -s  split key/value layout\n"
+    "  -j  threads (online CPUs)\n"
+    "  -m  MiB of sort buffers, and again of merge buffers (1024)\n"
+    "  -t  directory for temporary files (output_dir)\n";
+
+static uint64_t
+parse_u64(const char *arg, char option, uint64_t max)
+{
+	unsigned long long value;
+	char *end;
+
+	errno = 0;
+	value = strtoull(arg, &end, 0);
+	if (errno != 0 || end == arg || *end != '\0' || arg[0] == '-' ||
+	    value > max) {
+		errx(1, "-%c: expected an integer up to %" PRIu64 ", not %s",
+		    option, max, arg);
+	}
+
+	return value;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+int
+main(int argc, char **argv)
+{
+	long n_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+	struct build_options options = {
+		.memory = 1024UL << 20,
+		.n_thread = (n_cpu > 0) ? (uint32_t)n_cpu : 1,
+		.key_size = 1,
+		.value_size = 1,
+		.max_displacement = 16,
+		.max_bits = 20
+	};
+	struct build_plan plan = { .n_leaf = 0 };
+	struct build_runs runs;
+	struct build_stats stats;
+	double begin, sorted;
+	bool has_n_bits = false;
+	int opt;
+	int ret;
+
+	while ((opt = getopt(argc, argv, "k:v:n:p:N:d:f:sj:m:t:h")) != -1) {
+		switch (opt) {
+		case 'k':
+			options.key_size = (uint32_t)parse_u64(optarg, 'k', 8);
+			break;
+		case 'v':
+			options.value_size = (uint32_t)parse_u64(optarg, 'v',
+			    UINT16_MAX - 8);
+			break;
+		case 'n':
+			options.n_bits = (uint32_t)parse_u64(optarg, 'n', 31);
+			has_n_bits = true;
+			break;
+		case 'p':
+			options.target_bytes = parse_u64(optarg, 'p',
+			    UINT64_MAX >> 20) << 20;
+			break;
+		case 'N':
+			options.max_bits = (uint32_t)parse_u64(optarg, 'N',
+			    BUILD_PLAN_MAX_BITS);
+			break;
+		case 'd':
+			options.max_displacement = (uint32_t)parse_u64(optarg,
+			    'd', UINT16_MAX);
+			break;
+		case 'f':
+			options.filter_bits = (uint32_t)parse_u64(optarg, 'f', 64);
+			break;
+		case 's':
+			options.split = true;
+			break;
+		case 'j':
+			options.n_thread = (uint32_t)parse_u64(optarg, 'j', 1024);
+			break;
+		case 'm':
+			options.memory = (size_t)parse_u64(optarg, 'm',
+			    SIZE_MAX >> 21) << 20;
+			break;
+		case 't':
+			options.tmp_dir = optarg;
+			break;
+		case 'h':
+			fputs(usage, stdout);
+			return 0;
+		default:
+			fputs(usage, stderr);
+			return 1;
+		}
+	}
+
+	if (argc - optind != 2) {
+		fputs(usage, stderr);
+		return 1;
+	}
+
+	if (options.key_size != 1 && options.key_size != 2 &&
+	    options.key_size != 4 && options.key_size != 8) {
+		errx(1, "-k: key_words must be 1, 2, 4 or 8");
+	}
+
+	if (options.n_thread == 0 || options.memory == 0) {
+		errx(1, "-j and -m must be positive");
+	}
+
+	if (options.target_bytes != 0 && has_n_bits) {
+		errx(1, "-n and -p are exclusive");
+	}
+
+	if (options.max_bits == 0) {
+		errx(1, "-N must be positive");
+	}
+
+	if (strcmp(argv[optind], "-") != 0) {
+		options.input = argv[optind];
+	}
+
+	options.output_dir = argv[optind + 1];
+	if (options.tmp_dir == NULL) {
+		options.tmp_dir = options.output_dir;
+	}
+
+	begin = now();
+	if (build_sort(&options, &runs) != 0) {
+		return 1;
+	}
+
+	sorted = now();
+	fprintf(stderr, "jetex_build: sorted %" PRIu64 " records in %zu runs "
+	    "in %.3f s\n", runs.n_record, runs.n_run, sorted - begin);
+
+	if (options.target_bytes != 0) {
+		uint32_t min_bits = UINT32_MAX;
+		uint32_t max_bits = 0;
+
+		if (build_plan(&options, &runs, &plan) != 0) {
+			build_runs_destroy(&runs);
+			return 1;
+		}
+
+		for (size_t i = 0; i < plan.n_leaf; i++) {
+			uint32_t n_bits = plan.leaves[i].n_bits;
+
+			min_bits = (n_bits < min_bits) ? n_bits : min_bits;
+			max_bits = (n_bits > max_bits) ? n_bits : max_bits;
+		}
+
+		fprintf(stderr, "jetex_build: planned %zu fragments, "
+		    "prefixes of %" PRIu32 " ... %" PRIu32 " bits\n",
+		    plan.n_leaf, min_bits, max_bits);
+	}
+
+	ret = build_merge(&options, &runs,
+	    (options.target_bytes != 0) ? &plan : NULL, &stats);
+	build_plan_destroy(&plan);
+	build_runs_destroy(&runs);
+	if (ret != 0) {
+		return 1;
+	}
+
+	fprintf(stderr, "jetex_build: wrote %" PRIu64 " fragments, %" PRIu64
+	    " records (%" PRIu64 " duplicate keys dropped), %" PRIu64
+	    " bytes, max displacement %" PRIu64 " in %.3f s\n",
+	    stats.n_fragment, stats.n_record, stats.n_duplicate,
+	    stats.n_byte, stats.max_displacement, now() - sorted);
+	return 0;
+}
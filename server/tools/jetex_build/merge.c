@@ -0,0 +1,572 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "build.h"
+
+/* Merge units per thread, so fast units don't leave threads idle. */
+#define MERGE_UNITS_PER_THREAD 4
+/* Smallest read buffer per run, in bytes. */
+#define MERGE_READ_MIN (64UL << 10)
+
+/* A unit's records in one run: [next, end), buffered. */
+struct merge_reader {
+	const uint64_t *head; /* current record, in buf. */
+	uint64_t *buf;
+	size_t cap; /* in records. */
+	size_t len;
+	size_t pos;
+	uint64_t next; /* next record to read from the run. */
+	uint64_t end;
+	int fd;
+	uint32_t padding;
+};
+
+/* Records of the current partition, spilled to a file once buf fills. */
+struct merge_spill {
+	uint64_t *buf;
+	size_t cap; /* in records. */
+	size_t len;
+	uint64_t n_spilled;
+	int fd; /* -1 until the first spill. */
+	uint32_t padding;
+};
+
+struct merge_state {
+	const struct build_options *options;
+	const struct build_runs *runs;
+	const struct build_plan *plan; /* NULL -> n_bits prefixes. */
+	const uint64_t *bounds; /* each unit's first key[0]. */
+	size_t n_unit;
+	size_t next_unit;
+	size_t read_cap; /* per run, in records. */
+	size_t spill_cap; /* per thread, in records. */
+	pthread_mutex_t lock; /* for stats. */
+	struct build_stats stats;
+	int error;
+	uint32_t padding;
+};
+
+struct merge_worker {
+	struct merge_state *state;
+	struct merge_reader *readers;
+	struct merge_reader **heap;
+	struct merge_spill spill;
+	struct build_stats stats;
+	uint64_t last[8]; /* last key merged, to drop duplicates. */
+	/* The current partition: pattern's n_bits prefix, up to max. */
+	uint64_t pattern;
+	uint64_t max;
+	uint32_t n_bits;
+	int error;
+};
+
+/* Finds the partition that holds key0. */
+static void
+partition_of(const struct merge_state *state, uint64_t key0,
+    uint64_t *OUT_pattern, uint32_t *OUT_n_bits)
+{
+	const struct build_plan *plan = state->plan;
+	size_t lo = 0;
+	size_t hi;
+
+	if (plan == NULL) {
+		*OUT_n_bits = state->options->n_bits;
+		*OUT_pattern = build_prefix_min(build_prefix(key0, *OUT_n_bits),
+		    *OUT_n_bits);
+		return;
+	}
+
+	/* Plans cover every key[0] we counted: find the last leaf <= key0. */
+	hi = plan->n_leaf;
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (plan->leaves[mid].pattern <= key0) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	*OUT_pattern = plan->leaves[lo].pattern;
+	*OUT_n_bits = plan->leaves[lo].n_bits;
+	return;
+}
+
+/* First record in run whose key[0] is at least key0. */
+static int
+run_lower_bound(const struct build_options *options,
+    const struct build_run *run, uint64_t key0, uint64_t *OUT_index)
+{
+	size_t record_bytes = build_record_size(options) * sizeof(uint64_t);
+	uint64_t lo = 0;
+	uint64_t hi = run->n_record;
+
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		uint64_t probe;
+
+		if (build_pread_full(run->fd, &probe, sizeof(probe),
+		    mid * record_bytes) != 0) {
+			warn("reading a run");
+			return -1;
+		}
+
+		if (probe < key0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	*OUT_index = lo;
+	return 0;
+}
+
+/* Refills reader; head is NULL once it's exhausted. */
+static int
+reader_fill(const struct build_options *options, struct merge_reader *reader)
+{
+	size_t words = build_record_size(options);
+	uint64_t left = reader->end - reader->next;
+	size_t n = (left < reader->cap) ? (size_t)left : reader->cap;
+
+	reader->head = NULL;
+	reader->len = n;
+	reader->pos = 0;
+	if (n == 0) {
+		return 0;
+	}
+
+	if (build_pread_full(reader->fd, reader->buf,
+	    n * words * sizeof(uint64_t),
+	    reader->next * words * sizeof(uint64_t)) != 0) {
+		warn("reading a run");
+		return -1;
+	}
+
+	reader->next += n;
+	reader->head = reader->buf;
+	return 0;
+}
+
+static int
+reader_advance(const struct build_options *options,
+    struct merge_reader *reader)
+{
+
+	if (++reader->pos < reader->len) {
+		reader->head += build_record_size(options);
+		return 0;
+	}
+
+	return reader_fill(options, reader);
+}
+
+/*
+ * Orders readers by their head's key, then by run: readers[i] reads
+ * runs[i], and runs follow input order, so the earliest of equal keys
+ * comes out first.
+ */
+static inline bool
+heap_less(const struct merge_reader *a, const struct merge_reader *b,
+    size_t key_size)
+{
+	int cmp = build_key_compare(a->head, b->head, key_size);
+
+	return cmp < 0 || (cmp == 0 && a < b);
+}
+
+static void
+heap_sift_down(struct merge_reader **heap, size_t n, size_t i,
+    size_t key_size)
+{
+	struct merge_reader *top = heap[i];
+
+	for (;;) {
+		size_t child = 2 * i + 1;
+
+		if (child >= n) {
+			break;
+		}
+
+		if (child + 1 < n &&
+		    heap_less(heap[child + 1], heap[child], key_size)) {
+			child++;
+		}
+
+		if (!heap_less(heap[child], top, key_size)) {
+			break;
+		}
+
+		heap[i] = heap[child];
+		i = child;
+	}
+
+	heap[i] = top;
+	return;
+}
+
+/* Writes the current partition's fragment, and resets the spill. */
+static int
+partition_finish(struct merge_worker *worker)
+{
+	const struct build_options *options = worker->state->options;
+	struct merge_spill *spill = &worker->spill;
+	size_t record_bytes = build_record_size(options) * sizeof(uint64_t);
+	struct build_partition partition = {
+		.records = spill->buf,
+		.n_record = spill->n_spilled + spill->len,
+		.pattern = worker->pattern,
+		.n_bits = worker->n_bits,
+		.depth = worker->n_bits
+	};
+	void *map = NULL;
+	size_t map_len = 0;
+	int r;
+
+	if (partition.n_record == 0) {
+		return 0;
+	}
+
+	if (spill->n_spilled > 0) {
+		if (build_pwrite_full(spill->fd, spill->buf,
+		    spill->len * record_bytes,
+		    spill->n_spilled * record_bytes) != 0) {
+			warn("spilling a partition");
+			return -1;
+		}
+
+		map_len = partition.n_record * record_bytes;
+		map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, spill->fd, 0);
+		if (map == MAP_FAILED) {
+			warn("mapping a spilled partition");
+			return -1;
+		}
+
+		partition.records = map;
+	}
+
+	r = build_fragment_write(options, &partition, &worker->stats);
+	if (map != NULL) {
+		munmap(map, map_len);
+	}
+
+	spill->len = 0;
+	spill->n_spilled = 0;
+	return r;
+}
+
+static int
+partition_append(struct merge_worker *worker, const uint64_t *record)
+{
+	const struct build_options *options = worker->state->options;
+	struct merge_spill *spill = &worker->spill;
+	size_t words = build_record_size(options);
+
+	if (spill->len == spill->cap) {
+		if (spill->fd < 0) {
+			spill->fd = build_temp_file(options->tmp_dir);
+			if (spill->fd < 0) {
+				warn("creating a spill file in %s",
+				    options->tmp_dir);
+				return -1;
+			}
+		}
+
+		if (build_pwrite_full(spill->fd, spill->buf,
+		    spill->len * words * sizeof(uint64_t),
+		    spill->n_spilled * words * sizeof(uint64_t)) != 0) {
+			warn("spilling a partition");
+			return -1;
+		}
+
+		spill->n_spilled += spill->len;
+		spill->len = 0;
+	}
+
+	memcpy(&spill->buf[spill->len * words], record,
+	    words * sizeof(uint64_t));
+	spill->len++;
+	return 0;
+}
+
+/* Merges unit's slice of every run, and writes its fragments. */
+static int
+merge_unit(struct merge_worker *worker, size_t unit)
+{
+	const struct merge_state *state = worker->state;
+	const struct build_options *options = state->options;
+	const struct build_runs *runs = state->runs;
+	size_t key_size = options->key_size;
+	size_t n_heap = 0;
+	bool have_last = false;
+
+	for (size_t i = 0; i < runs->n_run; i++) {
+		struct merge_reader *reader = &worker->readers[i];
+		uint64_t begin = 0;
+		uint64_t end = runs->runs[i].n_record;
+
+		if ((unit > 0 && run_lower_bound(options, &runs->runs[i],
+		    state->bounds[unit], &begin) != 0) ||
+		    (unit + 1 < state->n_unit && run_lower_bound(options,
+		    &runs->runs[i], state->bounds[unit + 1], &end) != 0)) {
+			return -1;
+		}
+
+		reader->fd = runs->runs[i].fd;
+		reader->next = begin;
+		reader->end = end;
+		if (reader_fill(options, reader) != 0) {
+			return -1;
+		}
+
+		if (reader->head != NULL) {
+			worker->heap[n_heap++] = reader;
+		}
+	}
+
+	for (size_t i = n_heap / 2; i-- > 0; ) {
+		heap_sift_down(worker->heap, n_heap, i, key_size);
+	}
+
+	while (n_heap > 0) {
+		struct merge_reader *top = worker->heap[0];
+		const uint64_t *record = top->head;
+
+		if (have_last &&
+		    build_key_compare(record, worker->last, key_size) == 0) {
+			worker->stats.n_duplicate++;
+		} else {
+			if (!have_last || record[0] > worker->max) {
+				if (partition_finish(worker) != 0) {
+					return -1;
+				}
+
+				partition_of(state, record[0], &worker->pattern,
+				    &worker->n_bits);
+				worker->max = build_pattern_max(worker->pattern,
+				    worker->n_bits);
+			}
+
+			if (partition_append(worker, record) != 0) {
+				return -1;
+			}
+
+			memcpy(worker->last, record, key_size * sizeof(uint64_t));
+			have_last = true;
+		}
+
+		if (reader_advance(options, top) != 0) {
+			return -1;
+		}
+
+		if (top->head == NULL) {
+			worker->heap[0] = worker->heap[--n_heap];
+		}
+
+		if (n_heap > 0) {
+			heap_sift_down(worker->heap, n_heap, 0, key_size);
+		}
+	}
+
+	return partition_finish(worker);
+}
+
+static void *
+merge_worker_run(void *arg)
+{
+	struct merge_worker *worker = arg;
+	struct merge_state *state = worker->state;
+
+	for (;;) {
+		size_t unit = __atomic_fetch_add(&state->next_unit, 1,
+		    __ATOMIC_RELAXED);
+
+		if (unit >= state->n_unit ||
+		    __atomic_load_n(&state->error, __ATOMIC_RELAXED) != 0) {
+			break;
+		}
+
+		if (merge_unit(worker, unit) != 0) {
+			__atomic_store_n(&state->error, -1, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&state->lock);
+	state->stats.n_fragment += worker->stats.n_fragment;
+	state->stats.n_record += worker->stats.n_record;
+	state->stats.n_duplicate += worker->stats.n_duplicate;
+	state->stats.n_byte += worker->stats.n_byte;
+	if (worker->stats.max_displacement > state->stats.max_displacement) {
+		state->stats.max_displacement = worker->stats.max_displacement;
+	}
+
+	pthread_mutex_unlock(&state->lock);
+	return NULL;
+}
+
+static int
+merge_worker_init(struct merge_worker *worker, struct merge_state *state)
+{
+	const struct build_options *options = state->options;
+	size_t n_run = state->runs->n_run;
+	size_t words = build_record_size(options);
+
+	*worker = (struct merge_worker) {
+		.state = state,
+		.readers = calloc(n_run, sizeof(struct merge_reader)),
+		.heap = calloc(n_run, sizeof(struct merge_reader *)),
+		.spill = {
+			.buf = malloc(state->spill_cap * words *
+			    sizeof(uint64_t)),
+			.cap = state->spill_cap,
+			.fd = -1
+		},
+		.n_bits = 0
+	};
+
+	if ((n_run > 0 && (worker->readers == NULL || worker->heap == NULL)) ||
+	    worker->spill.buf == NULL) {
+		warn("allocating merge buffers");
+		return -1;
+	}
+
+	for (size_t i = 0; i < n_run; i++) {
+		worker->readers[i].cap = state->read_cap;
+		worker->readers[i].buf = malloc(state->read_cap * words *
+		    sizeof(uint64_t));
+		if (worker->readers[i].buf == NULL) {
+			warn("allocating merge buffers");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void
+merge_worker_deinit(struct merge_worker *worker, size_t n_run)
+{
+
+	for (size_t i = 0; worker->readers != NULL && i < n_run; i++) {
+		free(worker->readers[i].buf);
+	}
+
+	if (worker->spill.fd >= 0) {
+		close(worker->spill.fd);
+	}
+
+	free(worker->readers);
+	free(worker->heap);
+	free(worker->spill.buf);
+	return;
+}
+
+/*
+ * Splits key[0] in units with about as many samples each.  Units start
+ * where a partition does, so a partition (and duplicate keys) is never
+ * split across units.
+ */
+static size_t
+merge_bounds(const struct merge_state *state, uint64_t *bounds,
+    size_t max_unit)
+{
+	const struct build_runs *runs = state->runs;
+	size_t n = 1;
+
+	bounds[0] = 0;
+	for (size_t i = 1; i < max_unit && runs->n_sample > 0; i++) {
+		uint64_t pattern;
+		uint32_t n_bits;
+
+		partition_of(state, runs->samples[runs->n_sample * i / max_unit],
+		    &pattern, &n_bits);
+		if (pattern > bounds[n - 1]) {
+			bounds[n++] = pattern;
+		}
+	}
+
+	return n;
+}
+
+int
+build_merge(const struct build_options *options,
+    const struct build_runs *runs, const struct build_plan *plan,
+    struct build_stats *OUT_stats)
+{
+	size_t record_bytes = build_record_size(options) * sizeof(uint64_t);
+	size_t max_unit = (size_t)options->n_thread * MERGE_UNITS_PER_THREAD;
+	size_t n_worker = options->n_thread;
+	struct merge_state state = {
+		.options = options,
+		.runs = runs,
+		.plan = plan,
+		.lock = PTHREAD_MUTEX_INITIALIZER
+	};
+	struct merge_worker *workers;
+	pthread_t *threads;
+	uint64_t *bounds;
+	size_t read_bytes;
+	int ret = -1;
+
+	*OUT_stats = (struct build_stats) { .n_fragment = 0 };
+	bounds = calloc(max_unit, sizeof(*bounds));
+	workers = calloc(n_worker, sizeof(*workers));
+	threads = calloc(n_worker, sizeof(*threads));
+	if (bounds == NULL || workers == NULL || threads == NULL) {
+		warn("allocating %zu merge workers", n_worker);
+		goto out;
+	}
+
+	state.bounds = bounds;
+	state.n_unit = merge_bounds(&state, bounds, max_unit);
+	n_worker = (state.n_unit < n_worker) ? state.n_unit : n_worker;
+
+	/* Half the memory for run buffers, half for partitions. */
+	read_bytes = options->memory / 2 / n_worker /
+	    (runs->n_run > 0 ? runs->n_run : 1);
+	read_bytes = (read_bytes < MERGE_READ_MIN) ? MERGE_READ_MIN : read_bytes;
+	state.read_cap = read_bytes / record_bytes + 1;
+	state.spill_cap = options->memory / 2 / n_worker / record_bytes + 1;
+
+	for (size_t i = 0; i < n_worker; i++) {
+		if (merge_worker_init(&workers[i], &state) != 0) {
+			n_worker = i + 1;
+			goto out;
+		}
+	}
+
+	for (size_t i = 1; i < n_worker; i++) {
+		if (pthread_create(&threads[i], NULL,
+		    merge_worker_run, &workers[i]) != 0) {
+			/* Fewer workers is fine: units are shared. */
+			threads[i] = pthread_self();
+		}
+	}
+
+	merge_worker_run(&workers[0]);
+	for (size_t i = 1; i < n_worker; i++) {
+		if (!pthread_equal(threads[i], pthread_self())) {
+			pthread_join(threads[i], NULL);
+		}
+	}
+
+	*OUT_stats = state.stats;
+	ret = state.error;
+
+out:
+	for (size_t i = 0; workers != NULL && i < n_worker; i++) {
+		merge_worker_deinit(&workers[i], runs->n_run);
+	}
+
+	free(bounds);
+	free(workers);
+	free(threads);
+	return ret;
+}
@@ -0,0 +1,144 @@
+#include <err.h>
+#include <stdlib.h>
+
+#include "src/fragment.h"
+#include "build.h"
+
+/*
+ * Fits usually land between 100% and 150% of the record count; plan
+ * for the middle, and let build_fragment_write split what doesn't fit.
+ */
+#define PLAN_SLOT_PERCENT 125
+
+struct plan_state {
+	const struct build_options *options;
+	const uint64_t *histogram;
+	struct build_plan *plan;
+	size_t cap;
+};
+
+/* Estimated table_size of a fragment for n records. */
+static uint64_t
+plan_bytes(const struct build_options *options, uint64_t n)
+{
+	uint64_t record_bytes = build_record_size(options) * sizeof(uint64_t);
+	uint64_t bytes = sizeof(struct fragment_header) +
+	    n * record_bytes * PLAN_SLOT_PERCENT / 100;
+
+	if (options->filter_bits > 0) {
+		bytes += sizeof(struct fragment_filter) +
+		    n * options->filter_bits / 8;
+	}
+
+	return bytes;
+}
+
+static int
+plan_append(struct plan_state *state, uint64_t prefix, uint32_t n_bits,
+    uint64_t n_record)
+{
+	struct build_plan *plan = state->plan;
+
+	if (plan->n_leaf == state->cap) {
+		size_t cap = (state->cap == 0) ? 64 : 2 * state->cap;
+		void *grown = realloc(plan->leaves, cap * sizeof(*plan->leaves));
+
+		if (grown == NULL) {
+			warn("allocating a plan of %zu fragments", cap);
+			return -1;
+		}
+
+		plan->leaves = grown;
+		state->cap = cap;
+	}
+
+	plan->leaves[plan->n_leaf++] = (struct build_leaf) {
+		.pattern = build_prefix_min(prefix, n_bits),
+		.n_record = n_record,
+		.n_bits = n_bits
+	};
+
+	return 0;
+}
+
+/* Records under prefix, an n_bits prefix of key[0]. */
+static uint64_t
+plan_count(const struct plan_state *state, uint64_t prefix, uint32_t n_bits)
+{
+	uint32_t shift = state->options->max_bits - n_bits;
+
+	return state->histogram[(prefix + 1) << shift] -
+	    state->histogram[prefix << shift];
+}
+
+/*
+ * Splits dense prefixes, depth first so leaves come out in key order.
+ * A sparse prefix is never split, so its fragment covers all its
+ * sparse neighbours at once.  When a split leaves one half empty, the
+ * other half keeps the shorter leaf prefix, emit_prefix's emit_bits:
+ * a longer one would only make the table directory bigger.
+ */
+static int
+plan_split(struct plan_state *state, uint64_t prefix, uint32_t n_bits,
+    uint64_t emit_prefix, uint32_t emit_bits)
+{
+	const struct build_options *options = state->options;
+	uint64_t n = plan_count(state, prefix, n_bits);
+	uint64_t n_low;
+
+	if (n == 0) {
+		return 0;
+	}
+
+	if (n_bits >= options->max_bits ||
+	    plan_bytes(options, n) <= options->target_bytes) {
+		return plan_append(state, emit_prefix, emit_bits, n);
+	}
+
+	n_low = plan_count(state, 2 * prefix, n_bits + 1);
+	if (n_low == n) {
+		return plan_split(state, 2 * prefix, n_bits + 1,
+		    emit_prefix, emit_bits);
+	}
+
+	if (n_low == 0) {
+		return plan_split(state, 2 * prefix + 1, n_bits + 1,
+		    emit_prefix, emit_bits);
+	}
+
+	if (plan_split(state, 2 * prefix, n_bits + 1, 2 * prefix,
+	    n_bits + 1) != 0) {
+		return -1;
+	}
+
+	return plan_split(state, 2 * prefix + 1, n_bits + 1, 2 * prefix + 1,
+	    n_bits + 1);
+}
+
+int
+build_plan(const struct build_options *options,
+    const struct build_runs *runs, struct build_plan *OUT_plan)
+{
+	struct plan_state state = {
+		.options = options,
+		.histogram = runs->histogram,
+		.plan = OUT_plan
+	};
+
+	*OUT_plan = (struct build_plan) { .n_leaf = 0 };
+	if (plan_split(&state, 0, 0, 0, 0) != 0) {
+		build_plan_destroy(OUT_plan);
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+build_plan_destroy(struct build_plan *plan)
+{
+
+	free(plan->leaves);
+	*plan = (struct build_plan) { .n_leaf = 0 };
+	return;
+}
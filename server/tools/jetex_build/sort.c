@@ -0,0 +1,425 @@
+#include <err.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "build.h"
+
+/* Slices first scatter on this many bits of key[0] - min. */
+#define SORT_RADIX_BITS 11
+/* Below this, merge sort switches to insertion sort. */
+#define SORT_INSERTION_MAX 16
+/* Don't split a chunk in slices smaller than this many records. */
+#define SORT_SLICE_MIN 4096
+/* key[0] samples we keep per slice. */
+#define SORT_SAMPLES_PER_SLICE 256
+
+/* One thread's share of a chunk: sorted and written as its own run. */
+struct sort_slice {
+	const struct build_options *options;
+	uint64_t *records;
+	uint64_t *scratch; /* as large as records; holds the sorted slice. */
+	uint64_t *histogram; /* record counts per max_bits prefix, or NULL. */
+	size_t n_record;
+	size_t n_sample;
+	uint64_t samples[SORT_SAMPLES_PER_SLICE];
+	struct build_run run;
+	int error;
+	uint32_t padding;
+};
+
+static void
+insertion_sort(uint64_t *base, size_t n, size_t words, size_t key_size,
+    uint64_t *hole)
+{
+
+	for (size_t i = 1; i < n; i++) {
+		size_t j = i;
+
+		if (build_key_compare(&base[(i - 1) * words], &base[i * words],
+		    key_size) <= 0) {
+			continue;
+		}
+
+		memcpy(hole, &base[i * words], words * sizeof(uint64_t));
+		do {
+			memcpy(&base[j * words], &base[(j - 1) * words],
+			    words * sizeof(uint64_t));
+			j--;
+		} while (j > 0 &&
+		    build_key_compare(&base[(j - 1) * words], hole, key_size) > 0);
+
+		memcpy(&base[j * words], hole, words * sizeof(uint64_t));
+	}
+
+	return;
+}
+
+/* Sorts base in place, with scratch (as large as base) for merges. */
+static void
+merge_sort(uint64_t *base, uint64_t *scratch, size_t n, size_t words,
+    size_t key_size)
+{
+	size_t half = n / 2;
+	const uint64_t *left = base;
+	const uint64_t *right = base + half * words;
+	const uint64_t *left_end = right;
+	const uint64_t *right_end = base + n * words;
+	uint64_t *out = scratch;
+
+	if (n <= SORT_INSERTION_MAX) {
+		insertion_sort(base, n, words, key_size, scratch);
+		return;
+	}
+
+	merge_sort(base, scratch, half, words, key_size);
+	merge_sort(base + half * words, scratch + half * words, n - half,
+	    words, key_size);
+
+	/* Already in order: common with partially sorted inputs. */
+	if (build_key_compare(right - words, right, key_size) <= 0) {
+		return;
+	}
+
+	while (left < left_end && right < right_end) {
+		const uint64_t **from;
+
+		from = (build_key_compare(left, right, key_size) <= 0)
+		    ? &left : &right;
+		memcpy(out, *from, words * sizeof(uint64_t));
+		*from += words;
+		out += words;
+	}
+
+	/* What's left of right is already in place. */
+	memcpy(out, left, (size_t)(left_end - left) * sizeof(uint64_t));
+	out += left_end - left;
+	memcpy(base, scratch, (size_t)(out - scratch) * sizeof(uint64_t));
+	return;
+}
+
+/*
+ * Scatters slice->records into scratch on the top SORT_RADIX_BITS of
+ * key[0] - min, then merge sorts each bucket in place, with the now
+ * free records buffer as merge scratch.
+ */
+static void
+sort_slice_records(struct sort_slice *slice)
+{
+	size_t offsets[(1UL << SORT_RADIX_BITS) + 1];
+	size_t words = build_record_size(slice->options);
+	size_t key_size = slice->options->key_size;
+	uint64_t min = UINT64_MAX;
+	uint64_t max = 0;
+	uint64_t range;
+	unsigned int shift = 0;
+
+	for (size_t i = 0; i < slice->n_record; i++) {
+		uint64_t key0 = slice->records[i * words];
+
+		min = (key0 < min) ? key0 : min;
+		max = (key0 > max) ? key0 : max;
+	}
+
+	range = max - min;
+	if (range >> SORT_RADIX_BITS != 0) {
+		shift = 64 - SORT_RADIX_BITS - (unsigned int)__builtin_clzll(range);
+	}
+
+	memset(offsets, 0, sizeof(offsets));
+	for (size_t i = 0; i < slice->n_record; i++) {
+		offsets[1 + ((slice->records[i * words] - min) >> shift)]++;
+	}
+
+	for (size_t i = 1; i <= 1UL << SORT_RADIX_BITS; i++) {
+		offsets[i] += offsets[i - 1];
+	}
+
+	for (size_t i = 0; i < slice->n_record; i++) {
+		const uint64_t *record = &slice->records[i * words];
+		size_t *dst = &offsets[(record[0] - min) >> shift];
+
+		memcpy(&slice->scratch[*dst * words], record,
+		    words * sizeof(uint64_t));
+		(*dst)++;
+	}
+
+	/* offsets[i] is now bucket i's end. */
+	for (size_t i = 0, begin = 0; i < 1UL << SORT_RADIX_BITS; i++) {
+		size_t end = offsets[i];
+
+		if (end - begin > 1) {
+			merge_sort(&slice->scratch[begin * words],
+			    &slice->records[begin * words],
+			    end - begin, words, key_size);
+		}
+
+		begin = end;
+	}
+
+	return;
+}
+
+/* Adds the sorted slice's records to histogram, one add per prefix. */
+static void
+count_prefixes(const struct sort_slice *slice)
+{
+	size_t words = build_record_size(slice->options);
+	uint32_t n_bits = slice->options->max_bits;
+	size_t begin = 0;
+
+	while (begin < slice->n_record) {
+		uint64_t prefix = build_prefix(slice->scratch[begin * words],
+		    n_bits);
+		size_t end = begin + 1;
+
+		while (end < slice->n_record &&
+		    build_prefix(slice->scratch[end * words], n_bits) == prefix) {
+			end++;
+		}
+
+		__atomic_fetch_add(&slice->histogram[prefix], end - begin,
+		    __ATOMIC_RELAXED);
+		begin = end;
+	}
+
+	return;
+}
+
+static void *
+sort_slice_run(void *arg)
+{
+	struct sort_slice *slice = arg;
+	size_t words = build_record_size(slice->options);
+	size_t stride;
+
+	sort_slice_records(slice);
+	if (slice->histogram != NULL) {
+		count_prefixes(slice);
+	}
+
+	stride = slice->n_record / SORT_SAMPLES_PER_SLICE + 1;
+	slice->n_sample = 0;
+	for (size_t i = 0; i < slice->n_record; i += stride) {
+		slice->samples[slice->n_sample++] = slice->scratch[i * words];
+	}
+
+	slice->run.fd = build_temp_file(slice->options->tmp_dir);
+	slice->run.n_record = slice->n_record;
+	if (slice->run.fd < 0) {
+		warn("creating a run in %s", slice->options->tmp_dir);
+		slice->error = -1;
+		return NULL;
+	}
+
+	if (build_write_full(slice->run.fd, slice->scratch,
+	    slice->n_record * words * sizeof(uint64_t)) != 0) {
+		warn("writing a run in %s", slice->options->tmp_dir);
+		slice->error = -1;
+	}
+
+	return NULL;
+}
+
+static int
+u64_compare(const void *x, const void *y)
+{
+	uint64_t a, b;
+
+	memcpy(&a, x, sizeof(a));
+	memcpy(&b, y, sizeof(b));
+	return (a > b) - (a < b);
+}
+
+/* Sorts a chunk of n records in parallel slices, and appends their runs. */
+static int
+sort_chunk(const struct build_options *options, struct build_runs *runs,
+    uint64_t *records, uint64_t *scratch, size_t n)
+{
+	size_t words = build_record_size(options);
+	size_t n_slice = n / SORT_SLICE_MIN;
+	struct sort_slice *slices;
+	pthread_t *threads;
+	void *grown;
+	int ret = 0;
+
+	n_slice = (n_slice < options->n_thread) ? n_slice : options->n_thread;
+	n_slice = (n_slice == 0) ? 1 : n_slice;
+
+	grown = realloc(runs->runs,
+	    (runs->n_run + n_slice) * sizeof(*runs->runs));
+	if (grown != NULL) {
+		runs->runs = grown;
+		grown = realloc(runs->samples,
+		    (runs->n_sample + n_slice * SORT_SAMPLES_PER_SLICE) *
+		    sizeof(*runs->samples));
+	}
+
+	if (grown != NULL) {
+		runs->samples = grown;
+	}
+
+	slices = calloc(n_slice, sizeof(*slices));
+	threads = calloc(n_slice, sizeof(*threads));
+	if (grown == NULL || slices == NULL || threads == NULL) {
+		warn("allocating %zu sort slices", n_slice);
+		free(slices);
+		free(threads);
+		return -1;
+	}
+
+	for (size_t i = 0; i < n_slice; i++) {
+		size_t begin = n * i / n_slice;
+
+		slices[i] = (struct sort_slice) {
+			.options = options,
+			.records = records + begin * words,
+			.scratch = scratch + begin * words,
+			.histogram = runs->histogram,
+			.n_record = n * (i + 1) / n_slice - begin,
+			.run.fd = -1
+		};
+
+		if (i > 0 && pthread_create(&threads[i], NULL,
+		    sort_slice_run, &slices[i]) != 0) {
+			/* Sort it on this thread instead. */
+			threads[i] = pthread_self();
+		}
+	}
+
+	sort_slice_run(&slices[0]);
+	for (size_t i = 1; i < n_slice; i++) {
+		if (pthread_equal(threads[i], pthread_self())) {
+			sort_slice_run(&slices[i]);
+		} else {
+			pthread_join(threads[i], NULL);
+		}
+	}
+
+	for (size_t i = 0; i < n_slice; i++) {
+		if (slices[i].run.fd >= 0) {
+			runs->runs[runs->n_run++] = slices[i].run;
+		}
+
+		memcpy(&runs->samples[runs->n_sample], slices[i].samples,
+		    slices[i].n_sample * sizeof(uint64_t));
+		runs->n_sample += slices[i].n_sample;
+		ret |= slices[i].error;
+	}
+
+	free(slices);
+	free(threads);
+	return ret;
+}
+
+int
+build_sort(const struct build_options *options, struct build_runs *OUT_runs)
+{
+	size_t record_bytes = build_record_size(options) * sizeof(uint64_t);
+	size_t chunk = options->memory / 2 / record_bytes;
+	uint64_t *records = NULL;
+	uint64_t *scratch = NULL;
+	int fd = STDIN_FILENO;
+	int ret = -1;
+
+	*OUT_runs = (struct build_runs) { .n_record = 0 };
+	chunk = (chunk == 0) ? 1 : chunk;
+	if (options->input != NULL) {
+		fd = open(options->input, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			warn("opening %s", options->input);
+			return -1;
+		}
+	}
+
+	records = malloc(chunk * record_bytes);
+	scratch = malloc(chunk * record_bytes);
+	if (records == NULL || scratch == NULL) {
+		warn("allocating %zu-record sort buffers", chunk);
+		goto out;
+	}
+
+	if (options->target_bytes != 0) {
+		/* One more entry, for the prefix sums. */
+		OUT_runs->histogram = calloc(((size_t)1 << options->max_bits) + 1,
+		    sizeof(uint64_t));
+		if (OUT_runs->histogram == NULL) {
+			warn("allocating a %" PRIu32 "-bit histogram",
+			    options->max_bits);
+			goto out;
+		}
+	}
+
+	for (;;) {
+		ssize_t r = build_read_full(fd, records, chunk * record_bytes);
+		size_t n;
+
+		if (r < 0) {
+			warn("reading %s", options->input ?: "stdin");
+			goto out;
+		}
+
+		if ((size_t)r % record_bytes != 0) {
+			warnx("%s ends in a partial record",
+			    options->input ?: "stdin");
+			goto out;
+		}
+
+		n = (size_t)r / record_bytes;
+		if (n > 0 &&
+		    sort_chunk(options, OUT_runs, records, scratch, n) != 0) {
+			goto out;
+		}
+
+		OUT_runs->n_record += n;
+		if (n < chunk) {
+			break;
+		}
+	}
+
+	qsort(OUT_runs->samples, OUT_runs->n_sample, sizeof(uint64_t),
+	    u64_compare);
+	if (OUT_runs->histogram != NULL) {
+		uint64_t sum = 0;
+
+		for (size_t i = 0; i <= (size_t)1 << options->max_bits; i++) {
+			uint64_t count = OUT_runs->histogram[i];
+
+			OUT_runs->histogram[i] = sum;
+			sum += count;
+		}
+	}
+
+	ret = 0;
+
+out:
+	free(records);
+	free(scratch);
+	if (fd != STDIN_FILENO) {
+		close(fd);
+	}
+
+	if (ret != 0) {
+		build_runs_destroy(OUT_runs);
+	}
+
+	return ret;
+}
+
+void
+build_runs_destroy(struct build_runs *runs)
+{
+
+	for (size_t i = 0; i < runs->n_run; i++) {
+		close(runs->runs[i].fd);
+	}
+
+	free(runs->runs);
+	free(runs->samples);
+	free(runs->histogram);
+	*runs = (struct build_runs) { .n_record = 0 };
+	return;
+}
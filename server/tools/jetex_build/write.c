@@ -0,0 +1,740 @@
+#include <err.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "include/jetex_server.h"
+#include "src/fragment.h"
+#include "build.h"
+
+/*
+ * Candidate table sizes, in percent of the record count.  One pass
+ * places the records for every candidate at once.
+ */
+static const uint32_t fit_percent[] = {
+	100, 105, 110, 120, 135, 150, 175, 200, 250, 300, 400
+};
+
+#define FIT_N_CANDIDATE (sizeof(fit_percent) / sizeof(fit_percent[0]))
+
+struct fit {
+	uint64_t multiplier; /* version 0. */
+	uint64_t n_slot;
+	uint64_t max_displacement;
+	/* Version 1: n_segment knots and segments; NULL in version 0. */
+	uint64_t *knots;
+	struct fragment_segment *segments;
+	uint64_t n_segment;
+};
+
+static inline JT_CC_CONST uint64_t
+scale(uint64_t delta, uint64_t multiplier)
+{
+	unsigned __int128 offset = multiplier;
+
+	offset *= delta;
+	return (uint64_t)(offset >> 64);
+}
+
+/* Spreads range over about n_target slots. */
+static JT_CC_CONST uint64_t
+fit_multiplier(uint64_t range, uint64_t n_target)
+{
+	unsigned __int128 multiplier;
+
+	if (range == 0 || n_target <= 1) {
+		return 0;
+	}
+
+	multiplier = (unsigned __int128)(n_target - 1) << 64;
+	multiplier /= range;
+	return (multiplier > UINT64_MAX) ? UINT64_MAX : (uint64_t)multiplier;
+}
+
+/*
+ * Fragment lookups scan slots guess ... guess + max_displacement.
+ * Records go in key order, each in the first free slot at or after its
+ * guess, so max_displacement measures how much keys cluster at that
+ * density.  Returns the smallest candidate within
+ * options->max_displacement or, if none is, the one with the smallest
+ * displacement.
+ */
+static struct fit
+fit_model(const struct build_options *options,
+    const struct build_partition *partition)
+{
+	struct fit fits[FIT_N_CANDIDATE];
+	uint64_t next_slot[FIT_N_CANDIDATE] = { 0 };
+	size_t words = build_record_size(options);
+	const uint64_t *records = partition->records;
+	uint64_t n = partition->n_record;
+	uint64_t min = records[0];
+	uint64_t range = records[(n - 1) * words] - min;
+	struct fit best;
+
+	for (size_t c = 0; c < FIT_N_CANDIDATE; c++) {
+		fits[c] = (struct fit) {
+			.multiplier = fit_multiplier(range,
+			    n * fit_percent[c] / 100),
+		};
+	}
+
+	for (uint64_t i = 0; i < n; i++) {
+		uint64_t delta = records[i * words] - min;
+
+		for (size_t c = 0; c < FIT_N_CANDIDATE; c++) {
+			uint64_t guess = scale(delta, fits[c].multiplier);
+			uint64_t slot = (guess > next_slot[c])
+			    ? guess : next_slot[c];
+
+			if (slot - guess > fits[c].max_displacement) {
+				fits[c].max_displacement = slot - guess;
+			}
+
+			next_slot[c] = slot + 1;
+		}
+	}
+
+	/* The max key's window ends in the last slot. */
+	for (size_t c = 0; c < FIT_N_CANDIDATE; c++) {
+		fits[c].n_slot = scale(range, fits[c].multiplier) +
+		    fits[c].max_displacement + 1;
+	}
+
+	best = fits[0];
+	for (size_t c = 1; c < FIT_N_CANDIDATE; c++) {
+		if (best.max_displacement <= options->max_displacement) {
+			if (fits[c].max_displacement <=
+			    options->max_displacement &&
+			    fits[c].n_slot < best.n_slot) {
+				best = fits[c];
+			}
+		} else if (fits[c].max_displacement < best.max_displacement ||
+		    (fits[c].max_displacement == best.max_displacement &&
+		    fits[c].n_slot < best.n_slot)) {
+			best = fits[c];
+		}
+	}
+
+	return best;
+}
+
+/* Fits records a ... b - 1 of a partition to one segment each. */
+struct segment_fit {
+	const uint64_t *records;
+	size_t words;
+	uint64_t n_record;
+	uint64_t max; /* largest key[0]. */
+	uint64_t limit; /* on each segment's own displacement. */
+	uint64_t cap;
+	struct fit *fit;
+};
+
+static void
+fit_destroy(struct fit *fit)
+{
+
+	free(fit->knots);
+	free(fit->segments);
+	fit->knots = NULL;
+	fit->segments = NULL;
+	fit->n_segment = 0;
+	return;
+}
+
+/*
+ * One slot per record, from records[a]'s key[0] up to the next
+ * segment's knot (or past max).
+ */
+static JT_CC_PURE uint64_t
+segment_multiplier(const struct segment_fit *fit, uint64_t a, uint64_t b)
+{
+	uint64_t knot = fit->records[a * fit->words];
+	unsigned __int128 width;
+	unsigned __int128 multiplier;
+
+	if (b < fit->n_record) {
+		width = fit->records[b * fit->words] - knot;
+	} else {
+		width = (unsigned __int128)(fit->max - knot) + 1;
+	}
+
+	multiplier = ((unsigned __int128)(b - a) << 64) / width;
+	return (multiplier > UINT64_MAX) ? UINT64_MAX : (uint64_t)multiplier;
+}
+
+/*
+ * Max displacement of records a ... b - 1 in a segment of their own,
+ * or anything above fit->limit once it is clear they exceed it.
+ */
+static JT_CC_PURE uint64_t
+segment_displacement(const struct segment_fit *fit, uint64_t a, uint64_t b,
+    uint64_t multiplier)
+{
+	uint64_t knot = fit->records[a * fit->words];
+	uint64_t next_slot = 0;
+	uint64_t max_displacement = 0;
+
+	for (uint64_t i = a; i < b && max_displacement <= fit->limit; i++) {
+		uint64_t guess = scale(fit->records[i * fit->words] - knot,
+		    multiplier);
+		uint64_t slot = (guess > next_slot) ? guess : next_slot;
+
+		if (slot - guess > max_displacement) {
+			max_displacement = slot - guess;
+		}
+
+		next_slot = slot + 1;
+	}
+
+	return max_displacement;
+}
+
+/*
+ * A record near the middle of a ... b - 1 that starts a new key[0],
+ * or a if every record there shares one.
+ */
+static JT_CC_PURE uint64_t
+segment_middle(const struct segment_fit *fit, uint64_t a, uint64_t b)
+{
+	const uint64_t *records = fit->records;
+	size_t words = fit->words;
+	uint64_t middle = a + (b - a) / 2;
+
+	for (uint64_t i = middle; i < b; i++) {
+		if (records[i * words] != records[(i - 1) * words]) {
+			return i;
+		}
+	}
+
+	for (uint64_t i = middle; i > a; i--) {
+		if (records[i * words] != records[(i - 1) * words]) {
+			return i;
+		}
+	}
+
+	return a;
+}
+
+static int
+segment_append(struct segment_fit *fit, uint64_t knot, uint64_t multiplier)
+{
+	struct fit *model = fit->fit;
+
+	if (model->n_segment == fit->cap) {
+		uint64_t cap = (fit->cap == 0) ? 64 : 2 * fit->cap;
+		void *grown;
+
+		grown = realloc(model->knots, cap * sizeof(*model->knots));
+		if (grown == NULL) {
+			return -1;
+		}
+
+		model->knots = grown;
+		grown = realloc(model->segments, cap * sizeof(*model->segments));
+		if (grown == NULL) {
+			return -1;
+		}
+
+		model->segments = grown;
+		fit->cap = cap;
+	}
+
+	model->knots[model->n_segment] = knot;
+	model->segments[model->n_segment] = (struct fragment_segment) {
+		.multiplier = multiplier
+	};
+	model->n_segment++;
+	return 0;
+}
+
+/* Bisects records a ... b - 1 until each segment is within limit. */
+static int
+segment_split(struct segment_fit *fit, uint64_t a, uint64_t b)
+{
+	uint64_t multiplier = segment_multiplier(fit, a, b);
+
+	if (segment_displacement(fit, a, b, multiplier) > fit->limit) {
+		uint64_t middle = segment_middle(fit, a, b);
+
+		if (middle != a) {
+			if (segment_split(fit, a, middle) != 0) {
+				return -1;
+			}
+
+			return segment_split(fit, middle, b);
+		}
+	}
+
+	return segment_append(fit, fit->records[a * fit->words], multiplier);
+}
+
+/* Guess for key0 under fit; segment tracks ascending key0s. */
+static inline uint64_t
+fit_guess(const struct fit *fit, uint64_t min, uint64_t *segment,
+    uint64_t key0)
+{
+	uint64_t i = *segment;
+
+	if (fit->n_segment == 0) {
+		return scale(key0 - min, fit->multiplier);
+	}
+
+	while (i + 1 < fit->n_segment && key0 >= fit->knots[i + 1]) {
+		i++;
+	}
+
+	*segment = i;
+	return fit->segments[i].first_slot +
+	    scale(key0 - fit->knots[i], fit->segments[i].multiplier);
+}
+
+/*
+ * Fits a version 1 model for clusters that no single line can follow:
+ * bisects the records until each segment, on its own, stays within
+ * options->max_displacement (or just below
+ * FRAGMENT_MODEL_MAX_DISPLACEMENT).  Each segment then starts at the
+ * first slot its predecessor left free, so segments keep their own
+ * displacement.  A run of equal key[0]s can't be split, though: the
+ * caller must check the result.  0 -> ok.
+ */
+static int
+fit_segments(const struct build_options *options,
+    const struct build_partition *partition, struct fit *OUT_fit)
+{
+	size_t words = build_record_size(options);
+	const uint64_t *records = partition->records;
+	uint64_t n = partition->n_record;
+	struct segment_fit fit = {
+		.records = records,
+		.words = words,
+		.n_record = n,
+		.max = records[(n - 1) * words],
+		.limit = (options->max_displacement <
+		    FRAGMENT_MODEL_MAX_DISPLACEMENT) ?
+		    options->max_displacement :
+		    FRAGMENT_MODEL_MAX_DISPLACEMENT - 1,
+		.fit = OUT_fit
+	};
+	uint64_t segment = 0;
+	uint64_t next_slot = 0;
+	uint64_t guess = 0;
+
+	*OUT_fit = (struct fit) { .n_slot = 0 };
+	if (segment_split(&fit, 0, n) != 0) {
+		fit_destroy(OUT_fit);
+		return -1;
+	}
+
+	for (uint64_t i = 0; i < n; i++) {
+		uint64_t key0 = records[i * words];
+		uint64_t slot;
+
+		if (segment + 1 < OUT_fit->n_segment &&
+		    key0 >= OUT_fit->knots[segment + 1]) {
+			OUT_fit->segments[++segment].first_slot = next_slot;
+		}
+
+		guess = fit_guess(OUT_fit, 0, &segment, key0);
+		slot = (guess > next_slot) ? guess : next_slot;
+		if (slot - guess > OUT_fit->max_displacement) {
+			OUT_fit->max_displacement = slot - guess;
+		}
+
+		next_slot = slot + 1;
+	}
+
+	/* The max key's window ends in the last slot. */
+	OUT_fit->n_slot = guess + OUT_fit->max_displacement + 1;
+	return 0;
+}
+
+/* Bytes of fit's version 1 model, padded like fragment.c expects. */
+static JT_CC_PURE uint64_t
+fit_model_size(const struct fit *fit)
+{
+	uint64_t size = fit->n_segment *
+	    (sizeof(uint64_t) + sizeof(struct fragment_segment));
+
+	return (size + 63) & ~(uint64_t)63;
+}
+
+/* Slots are written in chunks of about this many bytes. */
+#define WRITE_CHUNK_BYTES (1UL << 20)
+
+/* Buffers slots, and writes them at their offset in fd. */
+struct slot_writer {
+	uint64_t *items;
+	uint64_t *values; /* split only. */
+	uint64_t items_offset; /* of slot 0, in the file. */
+	uint64_t values_offset;
+	uint64_t base; /* first buffered slot. */
+	size_t cap; /* in slots. */
+	size_t len;
+	size_t key_size;
+	size_t value_size;
+	int fd;
+	uint32_t padding;
+};
+
+static int
+slot_writer_flush(struct slot_writer *writer)
+{
+	size_t item_bytes = (writer->key_size + writer->value_size) *
+	    sizeof(uint64_t);
+
+	if (writer->values == NULL) {
+		if (build_pwrite_full(writer->fd, writer->items,
+		    writer->len * item_bytes,
+		    writer->items_offset + writer->base * item_bytes) != 0) {
+			return -1;
+		}
+	} else {
+		size_t key_bytes = writer->key_size * sizeof(uint64_t);
+		size_t value_bytes = writer->value_size * sizeof(uint64_t);
+
+		if (build_pwrite_full(writer->fd, writer->items,
+		    writer->len * key_bytes,
+		    writer->items_offset + writer->base * key_bytes) != 0 ||
+		    build_pwrite_full(writer->fd, writer->values,
+		    writer->len * value_bytes,
+		    writer->values_offset + writer->base * value_bytes) != 0) {
+			return -1;
+		}
+	}
+
+	writer->base += writer->len;
+	writer->len = 0;
+	return 0;
+}
+
+static int
+slot_writer_put(struct slot_writer *writer, const uint64_t *record)
+{
+	size_t key_size = writer->key_size;
+	size_t value_size = writer->value_size;
+
+	if (writer->values == NULL) {
+		memcpy(&writer->items[writer->len * (key_size + value_size)],
+		    record, (key_size + value_size) * sizeof(uint64_t));
+	} else {
+		memcpy(&writer->items[writer->len * key_size], record,
+		    key_size * sizeof(uint64_t));
+		memcpy(&writer->values[writer->len * value_size],
+		    record + key_size, value_size * sizeof(uint64_t));
+	}
+
+	if (++writer->len < writer->cap) {
+		return 0;
+	}
+
+	return slot_writer_flush(writer);
+}
+
+/*
+ * Writes the filter and the items after the header and model.  Empty
+ * slots repeat the next record (the last one, past the end), so every
+ * probe window stays sorted.
+ */
+static int
+write_items(const struct build_options *options,
+    const struct build_partition *partition, const struct fit *fit,
+    uint64_t n_block, int fd)
+{
+	size_t words = build_record_size(options);
+	size_t key_size = options->key_size;
+	const uint64_t *records = partition->records;
+	uint64_t n = partition->n_record;
+	uint64_t min = records[0];
+	uint64_t offset = sizeof(struct fragment_header) + fit_model_size(fit);
+	struct slot_writer writer = {
+		.key_size = key_size,
+		.value_size = options->value_size,
+		.fd = fd
+	};
+	uint64_t segment = 0;
+	uint64_t slot = 0;
+	int ret = -1;
+
+	if (n_block > 0) {
+		struct fragment_filter filter = { .n_blocks = n_block };
+		uint64_t *blocks = calloc(n_block, 64);
+
+		if (blocks == NULL) {
+			return -1;
+		}
+
+		for (uint64_t i = 0; i < n; i++) {
+			uint64_t hash = fragment_filter_hash(&records[i * words],
+			    key_size);
+			uint64_t *block = blocks +
+			    8 * fragment_filter_block(hash, n_block);
+
+			for (size_t j = 0; j < 8; j++) {
+				block[j] |= fragment_filter_bit(hash, j);
+			}
+		}
+
+		ret = build_pwrite_full(fd, &filter, sizeof(filter), offset);
+		ret |= build_pwrite_full(fd, blocks, n_block * 64,
+		    offset + sizeof(filter));
+		free(blocks);
+		if (ret != 0) {
+			return -1;
+		}
+
+		offset += sizeof(filter) + n_block * 64;
+		ret = -1;
+	}
+
+	writer.cap = WRITE_CHUNK_BYTES / (words * sizeof(uint64_t)) + 1;
+	writer.items_offset = offset;
+	writer.items = malloc(writer.cap * words * sizeof(uint64_t));
+	if (options->split) {
+		/* Keys then values, in the same buffer. */
+		writer.values = writer.items + writer.cap * key_size;
+		writer.values_offset = offset +
+		    fit->n_slot * key_size * sizeof(uint64_t);
+	}
+
+	if (writer.items == NULL) {
+		return -1;
+	}
+
+	for (uint64_t i = 0; i < n; i++) {
+		const uint64_t *record = &records[i * words];
+		uint64_t guess = fit_guess(fit, min, &segment, record[0]);
+
+		do {
+			if (slot_writer_put(&writer, record) != 0) {
+				goto out;
+			}
+		} while (slot++ < guess);
+	}
+
+	for (; slot < fit->n_slot; slot++) {
+		if (slot_writer_put(&writer, &records[(n - 1) * words]) != 0) {
+			goto out;
+		}
+	}
+
+	ret = slot_writer_flush(&writer);
+
+out:
+	free(writer.items);
+	return ret;
+}
+
+/* Writes partition's fragment for fit, as name in output_dir. */
+static int
+write_fragment(const struct build_options *options,
+    const struct build_partition *partition, const struct fit *fit,
+    uint64_t n_block, uint64_t table_size, const char *name)
+{
+	size_t words = build_record_size(options);
+	const uint64_t *records = partition->records;
+	uint64_t n = partition->n_record;
+	struct fragment_header header = {
+		.magic = FRAGMENT_HEADER_MAGIC,
+		.version = (fit->n_segment > 0) ? 1 : 0,
+		.pattern = partition->pattern,
+		.n_bits = (uint8_t)partition->n_bits,
+		.key_size = (uint8_t)options->key_size,
+		.item_size = (uint16_t)words,
+		.max_displacement = (uint16_t)fit->max_displacement,
+		.flags = (uint16_t)((options->split ? FRAGMENT_FLAG_SPLIT : 0) |
+		    (n_block > 0 ? FRAGMENT_FLAG_FILTER : 0)),
+		.table_size = table_size,
+		.min = records[0],
+		.max = records[(n - 1) * words],
+		.multiplier = fit->multiplier,
+		.n_segments = fit->n_segment
+	};
+	uint64_t segments_offset = sizeof(header) +
+	    fit->n_segment * sizeof(fit->knots[0]);
+	char path[PATH_MAX];
+	char tmp_path[PATH_MAX];
+	int fd;
+
+	if (snprintf(path, sizeof(path), "%s/%s", options->output_dir,
+	    name) >= (int)sizeof(path) ||
+	    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >=
+	    (int)sizeof(tmp_path)) {
+		warnx("%s/%s: path too long", options->output_dir, name);
+		return -1;
+	}
+
+	fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		warn("creating %s", tmp_path);
+		return -1;
+	}
+
+	if (build_pwrite_full(fd, &header, sizeof(header), 0) != 0 ||
+	    (fit->n_segment > 0 &&
+	    (build_pwrite_full(fd, fit->knots,
+	    fit->n_segment * sizeof(fit->knots[0]), sizeof(header)) != 0 ||
+	    build_pwrite_full(fd, fit->segments,
+	    fit->n_segment * sizeof(fit->segments[0]),
+	    segments_offset) != 0)) ||
+	    write_items(options, partition, fit, n_block, fd) != 0) {
+		warn("writing %s", tmp_path);
+		goto fail;
+	}
+
+	if (jetex_table_fragment_validate(fd) != 0) {
+		warnx("%s failed validation", tmp_path);
+		goto fail;
+	}
+
+	if (rename(tmp_path, path) != 0) {
+		warn("renaming %s", tmp_path);
+		goto fail;
+	}
+
+	close(fd);
+	return 0;
+
+fail:
+	(void)unlink(tmp_path);
+	close(fd);
+	return -1;
+}
+
+/*
+ * Splits partition on its next bit below depth, and writes both
+ * halves.  If either half is empty, the other is the whole partition:
+ * it keeps its prefix, one bit deeper.
+ */
+static int
+write_halves(const struct build_options *options,
+    const struct build_partition *partition, struct build_stats *stats)
+{
+	size_t words = build_record_size(options);
+	uint32_t depth = partition->depth + 1;
+	uint64_t bit = (uint64_t)1 << (64 - depth);
+	struct build_partition low = *partition;
+	struct build_partition high;
+	uint64_t lo = 0;
+	uint64_t hi = partition->n_record;
+
+	/* First record in the high half. */
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+
+		if ((partition->records[mid * words] & bit) == 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	low.depth = depth;
+	if (lo == 0 || lo == partition->n_record) {
+		return build_fragment_write(options, &low, stats);
+	}
+
+	high = low;
+	low.n_record = lo;
+	high.records += lo * words;
+	high.n_record -= lo;
+	low.n_bits = depth;
+	low.pattern = build_prefix_min(build_prefix(low.records[0], depth),
+	    depth);
+	high.n_bits = depth;
+	high.pattern = low.pattern | bit;
+	if (build_fragment_write(options, &low, stats) != 0) {
+		return -1;
+	}
+
+	return build_fragment_write(options, &high, stats);
+}
+
+int
+build_fragment_write(const struct build_options *options,
+    const struct build_partition *partition, struct build_stats *stats)
+{
+	static pthread_mutex_t manifest_lock = PTHREAD_MUTEX_INITIALIZER;
+	size_t words = build_record_size(options);
+	uint64_t n = partition->n_record;
+	uint64_t n_block = 0;
+	uint64_t filter_size = 0;
+	uint64_t table_size;
+	struct fit fit;
+	char name[32];
+
+	fit = fit_model(options, partition);
+	if (options->filter_bits > 0) {
+		n_block = (n * options->filter_bits + 511) / 512;
+		n_block = (n_block == 0) ? 1 : n_block;
+		n_block = (n_block > UINT32_MAX) ? UINT32_MAX : n_block;
+		filter_size = sizeof(struct fragment_filter) + 64 * n_block;
+	}
+
+	table_size = sizeof(struct fragment_header) + filter_size +
+	    fit.n_slot * words * sizeof(uint64_t);
+
+	/* Planned partitions that miss a target get split further. */
+	if (options->target_bytes != 0 && n > 1 &&
+	    partition->depth < options->max_bits &&
+	    (fit.max_displacement > options->max_displacement ||
+	    table_size > options->target_bytes)) {
+		return write_halves(options, partition, stats);
+	}
+
+	/* Clusters finer than any prefix: try segments. */
+	if (fit.max_displacement > options->max_displacement) {
+		struct fit segments;
+
+		if (fit_segments(options, partition, &segments) != 0) {
+			warnx("allocating a model for %" PRIu64 " records", n);
+			return -1;
+		}
+
+		if (segments.max_displacement <
+		    FRAGMENT_MODEL_MAX_DISPLACEMENT &&
+		    segments.max_displacement < fit.max_displacement) {
+			fit = segments;
+			table_size = sizeof(struct fragment_header) +
+			    fit_model_size(&fit) + filter_size +
+			    fit.n_slot * words * sizeof(uint64_t);
+		} else {
+			fit_destroy(&segments);
+		}
+	}
+
+	snprintf(name, sizeof(name), "%016" PRIx64 "-%" PRIu32 ".frag",
+	    partition->pattern, partition->n_bits);
+	if (fit.max_displacement > UINT16_MAX) {
+		warnx("%s/%s: max displacement %" PRIu64 " doesn't fit; "
+		    "use more prefix bits", options->output_dir, name,
+		    fit.max_displacement);
+		return -1;
+	}
+
+	if (write_fragment(options, partition, &fit, n_block, table_size,
+	    name) != 0) {
+		fit_destroy(&fit);
+		return -1;
+	}
+
+	stats->n_fragment++;
+	stats->n_record += n;
+	stats->n_byte += table_size;
+	if (fit.max_displacement > stats->max_displacement) {
+		stats->max_displacement = fit.max_displacement;
+	}
+
+	pthread_mutex_lock(&manifest_lock);
+	printf("%s/%s\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\n",
+	    options->output_dir, name, n, fit.n_slot, fit.max_displacement,
+	    table_size);
+	pthread_mutex_unlock(&manifest_lock);
+	fit_destroy(&fit);
+	return 0;
+}
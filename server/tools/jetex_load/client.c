@@ -0,0 +1,457 @@
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shared/packet.h"
+#include "load.h"
+
+/* Replies carry values of up to 32 KiB. */
+#define RECV_BUF_BYTES (1U << 15)
+
+/* Asked of the kernel, so bursts of replies don't overflow. */
+#define SOCKET_BUF_BYTES (8 << 20)
+
+/* Threads start this long after load_run, once all are set up. */
+#define START_DELAY_NS 20000000ULL
+
+/* Every request's correlation key: replies carry it back. */
+struct correlation {
+	uint64_t due_ns; /* CLOCK_MONOTONIC. */
+	uint64_t sequence;
+};
+
+struct load_thread {
+	const struct load_options *options;
+	struct load_stats *stats;
+	double interval_ns;
+	uint64_t start_ns; /* this thread's first due time. */
+	uint64_t end_ns; /* nothing is due from then on. */
+	int64_t realtime_offset_ns; /* CLOCK_REALTIME - CLOCK_MONOTONIC. */
+	uint64_t random;
+	uint64_t n_sent; /* sequence numbers below this were sent. */
+	int fd;
+	uint32_t index;
+	pthread_t thread;
+};
+
+static uint64_t
+now_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* splitmix64. */
+static uint64_t
+load_random(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+static inline JT_CC_PURE uint64_t
+due_ns(const struct load_thread *thread, uint64_t sequence)
+{
+
+	return thread->start_ns +
+	    (uint64_t)((double)sequence * thread->interval_ns);
+}
+
+/* Encodes request sequence, due at due, into dst.  0 -> ok. */
+static int
+request_encode(struct load_thread *thread, struct jetex_header_lookup *dst,
+    uint64_t sequence, uint64_t due)
+{
+	const struct load_options *options = thread->options;
+	struct correlation correlation = {
+		.due_ns = due,
+		.sequence = sequence
+	};
+	uint64_t key[8];
+	uint8_t table[16];
+
+	if (options->keys != NULL &&
+	    load_random(&thread->random) % 100 < options->hit_percent) {
+		uint64_t i = load_random(&thread->random) % options->n_key;
+
+		memcpy(key, &options->keys[i * options->key_size],
+		    options->key_size * sizeof(uint64_t));
+	} else {
+		for (size_t i = 0; i < options->key_size; i++) {
+			key[i] = load_random(&thread->random);
+		}
+	}
+
+	memcpy(table, options->table, sizeof(table));
+	if (jetex_packet_lookup_encode(dst, &correlation, sizeof(correlation),
+	    NULL, 0, table, key, options->key_size * sizeof(uint64_t)) < 0) {
+		return -1;
+	}
+
+	if (options->deadline_ns != 0) {
+		uint64_t deadline = (uint64_t)((int64_t)(due +
+		    options->deadline_ns) + thread->realtime_offset_ns);
+		struct timeval tv = {
+			.tv_sec = (time_t)(deadline / 1000000000ULL),
+			.tv_usec = (suseconds_t)(deadline % 1000000000ULL / 1000)
+		};
+
+		jetex_packet_set_deadline(&dst->header, &tv);
+	}
+
+	return 0;
+}
+
+/* Records every reply in a datagram received at now. */
+static void
+reply_handle(struct load_thread *thread, const uint8_t *buf, size_t len,
+    uint64_t now)
+{
+	const struct load_options *options = thread->options;
+	struct load_stats *stats = thread->stats;
+
+	while (len > 0) {
+		struct jetex_response response;
+		struct correlation correlation;
+
+		if (jetex_packet_response_decode(&response, buf, len) != 0 ||
+		    response.correlation_key_length != sizeof(correlation)) {
+			stats->n_bad++;
+			return;
+		}
+
+		memcpy(&correlation, buf + response.correlation_key_offset,
+		    sizeof(correlation));
+		if (correlation.sequence >= thread->n_sent ||
+		    correlation.due_ns != due_ns(thread, correlation.sequence) ||
+		    now < correlation.due_ns) {
+			stats->n_bad++;
+		} else {
+			load_hist_record(&stats->latency,
+			    now - correlation.due_ns);
+			if (response.found) {
+				stats->n_found++;
+			} else {
+				stats->n_missing++;
+			}
+
+			if (options->deadline_ns != 0 &&
+			    now - correlation.due_ns > options->deadline_ns) {
+				stats->n_late++;
+			}
+		}
+
+		buf += response.record_length;
+		len -= response.record_length;
+	}
+
+	return;
+}
+
+/*
+ * Sends the n requests in msgs; the ones the kernel refuses (e.g., a
+ * full send buffer, or no server: ECONNREFUSED) are lost.
+ */
+static void
+requests_send(struct load_thread *thread, struct mmsghdr *msgs, size_t n)
+{
+	size_t done = 0;
+
+	while (done < n) {
+		int r;
+
+		r = sendmmsg(thread->fd, msgs + done, (unsigned int)(n - done),
+		    MSG_DONTWAIT);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (r <= 0) {
+			thread->stats->n_send_error++;
+			done++;
+			continue;
+		}
+
+		done += (size_t)r;
+	}
+
+	return;
+}
+
+/* Receives what's there; true if there was anything. */
+static bool
+replies_receive(struct load_thread *thread, struct mmsghdr *msgs,
+    const uint8_t *bufs)
+{
+	uint64_t now;
+	int r;
+
+	r = recvmmsg(thread->fd, msgs, LOAD_BATCH, MSG_DONTWAIT, NULL);
+	if (r <= 0) {
+		/* EAGAIN, or an error queued by an ICMP message. */
+		return r < 0 && errno != EAGAIN && errno != EWOULDBLOCK;
+	}
+
+	now = now_ns(CLOCK_MONOTONIC);
+	for (int i = 0; i < r; i++) {
+		reply_handle(thread, bufs + (size_t)i * RECV_BUF_BYTES,
+		    msgs[i].msg_len, now);
+	}
+
+	return true;
+}
+
+static void *
+thread_main(void *arg)
+{
+	struct load_thread *thread = arg;
+	const struct load_options *options = thread->options;
+	struct load_stats *stats = thread->stats;
+	struct jetex_header_lookup requests[LOAD_BATCH];
+	struct mmsghdr send_msgs[LOAD_BATCH];
+	struct mmsghdr recv_msgs[LOAD_BATCH];
+	struct iovec send_iovs[LOAD_BATCH];
+	struct iovec recv_iovs[LOAD_BATCH];
+	uint64_t stop_ns = thread->end_ns + options->drain_ns;
+	uint8_t *bufs;
+
+	bufs = malloc(LOAD_BATCH * RECV_BUF_BYTES);
+	if (bufs == NULL) {
+		err(1, "allocating receive buffers");
+	}
+
+	memset(send_msgs, 0, sizeof(send_msgs));
+	memset(recv_msgs, 0, sizeof(recv_msgs));
+	for (size_t i = 0; i < LOAD_BATCH; i++) {
+		send_iovs[i] = (struct iovec) { .iov_base = &requests[i] };
+		send_msgs[i].msg_hdr.msg_iov = &send_iovs[i];
+		send_msgs[i].msg_hdr.msg_iovlen = 1;
+		recv_iovs[i] = (struct iovec) {
+			.iov_base = bufs + i * RECV_BUF_BYTES,
+			.iov_len = RECV_BUF_BYTES
+		};
+		recv_msgs[i].msg_hdr.msg_iov = &recv_iovs[i];
+		recv_msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	for (;;) {
+		uint64_t now = now_ns(CLOCK_MONOTONIC);
+		uint64_t next = due_ns(thread, thread->n_sent);
+		size_t n = 0;
+		bool busy;
+
+		/* Everything due by now, however late we are. */
+		if (next < thread->end_ns && next <= now &&
+		    now - next > stats->max_behind_ns) {
+			stats->max_behind_ns = now - next;
+		}
+
+		while (n < LOAD_BATCH && next < thread->end_ns && next <= now) {
+			if (request_encode(thread, &requests[n], thread->n_sent,
+			    next) != 0) {
+				errx(1, "encoding a lookup request");
+			}
+
+			send_iovs[n].iov_len = requests[n].header.len;
+			n++;
+			thread->n_sent++;
+			next = due_ns(thread, thread->n_sent);
+		}
+
+		stats->n_due += n;
+		requests_send(thread, send_msgs, n);
+		busy = replies_receive(thread, recv_msgs, bufs) || n > 0;
+		if (busy) {
+			continue;
+		}
+
+		if (next >= thread->end_ns &&
+		    (now >= stop_ns || stats->n_found + stats->n_missing +
+		    stats->n_send_error >= stats->n_due)) {
+			break;
+		}
+
+		{
+			uint64_t wake = (next < thread->end_ns) ? next : stop_ns;
+			struct pollfd pfd = { .fd = thread->fd, .events = POLLIN };
+			struct timespec timeout = { .tv_sec = 0 };
+
+			if (wake > now) {
+				timeout.tv_sec = (time_t)((wake - now) / 1000000000ULL);
+				timeout.tv_nsec = (long)((wake - now) % 1000000000ULL);
+				(void)ppoll(&pfd, 1, &timeout, NULL);
+			}
+		}
+	}
+
+	free(bufs);
+	return NULL;
+}
+
+int
+load_run(const struct load_options *options, double rate,
+    struct load_stats *stats)
+{
+	uint32_t n_thread = options->n_thread;
+	struct load_thread *threads;
+	struct load_stats *thread_stats;
+	double interval_ns = 1e9 * n_thread / rate;
+	uint64_t start_ns;
+	int64_t realtime_offset_ns;
+	int ret = -1;
+
+	threads = calloc(n_thread, sizeof(*threads));
+	thread_stats = calloc(n_thread, sizeof(*thread_stats));
+	if (threads == NULL || thread_stats == NULL) {
+		warn("allocating %" PRIu32 " threads", n_thread);
+		goto out;
+	}
+
+	for (uint32_t i = 0; i < n_thread; i++) {
+		threads[i].fd = -1;
+	}
+
+	for (uint32_t i = 0; i < n_thread; i++) {
+		int size = SOCKET_BUF_BYTES;
+		int fd;
+
+		fd = socket(options->addr.ss_family,
+		    SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if (fd < 0) {
+			warn("socket");
+			goto out;
+		}
+
+		threads[i].fd = fd;
+		(void)setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+		(void)setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+		if (connect(fd, (const struct sockaddr *)&options->addr,
+		    options->addr_len) != 0) {
+			warn("connect");
+			goto out;
+		}
+	}
+
+	realtime_offset_ns = (int64_t)(now_ns(CLOCK_REALTIME) -
+	    now_ns(CLOCK_MONOTONIC));
+	start_ns = now_ns(CLOCK_MONOTONIC) + START_DELAY_NS;
+	for (uint32_t i = 0; i < n_thread; i++) {
+		struct load_thread *thread = &threads[i];
+
+		/* Threads take turns, evenly spaced. */
+		thread->options = options;
+		thread->stats = &thread_stats[i];
+		thread->interval_ns = interval_ns;
+		thread->start_ns = start_ns +
+		    (uint64_t)(interval_ns * i / n_thread);
+		thread->end_ns = start_ns + options->duration_ns;
+		thread->realtime_offset_ns = realtime_offset_ns;
+		thread->random = 0x6A657465786C6FULL + i;
+		thread->index = i;
+		if (pthread_create(&thread->thread, NULL, thread_main,
+		    thread) != 0) {
+			errx(1, "creating thread %" PRIu32, i);
+		}
+	}
+
+	for (uint32_t i = 0; i < n_thread; i++) {
+		const struct load_stats *src = &thread_stats[i];
+
+		pthread_join(threads[i].thread, NULL);
+		load_hist_merge(&stats->latency, &src->latency);
+		stats->n_due += src->n_due;
+		stats->n_send_error += src->n_send_error;
+		stats->n_found += src->n_found;
+		stats->n_missing += src->n_missing;
+		stats->n_late += src->n_late;
+		stats->n_bad += src->n_bad;
+		if (src->max_behind_ns > stats->max_behind_ns) {
+			stats->max_behind_ns = src->max_behind_ns;
+		}
+	}
+
+	ret = 0;
+
+out:
+	for (uint32_t i = 0; threads != NULL && i < n_thread; i++) {
+		if (threads[i].fd >= 0) {
+			close(threads[i].fd);
+		}
+	}
+
+	free(thread_stats);
+	free(threads);
+	return ret;
+}
+
+/*
+ * Sums RcvbufErrors from /proc/net/snmp ("Udp:" lines: names, then
+ * values) and Udp6RcvbufErrors from /proc/net/snmp6.
+ */
+int64_t
+load_udp_drops(void)
+{
+	char names[1024];
+	char values[1024];
+	char line[256];
+	int64_t total = -1;
+	FILE *file;
+
+	file = fopen("/proc/net/snmp", "re");
+	if (file != NULL) {
+		while (fgets(names, sizeof(names), file) != NULL) {
+			char *name_save = NULL;
+			char *value_save = NULL;
+			char *name;
+			char *value;
+
+			if (strncmp(names, "Udp:", 4) != 0 ||
+			    fgets(values, sizeof(values), file) == NULL) {
+				continue;
+			}
+
+			name = strtok_r(names, " \n", &name_save);
+			value = strtok_r(values, " \n", &value_save);
+			while (name != NULL && value != NULL) {
+				if (strcmp(name, "RcvbufErrors") == 0) {
+					total = strtoll(value, NULL, 10);
+				}
+
+				name = strtok_r(NULL, " \n", &name_save);
+				value = strtok_r(NULL, " \n", &value_save);
+			}
+
+			break;
+		}
+
+		fclose(file);
+	}
+
+	file = fopen("/proc/net/snmp6", "re");
+	if (file != NULL) {
+		while (fgets(line, sizeof(line), file) != NULL) {
+			long long count;
+
+			if (sscanf(line, "Udp6RcvbufErrors %lld", &count) == 1) {
+				total = ((total < 0) ? 0 : total) + count;
+			}
+		}
+
+		fclose(file);
+	}
+
+	return total;
+}
@@ -0,0 +1,100 @@
+#include "load.h"
+
+#define SUB_COUNT (1U << LOAD_HIST_SUB_BITS)
+
+/*
+ * Values below SUB_COUNT get a bucket each; above, the top
+ * LOAD_HIST_SUB_BITS + 1 bits pick the bucket within their power of
+ * two.
+ */
+static JT_CC_CONST size_t
+bucket_of(uint64_t value)
+{
+	uint32_t shift;
+
+	if (value < SUB_COUNT) {
+		return (size_t)value;
+	}
+
+	if (value >> LOAD_HIST_MAX_BITS != 0) {
+		value = ((uint64_t)1 << LOAD_HIST_MAX_BITS) - 1;
+	}
+
+	shift = (uint32_t)(63 - __builtin_clzll(value)) - LOAD_HIST_SUB_BITS;
+	return SUB_COUNT + ((size_t)shift << LOAD_HIST_SUB_BITS) +
+	    (size_t)((value >> shift) - SUB_COUNT);
+}
+
+/* Largest value in bucket. */
+static JT_CC_CONST uint64_t
+bucket_max(size_t bucket)
+{
+	uint64_t shift;
+	uint64_t sub;
+
+	if (bucket < SUB_COUNT) {
+		return bucket;
+	}
+
+	shift = (bucket - SUB_COUNT) >> LOAD_HIST_SUB_BITS;
+	sub = SUB_COUNT + ((bucket - SUB_COUNT) & (SUB_COUNT - 1));
+	return ((sub + 1) << shift) - 1;
+}
+
+void
+load_hist_record(struct load_hist *hist, uint64_t value)
+{
+
+	hist->counts[bucket_of(value)]++;
+	hist->n++;
+	hist->sum += value;
+	if (value > hist->max) {
+		hist->max = value;
+	}
+
+	return;
+}
+
+void
+load_hist_merge(struct load_hist *dst, const struct load_hist *src)
+{
+
+	for (size_t i = 0; i < LOAD_HIST_BUCKETS; i++) {
+		dst->counts[i] += src->counts[i];
+	}
+
+	dst->n += src->n;
+	dst->sum += src->sum;
+	if (src->max > dst->max) {
+		dst->max = src->max;
+	}
+
+	return;
+}
+
+uint64_t
+load_hist_quantile(const struct load_hist *hist, double q)
+{
+	double exact = q * (double)hist->n;
+	uint64_t rank;
+	uint64_t seen = 0;
+
+	if (hist->n == 0) {
+		return 0;
+	}
+
+	/* The rank-th smallest value, counting from 1: ceil(q * n). */
+	rank = (uint64_t)exact;
+	rank += ((double)rank < exact);
+	rank = (rank == 0) ? 1 : rank;
+	for (size_t i = 0; i < LOAD_HIST_BUCKETS; i++) {
+		seen += hist->counts[i];
+		if (seen >= rank) {
+			uint64_t value = bucket_max(i);
+
+			return (value < hist->max) ? value : hist->max;
+		}
+	}
+
+	return hist->max;
+}
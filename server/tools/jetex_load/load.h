@@ -0,0 +1,87 @@
+#ifndef JETEX_LOAD_H
+#define JETEX_LOAD_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "utility/cc.h"
+
+/*
+ * jetex_load sends jetex_header_lookup requests at a fixed rate, open
+ * loop: request i of a thread is due at start + i / rate, whether or
+ * not earlier ones were answered, and its latency counts from that
+ * due time, not from when it actually went out.  A sender that falls
+ * behind therefore shows up in the latencies, instead of silently
+ * lowering the rate (coordinated omission).
+ */
+struct load_options {
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	uint32_t key_size; /* in uint64_t. */
+	uint8_t table[16];
+	const uint64_t *keys; /* key_size words each, or NULL. */
+	uint64_t n_key;
+	uint32_t hit_percent; /* of requests for keys, the rest random. */
+	uint32_t n_thread;
+	uint64_t duration_ns; /* per rate. */
+	uint64_t deadline_ns; /* after the due time; 0 -> none. */
+	uint64_t drain_ns; /* to wait for replies after the last send. */
+};
+
+/* Requests and replies handled per sendmmsg and recvmmsg call. */
+#define LOAD_BATCH 32
+
+/*
+ * Log-linear latency histogram, like HdrHistogram: 2^LOAD_HIST_SUB_BITS
+ * buckets per power of two, so any value is reported within 1/128 of
+ * itself, from 1 ns up to 2^LOAD_HIST_MAX_BITS ns (about 4.9 hours).
+ */
+#define LOAD_HIST_SUB_BITS 7
+#define LOAD_HIST_MAX_BITS 44
+#define LOAD_HIST_BUCKETS						\
+	((LOAD_HIST_MAX_BITS - LOAD_HIST_SUB_BITS + 1) << LOAD_HIST_SUB_BITS)
+
+struct load_hist {
+	uint64_t counts[LOAD_HIST_BUCKETS];
+	uint64_t n;
+	uint64_t max;
+	uint64_t sum;
+};
+
+/* What one thread (or, merged, the whole run) saw. */
+struct load_stats {
+	struct load_hist latency; /* ns, from due time to reply. */
+	uint64_t n_due; /* requests due before the end of the run. */
+	uint64_t n_send_error; /* due, but sendmmsg failed: lost. */
+	uint64_t n_found;
+	uint64_t n_missing;
+	uint64_t n_late; /* replies after their deadline. */
+	uint64_t n_bad; /* malformed or foreign replies. */
+	uint64_t max_behind_ns; /* worst sender lag behind schedule. */
+};
+
+/* hist.c */
+void
+load_hist_record(struct load_hist *hist, uint64_t value);
+
+void
+load_hist_merge(struct load_hist *dst, const struct load_hist *src);
+
+/* The q (0 ... 1) quantile of recorded values, within a bucket; 0 if none. */
+JT_CC_PURE uint64_t
+load_hist_quantile(const struct load_hist *hist, double q);
+
+/*
+ * client.c: runs n_thread senders, each with its own socket, at rate
+ * requests per second in total for duration_ns, then waits up to
+ * drain_ns for stragglers.  Adds everything to stats.  0 -> ok.
+ */
+int
+load_run(const struct load_options *options, double rate,
+    struct load_stats *stats);
+
+/* Host-wide UDP datagrams dropped for lack of buffer space, or -1. */
+int64_t
+load_udp_drops(void);
+#endif /* !JETEX_LOAD_H */
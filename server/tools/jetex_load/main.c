@@ -0,0 +1,338 @@
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "load.h"
+
+static const char usage[] =
+    "usage: jetex_load [-u table_uuid] [-k key_words] [-i keys [-v value_words]\n"
+    "           [-H hit_percent]] [-r rate,...] [-d seconds] [-j threads]\n"
+    "           [-D deadline_ms] [-w drain_ms] host port\n"
+    "\n"
+    "Sends single-key lookups to host:port over UDP at each fixed rate\n"
+    "in turn, open loop, and prints one line per rate: sent and reply\n"
+    "rates, found and missing replies, lost requests, late replies,\n"
+    "host UDP buffer drops, requests the server must have dropped as\n"
+    "expired (with -D), and latency percentiles from each request's\n"
+    "due time.\n"
+    "\n"
+    "  -u  table UUID, 32 hex digits (all zeroes)\n"
+    "  -k  key words: 1, 2, 4 or 8 (1)\n"
+    "  -i  look up keys from this file of jetex_build records,\n"
+    "      key_words then value_words LE uint64_t each; random keys\n"
+    "      without it\n"
+    "  -v  value words in -i records (1)\n"
+    "  -H  percent of lookups for -i keys; the rest are random (100)\n"
+    "  -r  requests per second, over all threads (100000)\n"
+    "  -d  seconds per rate (10)\n"
+    "  -j  sending threads, each with its own socket (1)\n"
+    "  -D  ask the server to drop requests this late; 0 -> never (0)\n"
+    "  -w  ms to wait for replies after the last request (1000)\n";
+
+static uint64_t
+parse_u64(const char *arg, char option, uint64_t min, uint64_t max)
+{
+	unsigned long long value;
+	char *end;
+
+	errno = 0;
+	value = strtoull(arg, &end, 0);
+	if (errno != 0 || end == arg || *end != '\0' || arg[0] == '-' ||
+	    value < min || value > max) {
+		errx(1, "-%c: expected an integer from %" PRIu64 " to %" PRIu64
+		    ", not %s", option, min, max, arg);
+	}
+
+	return value;
+}
+
+static void
+parse_uuid(uint8_t OUT_uuid[static 16], const char *arg)
+{
+	size_t j = 0;
+
+	for (size_t i = 0; arg[i] != '\0'; i++) {
+		char c = arg[i];
+		int digit;
+
+		if (c == '-') {
+			continue;
+		}
+
+		if (c >= '0' && c <= '9') {
+			digit = c - '0';
+		} else if (c >= 'a' && c <= 'f') {
+			digit = c - 'a' + 10;
+		} else if (c >= 'A' && c <= 'F') {
+			digit = c - 'A' + 10;
+		} else {
+			j = 33;
+			break;
+		}
+
+		if (j >= 32) {
+			j = 33;
+			break;
+		}
+
+		OUT_uuid[j / 2] = (uint8_t)((OUT_uuid[j / 2] << 4) | digit);
+		j++;
+	}
+
+	if (j != 32) {
+		errx(1, "-u: expected 32 hex digits, not %s", arg);
+	}
+
+	return;
+}
+
+/* Reads the keys of every record in path. */
+static uint64_t *
+keys_read(const char *path, size_t key_size, size_t value_size,
+    uint64_t *OUT_n_key)
+{
+	size_t record_bytes = (key_size + value_size) * sizeof(uint64_t);
+	uint64_t *record;
+	uint64_t *keys = NULL;
+	uint64_t n = 0;
+	struct stat st;
+	FILE *file;
+
+	file = fopen(path, "re");
+	if (file == NULL) {
+		err(1, "opening %s", path);
+	}
+
+	if (fstat(fileno(file), &st) != 0) {
+		err(1, "stat %s", path);
+	}
+
+	if (st.st_size <= 0 || (uint64_t)st.st_size % record_bytes != 0) {
+		errx(1, "%s: expected a positive number of %zu-byte records",
+		    path, record_bytes);
+	}
+
+	record = malloc(record_bytes);
+	keys = calloc((uint64_t)st.st_size / record_bytes,
+	    key_size * sizeof(uint64_t));
+	if (record == NULL || keys == NULL) {
+		err(1, "allocating keys for %s", path);
+	}
+
+	while (fread(record, record_bytes, 1, file) == 1) {
+		memcpy(&keys[n * key_size], record, key_size * sizeof(uint64_t));
+		n++;
+	}
+
+	if (ferror(file)) {
+		err(1, "reading %s", path);
+	}
+
+	fclose(file);
+	free(record);
+	*OUT_n_key = n;
+	return keys;
+}
+
+static void
+print_result(const struct load_options *options, double rate,
+    const struct load_stats *stats, int64_t drops)
+{
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	const struct load_hist *latency = &stats->latency;
+	double seconds = 1e-9 * (double)options->duration_ns;
+	uint64_t n_reply = stats->n_found + stats->n_missing;
+	uint64_t n_lost = (stats->n_due > n_reply) ? stats->n_due - n_reply : 0;
+
+	printf("%9.0f\t%9.0f\t%9.0f\t%10" PRIu64 "\t%10" PRIu64 "\t%8" PRIu64
+	    "\t%6.3f\t%8" PRIu64, rate,
+	    (double)(stats->n_due - stats->n_send_error) / seconds,
+	    (double)n_reply / seconds, stats->n_found, stats->n_missing,
+	    n_lost, (stats->n_due == 0) ? 0.0 :
+	    100.0 * (double)n_lost / (double)stats->n_due, stats->n_late);
+	if (drops < 0) {
+		printf("\t%8s", "-");
+	} else {
+		printf("\t%8" PRId64, drops);
+	}
+
+	/*
+	 * The server drops expired requests without a word: with a
+	 * deadline, whatever loss the host's UDP buffers don't explain.
+	 */
+	if (options->deadline_ns == 0 || drops < 0) {
+		printf("\t%8s", "-");
+	} else {
+		printf("\t%8" PRIu64, (n_lost > (uint64_t)drops)
+		    ? n_lost - (uint64_t)drops : 0);
+	}
+
+	for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+		printf("\t%9.1f", 1e-3 *
+		    (double)load_hist_quantile(latency, quantiles[i]));
+	}
+
+	printf("\t%9.1f\t%9.1f\n", 1e-3 * (double)latency->max,
+	    1e-3 * (double)stats->max_behind_ns);
+	if (stats->n_send_error > 0 || stats->n_bad > 0) {
+		printf("# %" PRIu64 " requests not sent, %" PRIu64
+		    " malformed or unexpected replies\n",
+		    stats->n_send_error, stats->n_bad);
+	}
+
+	fflush(stdout);
+	return;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct load_options options = {
+		.key_size = 1,
+		.hit_percent = 100,
+		.n_thread = 1,
+		.duration_ns = 10000000000ULL,
+		.drain_ns = 1000000000ULL
+	};
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_DGRAM
+	};
+	double rates[16] = { 100000 };
+	size_t n_rate = 1;
+	const char *keys_path = NULL;
+	uint64_t value_size = 1;
+	struct addrinfo *addrs;
+	int ret = 0;
+	int opt;
+	int r;
+
+	while ((opt = getopt(argc, argv, "u:k:i:v:H:r:d:j:D:w:h")) != -1) {
+		switch (opt) {
+		case 'u':
+			parse_uuid(options.table, optarg);
+			break;
+		case 'k':
+			options.key_size = (uint32_t)parse_u64(optarg, 'k', 1, 8);
+			if ((options.key_size & (options.key_size - 1)) != 0) {
+				errx(1, "-k: key_words must be 1, 2, 4 or 8");
+			}
+			break;
+		case 'i':
+			keys_path = optarg;
+			break;
+		case 'v':
+			value_size = parse_u64(optarg, 'v', 0, UINT16_MAX);
+			break;
+		case 'H':
+			options.hit_percent = (uint32_t)parse_u64(optarg, 'H',
+			    0, 100);
+			break;
+		case 'r': {
+			char *copy = strdup(optarg);
+			char *save = NULL;
+
+			if (copy == NULL) {
+				err(1, "strdup");
+			}
+
+			n_rate = 0;
+			for (char *item = strtok_r(copy, ",", &save);
+			     item != NULL; item = strtok_r(NULL, ",", &save)) {
+				if (n_rate == sizeof(rates) / sizeof(rates[0])) {
+					errx(1, "-r: at most %zu rates",
+					    sizeof(rates) / sizeof(rates[0]));
+				}
+
+				rates[n_rate++] = (double)parse_u64(item, 'r',
+				    1, 1000000000);
+			}
+
+			free(copy);
+			if (n_rate == 0) {
+				errx(1, "-r: expected at least one rate");
+			}
+			break;
+		}
+		case 'd':
+			options.duration_ns = parse_u64(optarg, 'd', 1,
+			    86400) * 1000000000ULL;
+			break;
+		case 'j':
+			options.n_thread = (uint32_t)parse_u64(optarg, 'j', 1,
+			    1024);
+			break;
+		case 'D':
+			options.deadline_ns = parse_u64(optarg, 'D', 0,
+			    3600000) * 1000000ULL;
+			break;
+		case 'w':
+			options.drain_ns = parse_u64(optarg, 'w', 0,
+			    3600000) * 1000000ULL;
+			break;
+		case 'h':
+			fputs(usage, stdout);
+			return 0;
+		default:
+			fputs(usage, stderr);
+			return 1;
+		}
+	}
+
+	if (argc - optind != 2) {
+		fputs(usage, stderr);
+		return 1;
+	}
+
+	r = getaddrinfo(argv[optind], argv[optind + 1], &hints, &addrs);
+	if (r != 0) {
+		errx(1, "%s port %s: %s", argv[optind], argv[optind + 1],
+		    gai_strerror(r));
+	}
+
+	memcpy(&options.addr, addrs->ai_addr, addrs->ai_addrlen);
+	options.addr_len = addrs->ai_addrlen;
+	freeaddrinfo(addrs);
+
+	if (keys_path != NULL) {
+		options.keys = keys_read(keys_path, options.key_size,
+		    value_size, &options.n_key);
+	}
+
+	printf("%9s\t%9s\t%9s\t%10s\t%10s\t%8s\t%6s\t%8s\t%8s\t%8s\t%9s"
+	    "\t%9s\t%9s\t%9s\t%9s\t%9s\n", "rate", "sent/s", "replies/s",
+	    "found", "missing", "lost", "lost%", "late", "udp_drop",
+	    "expired", "p50_us", "p90_us", "p99_us", "p99.9_us", "max_us",
+	    "behind_us");
+	for (size_t i = 0; i < n_rate; i++) {
+		struct load_stats *stats = calloc(1, sizeof(*stats));
+		int64_t drops_before = load_udp_drops();
+		int64_t drops_after;
+
+		if (stats == NULL) {
+			err(1, "allocating stats");
+		}
+
+		if (load_run(&options, rates[i], stats) != 0) {
+			free(stats);
+			ret = 1;
+			break;
+		}
+
+		drops_after = load_udp_drops();
+		print_result(&options, rates[i], stats,
+		    (drops_before < 0 || drops_after < 0)
+		    ? -1 : drops_after - drops_before);
+		free(stats);
+	}
+
+	free((void *)options.keys);
+	return ret;
+}
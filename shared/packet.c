@@ -33,82 +33,194 @@
 		memcpy(&(DST), ADV(sizeof(DST)), sizeof(DST));	\
 	} while (0)
 
-ssize_t
-jetex_packet_lookup_encode(struct jetex_header_lookup *restrict dst,
-    const void *restrict correlation, size_t correlation_len,
-    const struct sockaddr *restrict addr, socklen_t addr_len,
-    uint8_t table[static 16], const void *restrict key, size_t key_len)
+/*
+ * Appends the correlation key, zero-padded to a multiple of 8 bytes
+ * (at least 8), and sets extra's low 4 bits to its size.
+ */
+static int
+encode_correlation(char *restrict *io_bytes, size_t *io_remaining, uint8_t *extra,
+    const void *restrict correlation, size_t correlation_len)
 {
-	char *restrict bytes;
-	size_t remaining;
-
-	*dst = (struct jetex_header_lookup) { .header.len = 0 };
-	dst->header.type = 0;
-	bytes = &dst->data[0];
-	remaining = sizeof(dst->data);
-
-	if (addr == NULL && addr_len != 0) {
-		return -1;
-	}
+	char *restrict bytes = *io_bytes;
+	size_t remaining = *io_remaining;
 
 	if (correlation_len > 128 || correlation_len > remaining) {
-		return -1;
+		goto fail;
 	}
 
 	if (correlation_len == 0) {
 		ADV(sizeof(uint64_t));
-		dst->header.extra = 0;
+		*extra = 0;
 	} else {
 		size_t u64sz = sizeof(uint64_t);
 		size_t count = (correlation_len + u64sz - 1) / u64sz;
 
 		memcpy(ADV(count * u64sz), correlation, correlation_len);
-		dst->header.extra = (uint8_t)(count - 1);
+		*extra = (uint8_t)(count - 1);
 	}
 
-	if (addr != NULL) {
-		switch (addr->sa_family) {
-		case AF_INET: {
-			struct sockaddr_in in;
+	*io_bytes = bytes;
+	*io_remaining = remaining;
+	return 0;
 
-			_Static_assert(sizeof(in.sin_addr) == 4,
-			    "ipv4 address must be exactly 4 bytes.");
-			_Static_assert(sizeof(in.sin_port) == 2,
-			    "ipv4 port must be exactly 2 bytes.");
+fail:
+	return -1;
+}
 
-			if (addr_len < sizeof(in)) {
-				goto fail;
-			}
+/* Appends addr's destination section, and sets its type in extra. */
+static int
+encode_destination(char *restrict *io_bytes, size_t *io_remaining, uint8_t *extra,
+    const struct sockaddr *restrict addr, socklen_t addr_len)
+{
+	char *restrict bytes = *io_bytes;
+	size_t remaining = *io_remaining;
 
-			memcpy(&in, addr, sizeof(in));
-			OUT(in.sin_addr);
-			OUT(in.sin_port);
-			dst->header.extra |= 1U << 4;
-			break;
+	if (addr == NULL) {
+		return (addr_len == 0) ? 0 : -1;
+	}
+
+	switch (addr->sa_family) {
+	case AF_INET: {
+		struct sockaddr_in in;
+
+		_Static_assert(sizeof(in.sin_addr) == 4,
+		    "ipv4 address must be exactly 4 bytes.");
+		_Static_assert(sizeof(in.sin_port) == 2,
+		    "ipv4 port must be exactly 2 bytes.");
+
+		if (addr_len < sizeof(in)) {
+			goto fail;
 		}
 
-		case AF_INET6: {
-			struct sockaddr_in6 in;
+		memcpy(&in, addr, sizeof(in));
+		OUT(in.sin_addr);
+		OUT(in.sin_port);
+		*extra |= 1U << 4;
+		break;
+	}
 
-			_Static_assert(sizeof(in.sin6_addr) == 16,
-			    "ipv6 address must be exactly 16 bytes.");
-			_Static_assert(sizeof(in.sin6_port) == 2,
-			    "ipv6 port must be exactly 2 bytes.");
+	case AF_INET6: {
+		struct sockaddr_in6 in;
 
-			if (addr_len < sizeof(in)) {
-				goto fail;
-			}
+		_Static_assert(sizeof(in.sin6_addr) == 16,
+		    "ipv6 address must be exactly 16 bytes.");
+		_Static_assert(sizeof(in.sin6_port) == 2,
+		    "ipv6 port must be exactly 2 bytes.");
 
-			memcpy(&in, addr, sizeof(in));
-			OUT(in.sin6_addr);
-			OUT(in.sin6_port);
-			dst->header.extra |= 2U << 4;
-			break;
+		if (addr_len < sizeof(in)) {
+			goto fail;
 		}
 
-		default:
+		memcpy(&in, addr, sizeof(in));
+		OUT(in.sin6_addr);
+		OUT(in.sin6_port);
+		*extra |= 2U << 4;
+		break;
+	}
+
+	default:
+		goto fail;
+	}
+
+	*io_bytes = bytes;
+	*io_remaining = remaining;
+	return 0;
+
+fail:
+	return -1;
+}
+
+/*
+ * Consumes a destination section of type kind (0 means src) into dst,
+ * a struct sockaddr_storage.  Returns the address length, -1 on error.
+ */
+static ssize_t
+decode_destination(const char **io_bytes, size_t *io_remaining, unsigned int kind,
+    const struct sockaddr *restrict src, socklen_t srclen, void *restrict dst)
+{
+	const char *bytes = *io_bytes;
+	size_t remaining = *io_remaining;
+	size_t dstlen;
+
+	switch (kind) {
+	case 0:
+		/* Implicit dst. */
+		if (srclen > sizeof(struct sockaddr_storage)) {
 			goto fail;
 		}
+
+		memcpy(dst, src, srclen);
+		dstlen = srclen;
+		break;
+
+	case 1: {
+		/* ipv4 */
+		struct sockaddr_in in = { .sin_family = AF_INET };
+
+		_Static_assert(sizeof(in.sin_addr) == 4,
+		    "ipv4 address must be exactly 4 bytes.");
+		_Static_assert(sizeof(in.sin_port) == 2,
+		    "ipv4 port must be exactly 2 bytes.");
+		IN(in.sin_addr);
+		IN(in.sin_port);
+		memcpy(dst, &in, sizeof(in));
+		dstlen = sizeof(in);
+		break;
+	}
+
+	case 2: {
+		/* ipv6 */
+		struct sockaddr_in6 in = { .sin6_family = AF_INET6 };
+
+		_Static_assert(sizeof(in.sin6_addr) == 16,
+		    "ipv6 address must be exactly 16 bytes.");
+		_Static_assert(sizeof(in.sin6_port) == 2,
+		    "ipv4 port must be exactly 2 bytes.");
+		IN(in.sin6_addr);
+		IN(in.sin6_port);
+		memcpy(dst, &in, sizeof(in));
+		dstlen = sizeof(in);
+		break;
+	}
+
+	default:
+		goto fail;
+	}
+
+	*io_bytes = bytes;
+	*io_remaining = remaining;
+	return (ssize_t)dstlen;
+
+fail:
+	return -1;
+}
+
+ssize_t
+jetex_packet_lookup_encode(struct jetex_header_lookup *restrict dst,
+    const void *restrict correlation, size_t correlation_len,
+    const struct sockaddr *restrict addr, socklen_t addr_len,
+    uint8_t table[static 16], const void *restrict key, size_t key_len)
+{
+	char *restrict bytes;
+	size_t remaining;
+
+	*dst = (struct jetex_header_lookup) { .header.len = 0 };
+	dst->header.type = 0;
+	bytes = &dst->data[0];
+	remaining = sizeof(dst->data);
+
+	if (addr == NULL && addr_len != 0) {
+		return -1;
+	}
+
+	if (encode_correlation(&bytes, &remaining, &dst->header.extra,
+	    correlation, correlation_len) != 0) {
+		goto fail;
+	}
+
+	if (encode_destination(&bytes, &remaining, &dst->header.extra,
+	    addr, addr_len) != 0) {
+		goto fail;
 	}
 
 	if (remaining < 16) {
@@ -168,58 +280,28 @@ jetex_packet_lookup_decode(struct jetex_lookup *restrict dst,
 	ADV(dst->correlation_key_length);
 	
 	dst->base_data = packet;
-	switch (header.extra >> 4) {
-	case 0:
-		/* Implicit dst. */
-		if (srclen > sizeof(dst->dst)) {
+	{
+		ssize_t dstlen;
+
+		dstlen = decode_destination(&bytes, &remaining,
+		    header.extra >> 4U, src, srclen, &dst->dst);
+		if (dstlen < 0) {
 			goto fail;
 		}
 
-		memcpy(&dst->dst, src, srclen);
-		dst->dstlen = srclen;
-		break;
-
-	case 1: {
-		/* ipv4 */
-		struct sockaddr_in in = { .sin_family = AF_INET };
-
-		_Static_assert(sizeof(in.sin_addr) == 4,
-		    "ipv4 address must be exactly 4 bytes.");
-		_Static_assert(sizeof(in.sin_port) == 2,
-		    "ipv4 port must be exactly 2 bytes.");
-		IN(in.sin_addr);
-		IN(in.sin_port);
-		memcpy(&dst->dst, &in, sizeof(in));
-		dst->dstlen = sizeof(in);
-		break;
-	}
-
-	case 2: {
-		/* ipv6 */
-		struct sockaddr_in6 in = { .sin6_family = AF_INET6 };
-
-		_Static_assert(sizeof(in.sin6_addr) == 16,
-		    "ipv6 address must be exactly 16 bytes.");
-		_Static_assert(sizeof(in.sin6_port) == 2,
-		    "ipv4 port must be exactly 2 bytes.");
-		IN(in.sin6_addr);
-		IN(in.sin6_port);
-		memcpy(&dst->dst, &in, sizeof(in));
-		dst->dstlen = sizeof(in);
-		break;
+		dst->dstlen = (size_t)dstlen;
 	}
 
-	default:
+	IN(dst->table_uuid);
+	/* key length must be a power of two in [8, 64]. */
+	if (remaining < 8 ||
+	    remaining > 64 ||
+	    (remaining & (remaining - 1)) != 0) {
 		goto fail;
 	}
 
-	IN(dst->table_uuid);
-	if (remaining >= sizeof(dst->key)) {
-		memcpy(&dst->key[0], bytes, sizeof(dst->key));
-	} else {
-		memcpy(&dst->key[0], bytes, remaining);
-	}
-	
+	dst->key_length = (uint32_t)remaining;
+	memcpy(&dst->key[0], bytes, remaining);
 	return 0;
 
 fail:
@@ -241,21 +323,11 @@ jetex_response_header_encode(struct jetex_response_header *restrict dst,
 	remaining = sizeof(dst->data);
 
 	dst->header.type = type;
-	if (correlation_len > 128 || correlation_len > remaining) {
+	if (encode_correlation(&bytes, &remaining, &dst->header.extra,
+	    correlation, correlation_len) != 0) {
 		goto fail;
 	}
 
-	if (correlation_len == 0) {
-		ADV(sizeof(uint64_t));
-		dst->header.extra = 0;
-	} else {
-		size_t u64sz = sizeof(uint64_t);
-		size_t count = (correlation_len + u64sz - 1) / u64sz;
-
-		memcpy(ADV(count * u64sz), correlation, correlation_len);
-		dst->header.extra = (uint8_t)(count - 1);
-	}
-
 	memcpy(ADV(16), &table[0], 16);
 	switch (key_len) {
 	case 8:
@@ -318,3 +390,781 @@ jetex_packet_found_encode(struct jetex_header_found *restrict dst,
 	dst->header.header.len = (uint16_t)(dst->header.header.len + value_len);
 	return r;
 }
+
+int
+jetex_packet_response_decode(struct jetex_response *restrict dst,
+    const void *restrict packet, size_t packet_len)
+{
+	struct jetex_header header;
+	const char *bytes;
+	size_t remaining;
+
+	*dst = (struct jetex_response) { .base_data = NULL };
+	bytes = packet;
+	remaining = packet_len;
+
+	IN(header);
+	if ((header.type != 1 && header.type != 3) ||
+	    header.len < sizeof(header) ||
+	    header.len > packet_len ||
+	    header.extra / 16U > 3) {
+		return -1;
+	}
+
+	/* Only decode this record. */
+	remaining = header.len - sizeof(header);
+	dst->correlation_key_offset = (uint32_t)(bytes - (const char *)packet);
+	dst->correlation_key_length = 8 * (1 + (header.extra % 16U));
+	ADV(dst->correlation_key_length);
+
+	memcpy(dst->table_uuid, ADV(16), 16);
+
+	dst->key_offset = (uint32_t)(bytes - (const char *)packet);
+	dst->key_length = 8U << (header.extra / 16U);
+	ADV(dst->key_length);
+
+	dst->found = (header.type == 1);
+	if (!dst->found && remaining != 0) {
+		goto fail;
+	}
+
+	dst->base_data = packet;
+	dst->value_offset = (uint32_t)(bytes - (const char *)packet);
+	dst->value_length = (uint32_t)remaining;
+	dst->record_length = header.len;
+	return 0;
+
+fail:
+	*dst = (struct jetex_response) { .base_data = NULL };
+	return -1;
+}
+
+/* Returns log2(key_len / 8), or -1 if key_len isn't 8, 16, 32 or 64. */
+static int
+multi_key_code(size_t key_len)
+{
+
+	switch (key_len) {
+	case 8:
+		return 0;
+	case 16:
+		return 1;
+	case 32:
+		return 2;
+	case 64:
+		return 3;
+	default:
+		return -1;
+	}
+}
+
+ssize_t
+jetex_packet_multi_lookup_encode(struct jetex_header_multi_lookup *restrict dst,
+    const void *restrict correlation, size_t correlation_len,
+    const struct sockaddr *restrict addr, socklen_t addr_len,
+    const struct jetex_multi_key *restrict keys, size_t n,
+    size_t *restrict OUT_n_encoded)
+{
+	const uint8_t *table = NULL;
+	char *restrict bytes;
+	size_t remaining;
+	size_t i;
+
+	/* Don't clear all of data: it's 32 KB. */
+	*OUT_n_encoded = 0;
+	dst->header = (struct jetex_header) { .type = 4 };
+	bytes = &dst->data[0];
+	remaining = sizeof(dst->data);
+
+	if (encode_correlation(&bytes, &remaining, &dst->header.extra,
+	    correlation, correlation_len) != 0 ||
+	    encode_destination(&bytes, &remaining, &dst->header.extra,
+	    addr, addr_len) != 0) {
+		goto fail;
+	}
+
+	for (i = 0; i < n && i <= UINT16_MAX; i++) {
+		const struct jetex_multi_key *key = &keys[i];
+		bool new_table;
+		uint8_t tag;
+		int code;
+
+		code = multi_key_code(key->key_len);
+		if (code < 0) {
+			goto fail;
+		}
+
+		new_table = (table == NULL || memcmp(table, key->table, 16) != 0);
+		if ((new_table ? 17UL : 1UL) + key->key_len > remaining) {
+			break;
+		}
+
+		tag = (uint8_t)((unsigned int)code | (new_table ? JETEX_MULTI_TABLE : 0));
+		OUT(tag);
+		if (new_table) {
+			memcpy(ADV(16), key->table, 16);
+		}
+
+		memcpy(ADV(key->key_len), key->key, key->key_len);
+		table = key->table;
+	}
+
+	if (i == 0) {
+		goto fail;
+	}
+
+	*OUT_n_encoded = i;
+	dst->header.len = (uint16_t)(sizeof(dst->header) + (size_t)(bytes - &dst->data[0]));
+	return dst->header.len;
+
+fail:
+	*OUT_n_encoded = 0;
+	dst->header = (struct jetex_header) { .len = 0 };
+	return -1;
+}
+
+/*
+ * Returns the size of the multi-lookup record at bytes, or -1 if it's
+ * invalid.  have_table is true if a previous record named a table.
+ */
+static ssize_t
+multi_lookup_record_size(const char *bytes, size_t remaining, bool have_table)
+{
+	size_t size;
+	uint8_t tag;
+
+	if (remaining < 1) {
+		return -1;
+	}
+
+	memcpy(&tag, bytes, 1);
+	if ((tag & ~(JETEX_MULTI_TABLE | 3U)) != 0 ||
+	    (have_table == false && (tag & JETEX_MULTI_TABLE) == 0)) {
+		return -1;
+	}
+
+	size = 1 + (8UL << (tag & 3U));
+	if ((tag & JETEX_MULTI_TABLE) != 0) {
+		size += 16;
+	}
+
+	return (size <= remaining) ? (ssize_t)size : -1;
+}
+
+int
+jetex_packet_multi_lookup_decode(struct jetex_multi_lookup *restrict dst,
+    const void *restrict packet, size_t packet_len,
+    const struct sockaddr *restrict src, socklen_t srclen)
+{
+	struct jetex_header header;
+	const char *bytes;
+	size_t remaining;
+	uint32_t n_keys = 0;
+
+	*dst = (struct jetex_multi_lookup) { .base_data = NULL };
+	bytes = packet;
+	remaining = packet_len;
+
+	IN(header);
+	if (packet_len > JETEX_MULTI_MAX_LEN) {
+		return -1;
+	}
+
+	if (header.type != 4) {
+		return -1;
+	}
+
+	if (header.len != packet_len) {
+		return -1;
+	}
+
+	dst->correlation_key_offset = (uint32_t)(bytes - (const char *)packet);
+	dst->correlation_key_length = 8 * (1 + (header.extra % 16U));
+	ADV(dst->correlation_key_length);
+
+	dst->base_data = packet;
+	{
+		ssize_t dstlen;
+
+		dstlen = decode_destination(&bytes, &remaining,
+		    header.extra >> 4U, src, srclen, &dst->dst);
+		if (dstlen < 0) {
+			goto fail;
+		}
+
+		dst->dstlen = (size_t)dstlen;
+	}
+
+	dst->next_offset = (uint32_t)(bytes - (const char *)packet);
+	dst->end_offset = (uint32_t)packet_len;
+	while (remaining > 0) {
+		ssize_t size;
+
+		size = multi_lookup_record_size(bytes, remaining, n_keys > 0);
+		if (size < 0 || n_keys > UINT16_MAX) {
+			goto fail;
+		}
+
+		ADV((size_t)size);
+		n_keys++;
+	}
+
+	if (n_keys == 0) {
+		goto fail;
+	}
+
+	dst->n_keys = n_keys;
+	return 0;
+
+fail:
+	*dst = (struct jetex_multi_lookup) { .base_data = NULL };
+	return -1;
+}
+
+int
+jetex_packet_multi_lookup_next(struct jetex_multi_lookup *restrict lookup,
+    struct jetex_multi_lookup_key *restrict key)
+{
+	const char *bytes;
+	size_t key_len;
+	uint8_t tag;
+
+	/* decode validated every record. */
+	if (lookup->next_offset >= lookup->end_offset) {
+		return 0;
+	}
+
+	bytes = (const char *)lookup->base_data + lookup->next_offset;
+	memcpy(&tag, bytes++, 1);
+	if ((tag & JETEX_MULTI_TABLE) != 0) {
+		memcpy(lookup->table_uuid, bytes, 16);
+		bytes += 16;
+	}
+
+	key_len = 8UL << (tag & 3U);
+	*key = (struct jetex_multi_lookup_key) {
+		.index = lookup->next_index++,
+		.key_length = (uint32_t)key_len
+	};
+
+	memcpy(key->table_uuid, lookup->table_uuid, 16);
+	memcpy(&key->key[0], bytes, key_len);
+	bytes += key_len;
+	lookup->next_offset = (uint32_t)(bytes - (const char *)lookup->base_data);
+	return 1;
+}
+
+ssize_t
+jetex_packet_multi_response_init(struct jetex_header_multi_response *restrict dst,
+    const void *restrict correlation, size_t correlation_len)
+{
+	char *restrict bytes;
+	size_t remaining;
+
+	dst->header = (struct jetex_header) { .type = 5 };
+	bytes = &dst->data[0];
+	remaining = sizeof(dst->data);
+
+	if (encode_correlation(&bytes, &remaining, &dst->header.extra,
+	    correlation, correlation_len) != 0) {
+		goto fail;
+	}
+
+	dst->header.len = (uint16_t)(sizeof(dst->header) + (size_t)(bytes - &dst->data[0]));
+	return dst->header.len;
+
+fail:
+	dst->header = (struct jetex_header) { .len = 0 };
+	return -1;
+}
+
+/*
+ * Appends a record header for the key at index, with value_len | flags
+ * as its length, and returns where its value_len bytes go; NULL if it
+ * doesn't fit.
+ */
+static char *
+multi_response_append(struct jetex_header_multi_response *restrict dst,
+    uint32_t index, size_t value_len, uint16_t flags)
+{
+	size_t used = dst->header.len;
+	char *restrict bytes;
+	char *value;
+	size_t remaining;
+	uint16_t index16;
+	uint16_t length;
+
+	if (used < sizeof(dst->header) || used > JETEX_MULTI_MAX_LEN ||
+	    index > UINT16_MAX) {
+		return NULL;
+	}
+
+	if (value_len >= JETEX_MULTI_FOUND) {
+		return NULL;
+	}
+
+	bytes = (char *)dst + used;
+	remaining = JETEX_MULTI_MAX_LEN - used;
+	if (2 * sizeof(uint16_t) + value_len > remaining) {
+		return NULL;
+	}
+
+	index16 = (uint16_t)index;
+	length = (uint16_t)(value_len | flags);
+	OUT(index16);
+	OUT(length);
+	value = ADV(value_len);
+	dst->header.len = (uint16_t)(bytes - (char *)dst);
+	return value;
+
+fail:
+	return NULL;
+}
+
+ssize_t
+jetex_packet_multi_response_add(struct jetex_header_multi_response *restrict dst,
+    uint32_t index, const void *restrict value, size_t value_len)
+{
+	char *record;
+
+	if (value == NULL) {
+		value_len = 0;
+	}
+
+	record = multi_response_append(dst, index, value_len,
+	    (value != NULL) ? JETEX_MULTI_FOUND : 0);
+	if (record == NULL) {
+		return -1;
+	}
+
+	if (value_len > 0) {
+		memcpy(record, value, value_len);
+	}
+
+	return dst->header.len;
+}
+
+void *
+jetex_packet_multi_response_reserve(struct jetex_header_multi_response *restrict dst,
+    uint32_t index, size_t value_len)
+{
+
+	return multi_response_append(dst, index, value_len, JETEX_MULTI_FOUND);
+}
+
+size_t
+jetex_packet_multi_response_max_value(const struct jetex_header_multi_response *dst)
+{
+
+	return JETEX_MULTI_MAX_LEN - sizeof(dst->header) -
+	    8 * (1 + (dst->header.extra % 16U)) - 2 * sizeof(uint16_t);
+}
+
+ssize_t
+jetex_packet_multi_response_add_oversized(struct jetex_header_multi_response *restrict dst,
+    uint32_t index)
+{
+
+	if (multi_response_append(dst, index, 0, JETEX_MULTI_OVERSIZED) == NULL) {
+		return -1;
+	}
+
+	return dst->header.len;
+}
+
+/* Returns the size of the multi-response record at bytes, or -1. */
+static ssize_t
+multi_response_record_size(const char *bytes, size_t remaining)
+{
+	uint16_t length;
+	size_t size;
+
+	if (remaining < 2 * sizeof(uint16_t)) {
+		return -1;
+	}
+
+	memcpy(&length, bytes + sizeof(uint16_t), sizeof(length));
+	size = 2 * sizeof(uint16_t);
+	if (length != JETEX_MULTI_OVERSIZED) {
+		size += length & ~JETEX_MULTI_FOUND;
+	}
+
+	return (size <= remaining) ? (ssize_t)size : -1;
+}
+
+int
+jetex_packet_multi_response_decode(struct jetex_multi_response *restrict dst,
+    const void *restrict packet, size_t packet_len)
+{
+	struct jetex_header header;
+	const char *bytes;
+	size_t remaining;
+
+	*dst = (struct jetex_multi_response) { .base_data = NULL };
+	bytes = packet;
+	remaining = packet_len;
+
+	IN(header);
+	if (packet_len > JETEX_MULTI_MAX_LEN ||
+	    header.type != 5 ||
+	    header.len != packet_len) {
+		return -1;
+	}
+
+	dst->correlation_key_offset = (uint32_t)(bytes - (const char *)packet);
+	dst->correlation_key_length = 8 * (1 + (header.extra % 16U));
+	ADV(dst->correlation_key_length);
+
+	dst->base_data = packet;
+	dst->next_offset = (uint32_t)(bytes - (const char *)packet);
+	dst->end_offset = (uint32_t)packet_len;
+	while (remaining > 0) {
+		ssize_t size;
+
+		size = multi_response_record_size(bytes, remaining);
+		if (size < 0) {
+			goto fail;
+		}
+
+		ADV((size_t)size);
+	}
+
+	return 0;
+
+fail:
+	*dst = (struct jetex_multi_response) { .base_data = NULL };
+	return -1;
+}
+
+int
+jetex_packet_multi_response_next(struct jetex_multi_response *restrict response,
+    struct jetex_multi_record *restrict record)
+{
+	const char *bytes;
+	uint16_t index;
+	uint16_t length;
+
+	/* decode validated every record. */
+	if (response->next_offset >= response->end_offset) {
+		return 0;
+	}
+
+	bytes = (const char *)response->base_data + response->next_offset;
+	memcpy(&index, bytes, sizeof(index));
+	memcpy(&length, bytes + sizeof(index), sizeof(length));
+	bytes += sizeof(index) + sizeof(length);
+
+	*record = (struct jetex_multi_record) {
+		.index = index,
+		.found = ((length & JETEX_MULTI_FOUND) != 0) ? 1 : 0,
+		.oversized = (length == JETEX_MULTI_OVERSIZED) ? 1 : 0,
+		.value = bytes,
+		.value_len = (length == JETEX_MULTI_OVERSIZED)
+		    ? 0 : length & ~JETEX_MULTI_FOUND
+	};
+
+	bytes += record->value_len;
+	response->next_offset = (uint32_t)(bytes - (const char *)response->base_data);
+	return 1;
+}
+
+ssize_t
+jetex_packet_scan_encode(struct jetex_header_scan *restrict dst,
+    const void *restrict correlation, size_t correlation_len,
+    const struct sockaddr *restrict addr, socklen_t addr_len,
+    const uint8_t table[static 16], const void *restrict start, size_t key_len,
+    uint64_t end, uint16_t limit)
+{
+	char *restrict bytes;
+	size_t remaining;
+	uint8_t tag;
+	int code;
+
+	*dst = (struct jetex_header_scan) { .header.len = 0 };
+	dst->header.type = 6;
+	bytes = &dst->data[0];
+	remaining = sizeof(dst->data);
+
+	code = multi_key_code(key_len);
+	if (code < 0) {
+		goto fail;
+	}
+
+	if (encode_correlation(&bytes, &remaining, &dst->header.extra,
+	    correlation, correlation_len) != 0 ||
+	    encode_destination(&bytes, &remaining, &dst->header.extra,
+	    addr, addr_len) != 0) {
+		goto fail;
+	}
+
+	tag = (uint8_t)code;
+	memcpy(ADV(16), &table[0], 16);
+	OUT(tag);
+	OUT(limit);
+	OUT(end);
+	memcpy(ADV(key_len), start, key_len);
+	dst->header.len = (uint16_t)(sizeof(dst->header) + (size_t)(bytes - &dst->data[0]));
+	return dst->header.len;
+
+fail:
+	*dst = (struct jetex_header_scan) { .header.len = 0 };
+	return -1;
+}
+
+int
+jetex_packet_scan_decode(struct jetex_scan *restrict dst,
+    const void *restrict packet, size_t packet_len,
+    const struct sockaddr *restrict src, socklen_t srclen)
+{
+	struct jetex_header header;
+	const char *bytes;
+	size_t remaining;
+	uint16_t limit;
+	uint8_t tag;
+
+	*dst = (struct jetex_scan) { .base_data = NULL };
+	bytes = packet;
+	remaining = packet_len;
+
+	IN(header);
+	if (packet_len > sizeof(struct jetex_header_scan) ||
+	    header.type != 6 ||
+	    header.len != packet_len) {
+		return -1;
+	}
+
+	dst->correlation_key_offset = (uint32_t)(bytes - (const char *)packet);
+	dst->correlation_key_length = 8 * (1 + (header.extra % 16U));
+	ADV(dst->correlation_key_length);
+
+	dst->base_data = packet;
+	{
+		ssize_t dstlen;
+
+		dstlen = decode_destination(&bytes, &remaining,
+		    header.extra >> 4U, src, srclen, &dst->dst);
+		if (dstlen < 0) {
+			goto fail;
+		}
+
+		dst->dstlen = (size_t)dstlen;
+	}
+
+	IN(dst->table_uuid);
+	IN(tag);
+	IN(limit);
+	IN(dst->end);
+	if ((tag & ~3U) != 0 || remaining != (8UL << tag)) {
+		goto fail;
+	}
+
+	dst->limit = limit;
+	dst->key_length = (uint32_t)remaining;
+	memcpy(&dst->start[0], bytes, remaining);
+	return 0;
+
+fail:
+	*dst = (struct jetex_scan) { .base_data = NULL };
+	return -1;
+}
+
+/* Offset of the sequence number, flags and next key in a response. */
+static size_t
+scan_response_state_offset(const struct jetex_header *header)
+{
+
+	return sizeof(*header) + 8 * (1 + (header->extra % 16U));
+}
+
+ssize_t
+jetex_packet_scan_response_init(struct jetex_header_scan_response *restrict dst,
+    const void *restrict correlation, size_t correlation_len,
+    size_t key_len, uint16_t sequence)
+{
+	char *restrict bytes;
+	size_t remaining;
+	uint16_t flags = 0;
+	int code;
+
+	dst->header = (struct jetex_header) { .type = 7 };
+	bytes = &dst->data[0];
+	remaining = sizeof(dst->data);
+
+	code = multi_key_code(key_len);
+	if (code < 0 ||
+	    encode_correlation(&bytes, &remaining, &dst->header.extra,
+	    correlation, correlation_len) != 0) {
+		goto fail;
+	}
+
+	dst->header.extra |= (uint8_t)((unsigned int)code << 4);
+	OUT(sequence);
+	OUT(flags);
+	memset(ADV(key_len), 0, key_len);
+	dst->header.len = (uint16_t)(sizeof(dst->header) + (size_t)(bytes - &dst->data[0]));
+	return dst->header.len;
+
+fail:
+	dst->header = (struct jetex_header) { .len = 0 };
+	return -1;
+}
+
+/*
+ * Appends a record for key with the given length field, and returns
+ * where its value_len-byte value goes; NULL if it doesn't fit.
+ */
+static void *
+scan_response_append(struct jetex_header_scan_response *restrict dst,
+    const void *restrict key, size_t value_len, uint16_t length)
+{
+	size_t used = dst->header.len;
+	size_t key_len = 8UL << (dst->header.extra >> 4U);
+	char *restrict bytes;
+	char *value;
+	size_t remaining;
+
+	if (used < scan_response_state_offset(&dst->header) ||
+	    used > JETEX_SCAN_MAX_LEN) {
+		return NULL;
+	}
+
+	bytes = (char *)dst + used;
+	remaining = JETEX_SCAN_MAX_LEN - used;
+	if (key_len + sizeof(length) + value_len > remaining) {
+		return NULL;
+	}
+
+	memcpy(ADV(key_len), key, key_len);
+	OUT(length);
+	value = ADV(value_len);
+	dst->header.len = (uint16_t)(bytes - (char *)dst);
+	return value;
+
+fail:
+	return NULL;
+}
+
+void *
+jetex_packet_scan_response_add(struct jetex_header_scan_response *restrict dst,
+    const void *restrict key, size_t value_len)
+{
+
+	if (value_len >= JETEX_SCAN_OVERSIZED) {
+		return NULL;
+	}
+
+	return scan_response_append(dst, key, value_len, (uint16_t)value_len);
+}
+
+size_t
+jetex_packet_scan_response_max_value(const struct jetex_header_scan_response *dst)
+{
+	size_t key_len = 8UL << (dst->header.extra >> 4U);
+
+	/* State, with the next key, then one record's key and length. */
+	return JETEX_SCAN_MAX_LEN - scan_response_state_offset(&dst->header) -
+	    2 * sizeof(uint16_t) - 2 * key_len - sizeof(uint16_t);
+}
+
+ssize_t
+jetex_packet_scan_response_add_oversized(struct jetex_header_scan_response *restrict dst,
+    const void *restrict key)
+{
+
+	if (scan_response_append(dst, key, 0, JETEX_SCAN_OVERSIZED) == NULL) {
+		return -1;
+	}
+
+	return dst->header.len;
+}
+
+void
+jetex_packet_scan_response_finish(struct jetex_header_scan_response *restrict dst,
+    uint16_t flags, const void *restrict next_key)
+{
+	char *state = (char *)dst + scan_response_state_offset(&dst->header);
+
+	memcpy(state + sizeof(uint16_t), &flags, sizeof(flags));
+	if ((flags & JETEX_SCAN_MORE) != 0 && next_key != NULL) {
+		memcpy(state + 2 * sizeof(uint16_t), next_key,
+		    8UL << (dst->header.extra >> 4U));
+	}
+
+	return;
+}
+
+int
+jetex_packet_scan_response_decode(struct jetex_scan_response *restrict dst,
+    const void *restrict packet, size_t packet_len)
+{
+	struct jetex_header header;
+	const char *bytes;
+	size_t remaining;
+
+	*dst = (struct jetex_scan_response) { .base_data = NULL };
+	bytes = packet;
+	remaining = packet_len;
+
+	IN(header);
+	if (packet_len > JETEX_SCAN_MAX_LEN ||
+	    header.type != 7 ||
+	    header.len != packet_len ||
+	    (header.extra >> 4U) > 3) {
+		return -1;
+	}
+
+	dst->correlation_key_offset = (uint32_t)(bytes - (const char *)packet);
+	dst->correlation_key_length = 8 * (1 + (header.extra % 16U));
+	ADV(dst->correlation_key_length);
+
+	dst->base_data = packet;
+	dst->key_length = (uint32_t)(8UL << (header.extra >> 4U));
+	IN(dst->sequence);
+	IN(dst->flags);
+	dst->next_key_offset = (uint32_t)(bytes - (const char *)packet);
+	ADV(dst->key_length);
+
+	dst->next_offset = (uint32_t)(bytes - (const char *)packet);
+	dst->end_offset = (uint32_t)packet_len;
+	while (remaining > 0) {
+		uint16_t length;
+
+		ADV(dst->key_length);
+		IN(length);
+		if (length != JETEX_SCAN_OVERSIZED) {
+			ADV(length);
+		}
+	}
+
+	return 0;
+
+fail:
+	*dst = (struct jetex_scan_response) { .base_data = NULL };
+	return -1;
+}
+
+int
+jetex_packet_scan_response_next(struct jetex_scan_response *restrict response,
+    struct jetex_scan_record *restrict record)
+{
+	const char *bytes;
+	uint16_t length;
+
+	/* decode validated every record. */
+	if (response->next_offset >= response->end_offset) {
+		return 0;
+	}
+
+	bytes = (const char *)response->base_data + response->next_offset;
+	memcpy(&length, bytes + response->key_length, sizeof(length));
+	*record = (struct jetex_scan_record) {
+		.key = bytes,
+		.value = bytes + response->key_length + sizeof(length),
+		.value_len = (length == JETEX_SCAN_OVERSIZED) ? 0 : length,
+		.oversized = (length == JETEX_SCAN_OVERSIZED) ? 1 : 0
+	};
+
+	bytes += response->key_length + sizeof(length) + record->value_len;
+	response->next_offset = (uint32_t)(bytes - (const char *)response->base_data);
+	return 1;
+}